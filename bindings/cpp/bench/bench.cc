@@ -0,0 +1,439 @@
+// Client benchmarks, one json object per line on stdout:
+//   ot_bench [--host HOST --port PORT] [--filter NAME] [--scale X]
+// Without --host the end-to-end scenarios run against an in-process mock
+// server, so they measure the client overhead only.
+
+#include "mock_server.h"
+#include "opentick.h"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+using namespace opentick;
+using namespace opentick::mock;
+using namespace std::chrono;
+
+static const std::string kInsert =
+    "insert into test(sec, interval, tm, open, high, low, close, v, vwap) "
+    "values(?, ?, ?, ?, ?, ?, ?, ?, ?)";
+static const std::string kSelect =
+    "select * from test where sec=? and interval=?";
+
+static std::string g_filter;
+
+static bool Wanted(const std::string& name) {
+  return name.find(g_filter) != std::string::npos;
+}
+
+// The same bar as a struct for the typed Insert/Select
+struct TypedBar {
+  int sec;
+  int interval;
+  Tm tm;
+  double open, high, low, close, v, vwap;
+};
+
+template <>
+struct opentick::Schema<TypedBar> {
+  static constexpr auto fields = std::make_tuple(
+      &TypedBar::sec, &TypedBar::interval, &TypedBar::tm, &TypedBar::open,
+      &TypedBar::high, &TypedBar::low, &TypedBar::close, &TypedBar::v,
+      &TypedBar::vwap);
+};
+
+static TypedBar MakeTypedBar(int i) {
+  auto tm = Tm(seconds(1500000000) + microseconds(i));
+  return TypedBar{1, 1, tm, 2.2, 2.4, 2.1, 2.3, 1000000, 2.25};
+}
+
+// bytes is the size of one encoded message if relevant
+static void Report(const std::string& name, const Histogram::Snapshot& s,
+                   std::uint64_t rows, double seconds,
+                   std::uint64_t bytes = 0) {
+  json j{{"benchmark", name},
+         {"ops", s.count},
+         {"rows", rows},
+         {"seconds", seconds},
+         {"ops_per_sec", s.count / seconds},
+         {"rows_per_sec", rows / seconds},
+         {"mean_ns", s.Mean()},
+         {"p50_ns", s.Percentile(50)},
+         {"p99_ns", s.Percentile(99)},
+         {"max_ns", s.max}};
+  if (bytes) j["bytes"] = bytes;
+  std::cout << j.dump() << std::endl;
+}
+
+// Records of s that came after before, max is kept as is
+static Histogram::Snapshot Since(Histogram::Snapshot s,
+                                 const Histogram::Snapshot& before) {
+  for (auto i = 0; i < Histogram::kBuckets && before.count; ++i) {
+    s.counts[i] -= before.counts[i];
+  }
+  s.count -= before.count;
+  s.sum -= before.sum;
+  return s;
+}
+
+// Times each of n calls of fn, fn returns the rows it processed
+template <typename F>
+static void Run(const std::string& name, int n, F&& fn,
+                std::uint64_t bytes = 0) {
+  if (!Wanted(name)) return;
+  Histogram h;
+  std::uint64_t rows = 0;
+  auto start = steady_clock::now();
+  for (auto i = 0; i < n; ++i) {
+    auto t = steady_clock::now();
+    rows += fn(i);
+    h.Record(NanosSince(t));
+  }
+  Report(name, h.Read(), rows, NanosSince(start) / 1e9, bytes);
+}
+
+static void BenchCodec(double scale) {
+  std::vector<std::uint8_t> buf;
+  auto args = Bar(0);
+  Run("encode_insert", 1000000 * scale, [&](int i) {
+    buf.clear();
+    EncodeFrame(buf, [&](BsonWriter& w) {
+      w.WriteCommand(i, "run", 0, args);
+    });
+    return 1;
+  });
+  Argss argss;
+  for (auto i = 0; i < 10000; ++i) argss.push_back(Bar(i));
+  Run("encode_batch_10000", 200 * scale, [&](int i) {
+    buf.clear();
+    EncodeFrame(buf, [&](BsonWriter& w) {
+      w.WriteCommand(i, "batch", 0, argss);
+    });
+    return argss.size();
+  });
+  std::vector<TypedBar> bars;
+  for (auto i = 0; i < 10000; ++i) bars.push_back(MakeTypedBar(i));
+  Run("encode_batch_10000_typed", 200 * scale, [&](int i) {
+    buf.clear();
+    EncodeFrame(buf, [&](BsonWriter& w) {
+      w.WriteCommand(i, "batch", 0,
+                     RowsSpan<TypedBar>{bars.data(), bars.data() + 10000});
+    });
+    return bars.size();
+  });
+  buf.clear();
+  BsonWriter w(buf);
+  auto start = w.Begin();
+  w.Write("0", std::int64_t(1));
+  w.Write("1", Argss(argss.begin(), argss.begin() + kSelectRows));
+  w.End(start);
+  Run(
+      "decode_columns_1000", 5000 * scale,
+      [&](int) {
+        Value v;
+        BsonReader(buf.data(), buf.size()).ReadReply(v);
+        return std::get<ColumnarResultSet>(v)->num_rows;
+      },
+      buf.size());
+  Run("decode_rows_1000", 2000 * scale, [&](int) {
+    Value v;
+    BsonReader(buf.data(), buf.size()).ReadReply(v);
+    return std::get<ColumnarResultSet>(v)->ToRows()->size();
+  });
+  Run("decode_structs_1000", 5000 * scale, [&](int) {
+    Value v;
+    BsonReader(buf.data(), buf.size()).ReadReply(v);
+    return ToStructs<TypedBar>(*std::get<ColumnarResultSet>(v)).size();
+  });
+  std::vector<std::uint8_t> block;
+  BsonWriter w2(block);
+  start = w2.Begin();
+  w2.Write("0", std::int64_t(1));
+  w2.WriteBinary(
+      "1", EncodeColumnar(Argss(argss.begin(), argss.begin() + kSelectRows)),
+      columnar::kSubtype);
+  w2.End(start);
+  Run(
+      "decode_columnar_1000", 5000 * scale,
+      [&](int) {
+        Value v;
+        BsonReader(block.data(), block.size()).ReadReply(v);
+        return std::get<ColumnarResultSet>(v)->num_rows;
+      },
+      block.size());
+  Argss named;
+  for (auto i = 0; i < kSelectRows; ++i) {
+    named.push_back(Args{"instrument-" + std::to_string(i), 1.5, i});
+  }
+  buf.clear();
+  start = w.Begin();
+  w.Write("0", std::int64_t(1));
+  w.Write("1", named);
+  w.End(start);
+  Run("decode_strings_1000", 5000 * scale, [&](int) {
+    Value v;
+    BsonReader(buf.data(), buf.size()).ReadReply(v);
+    return std::get<ColumnarResultSet>(v)->num_rows;
+  });
+}
+
+static Connection::Ptr Open(const std::string& host, int port) {
+  auto conn = Connect(host, port);
+  conn->Execute("create database if not exists test");
+  conn->Use("test");
+  conn->Execute(
+      "create table if not exists test(sec int, interval int, tm timestamp, "
+      "open double, high double, low double, close double, v double, vwap "
+      "double, primary key(sec, interval, tm))");
+  return conn;
+}
+
+static void BenchEndToEnd(const std::string& host, int port, double scale) {
+  if (Wanted("insert_sync")) {
+    auto conn = Open(host, port);
+    Run("insert_sync", 20000 * scale, [&](int i) {
+      conn->Execute(kInsert, Bar(i));
+      return 1;
+    });
+    conn->Close();
+  }
+  for (auto window : {0, 1000}) {
+    // per-request latencies come from the connection's own histogram, with a
+    // window the producer is held back instead of queueing all n at once
+    auto name = std::string("insert_async_fanout") +
+                (window ? "_window_" + std::to_string(window) : "");
+    if (!Wanted(name)) continue;
+    auto conn = Open(host, port);
+    WindowOptions options;
+    options.max_requests = window;
+    conn->SetWindow(options);
+    auto n = int(100000 * scale);
+    std::vector<Future> futs;
+    futs.reserve(n);
+    auto before = conn->Metrics().commands[kRun].latency_ns;
+    auto start = steady_clock::now();
+    for (auto i = 0; i < n; ++i) {
+      futs.push_back(conn->ExecuteAsync(kInsert, Bar(i)));
+    }
+    for (auto& f : futs) f->Get();
+    auto seconds = NanosSince(start) / 1e9;
+    auto s = Since(conn->Metrics().commands[kRun].latency_ns, before);
+    Report(name, s, n, seconds);
+    conn->Close();
+  }
+  if (Wanted("insert_async_callback")) {
+    auto conn = Open(host, port);
+    auto n = int(100000 * scale);
+    std::mutex m;
+    std::condition_variable cv;
+    auto left = n;
+    auto before = conn->Metrics().commands[kRun].latency_ns;
+    auto start = steady_clock::now();
+    for (auto i = 0; i < n; ++i) {
+      conn->ExecuteAsync(kInsert, Bar(i),
+                         [&](ColumnarResultSet, const std::string&) {
+                           std::lock_guard<std::mutex> lk(m);
+                           if (!--left) cv.notify_one();
+                         });
+    }
+    {
+      std::unique_lock<std::mutex> lk(m);
+      cv.wait(lk, [&]() { return !left; });
+    }
+    auto seconds = NanosSince(start) / 1e9;
+    auto s = Since(conn->Metrics().commands[kRun].latency_ns, before);
+    Report("insert_async_callback", s, n, seconds);
+    conn->Close();
+  }
+  if (Wanted("batch_insert_10000")) {
+    auto conn = Open(host, port);
+    Argss argss;
+    for (auto i = 0; i < 10000; ++i) argss.push_back(Bar(i));
+    Run("batch_insert_10000", 50 * scale, [&](int) {
+      conn->BatchInsert(kInsert, argss);
+      return argss.size();
+    });
+    std::vector<TypedBar> bars;
+    for (auto i = 0; i < 10000; ++i) bars.push_back(MakeTypedBar(i));
+    Run("batch_insert_10000_typed", 50 * scale, [&](int) {
+      conn->Insert(kInsert, bars);
+      return bars.size();
+    });
+    conn->Close();
+  }
+  if (Wanted("bulk_load")) {
+    // the 10000 rows of batch_insert_10000 as one columnar block, then a csv
+    // file of 100000 rows parsed and streamed 50000 rows per block
+    auto conn = Open(host, port);
+    ColumnarResult block;
+    block.num_rows = 10000;
+    block.cols.resize(9);
+    for (auto i = 0; i < 10000; ++i) {
+      auto bar = Bar(i);
+      for (auto j = 0; j < 9; ++j) {
+        auto& col = block.cols[j];
+        if (auto v = std::get_if<int>(&bar[j])) {
+          col.Append(Column::kInt64, *v);
+        } else if (auto v = std::get_if<Tm>(&bar[j])) {
+          col.Append(Column::kTm,
+                     duration_cast<nanoseconds>(v->time_since_epoch()).count());
+        } else {
+          col.Append(std::get<double>(bar[j]));
+        }
+      }
+    }
+    Run("bulk_load_10000", 50 * scale, [&](int) {
+      conn->LoadAsync(kInsert, block)->Get();
+      return block.num_rows;
+    });
+    auto path = (std::filesystem::temp_directory_path() / "ot_bench_load.csv")
+                    .string();
+    {
+      std::ofstream csv(path);
+      for (auto i = 0; i < 100000; ++i) {
+        csv << "1,1,1500000000." << i << ",2.2,2.4,2.1,2.3,1000000,2.25\n";
+      }
+    }
+    std::vector<Column::Type> types(9, Column::kDouble);
+    types[0] = types[1] = Column::kInt64;
+    types[2] = Column::kTm;
+    Run("bulk_load_csv_100000", 5 * scale, [&](int) {
+      return conn->LoadCsv(kInsert, path, types).rows;
+    });
+    std::filesystem::remove(path);
+    conn->Close();
+  }
+  if (Wanted("range_select")) {
+    auto conn = Open(host, port);
+    Run("range_select", 2000 * scale, [&](int) {
+      auto res = conn->Execute(kSelect, Args{1, 1});
+      return res ? res->size() : 0;
+    });
+    Run("range_select_columns", 2000 * scale, [&](int) {
+      auto res = conn->ExecuteAsync(kSelect, Args{1, 1})->GetColumns();
+      return res ? res->num_rows : 0;
+    });
+#ifdef OPENTICK_ZLIB
+    {
+      // bytes is what one reply takes on the wire
+      auto compressed = Open(host, port);
+      compressed->SetCompression();
+      auto before = compressed->Metrics().bytes_in;
+      Run("range_select_compressed", 2000 * scale, [&](int) {
+        auto res = compressed->ExecuteAsync(kSelect, Args{1, 1})->GetColumns();
+        return res ? res->num_rows : 0;
+      });
+      if (Wanted("range_select_compressed")) {
+        std::cout << json{{"benchmark", "range_select_compressed_bytes"},
+                          {"bytes", (compressed->Metrics().bytes_in - before) /
+                                        std::uint64_t(2000 * scale)}}
+                         .dump()
+                  << std::endl;
+      }
+      compressed->Close();
+    }
+#endif
+    Run("range_select_typed", 2000 * scale, [&](int) {
+      return conn->Select<TypedBar>(kSelect, Args{1, 1}).size();
+    });
+    // the same 1000-row window over and over, all but the first from cache
+    conn->SetResultCache(std::make_shared<ResultCache>(64 << 20));
+    Run("range_select_cached", 2000 * scale, [&](int) {
+      auto res = conn->ExecuteCachedAsync(kSelect, Args{1, 1})->GetColumns();
+      return res ? res->num_rows : 0;
+    });
+    conn->SetResultCache(nullptr);
+    conn->UseColumnarProtocol();
+    Run("range_select_columnar", 2000 * scale, [&](int) {
+      auto res = conn->ExecuteAsync(kSelect, Args{1, 1})->GetColumns();
+      return res ? res->num_rows : 0;
+    });
+    conn->Close();
+  }
+  if (Wanted("execute_many") || Wanted("select_many")) {
+    // 10 symbols of 1000 rows, the loop gathers rows the way test.cc used to
+    auto conn = Open(host, port);
+    Argss argss;
+    for (auto i = 0; i < 10; ++i) argss.push_back(Args{1, i});
+    Run("execute_many_10x1000_loop", 200 * scale, [&](int) {
+      std::vector<Future> futs;
+      for (auto& args : argss) {
+        futs.push_back(conn->ExecuteAsync(kSelect, args));
+      }
+      ResultSet::element_type rows;
+      for (auto& f : futs) {
+        auto res = f->Get();
+        if (res) rows.insert(rows.end(), res->begin(), res->end());
+      }
+      return rows.size();
+    });
+    Run("execute_many_10x1000", 200 * scale, [&](int) {
+      return conn->ExecuteMany(kSelect, argss)->num_rows;
+    });
+    Run("execute_many_10x1000_sorted", 200 * scale, [&](int) {
+      return conn->ExecuteMany(kSelect, argss, 2)->num_rows;
+    });
+    Run("select_many_10x1000", 200 * scale, [&](int) {
+      return conn->SelectMany(kSelect, argss)->num_rows;
+    });
+    conn->Close();
+  }
+  for (auto decoders : {0, 2}) {
+    // insert latency while another thread keeps a 10000-row select in flight
+    auto name = std::string("insert_behind_select") +
+                (decoders ? "_decoders" : "");
+    if (!Wanted(name)) continue;
+    auto conn = Open(host, port);
+    conn->SetDecodeThreads(decoders);
+    std::atomic<bool> stop = false;
+    std::thread selects([&]() {
+      auto sql = kSelect + " limit 10000";
+      while (!stop) conn->ExecuteAsync(sql, Args{1, 1})->GetColumns();
+    });
+    Run(name, 2000 * scale, [&](int i) {
+      conn->Execute(kInsert, Bar(i));
+      return 1;
+    });
+    stop = true;
+    selects.join();
+    conn->Close();
+  }
+  if (Wanted("stream_select")) {
+    // whole kStreamRows scans, a page is in flight while one is consumed
+    auto conn = Open(host, port);
+    Run("stream_select_1000", 20 * scale, [&](int) {
+      std::size_t rows = 0;
+      auto cursor = conn->Stream(kSelect, Args{1, 1}, 1000);
+      while (auto page = cursor->Next()) rows += page->num_rows;
+      return rows;
+    });
+    conn->Close();
+  }
+}
+
+int main(int argc, char** argv) {
+  std::string host;
+  int port = 1116;
+  double scale = 1;
+  for (auto i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--host")
+      host = argv[i + 1];
+    else if (opt == "--port")
+      port = atoi(argv[i + 1]);
+    else if (opt == "--filter")
+      g_filter = argv[i + 1];
+    else if (opt == "--scale")
+      scale = atof(argv[i + 1]);
+  }
+  BenchCodec(scale);
+  std::unique_ptr<MockServer> mock;
+  if (host.empty()) {
+    mock.reset(new MockServer);
+    host = "127.0.0.1";
+    port = mock->Port();
+  }
+  BenchEndToEnd(host, port, scale);
+  return 0;
+}
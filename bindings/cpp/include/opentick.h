@@ -1,21 +1,44 @@
 #ifndef OPENTICK_CONNECTION_H_
 #define OPENTICK_CONNECTION_H_
 
+#include <algorithm>
 #include <atomic>
-#include <boost/asio.hpp>
+#include <cctype>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <cstring>
 #include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <set>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include "boost/endian/conversion.hpp"
+#ifdef OPENTICK_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define OPENTICK_HAS_COROUTINES 1
+#endif
 
 #include "json.hpp"
 
@@ -24,61 +47,665 @@ namespace opentick {
 using json = nlohmann::json;
 
 typedef std::chrono::system_clock::time_point Tm;
+// Point in time a request is given up at, the default one means none
+typedef std::chrono::steady_clock::time_point Deadline;
 typedef std::variant<std::int64_t, std::uint64_t, std::int32_t, std::uint32_t,
                      bool, float, double, std::nullptr_t, std::string, Tm>
     ValueScalar;
 typedef std::vector<std::vector<ValueScalar>> ValuesVector;
 typedef std::shared_ptr<ValuesVector> ResultSet;
-typedef std::variant<ResultSet, ValueScalar> Value;
+
+// One column of a result set, the cells live in one contiguous typed array,
+// string cells included, so a reply costs a few allocations per column
+// rather than one per row or string
+struct Column {
+  enum Type : std::uint8_t {
+    kNull,
+    kInt64,
+    kDouble,
+    kTm,
+    kBool,
+    kString,
+    kMixed,
+  };
+  Type type = kNull;  // kNull until the first non-null cell
+  std::size_t size = 0;
+  std::vector<std::int64_t> ints;    // kInt64, kBool, kTm (ns since epoch)
+  std::vector<double> doubles;       // kDouble
+  std::string chars;                 // kString, the cells back to back
+  std::vector<std::uint32_t> ends;   // kString, end of each cell in chars
+  std::vector<ValueScalar> values;   // kMixed, cells of different types
+  std::vector<std::uint64_t> nulls;  // bitmap, bit set for a null cell
+  bool IsNull(std::size_t row) const {
+    if (type == kNull) return true;
+    return row / 64 < nulls.size() && (nulls[row / 64] >> (row % 64)) & 1;
+  }
+  // kString cell without a copy, valid as long as the column
+  std::string_view String(std::size_t row) const {
+    auto begin = row ? ends[row - 1] : 0;
+    return std::string_view(chars.data() + begin, ends[row] - begin);
+  }
+  ValueScalar Get(std::size_t row) const;
+  // Makes room for rows cells as large as the ones so far on average
+  void Reserve(std::size_t rows);
+  void AppendNull();
+  void Append(Type t, std::int64_t v);
+  void Append(double v);
+  void Append(std::string_view v);
+  void AppendCell(const Column& other, std::size_t row);
+  // Rows [begin, end) of other, array by array if of the same type
+  void Append(const Column& other, std::size_t begin, std::size_t end);
+
+ private:
+  bool Switch(Type t);
+};
+
+struct ColumnarResult {
+  std::size_t num_rows = 0;
+  std::vector<Column> cols;
+  ValueScalar Get(std::size_t row, std::size_t col) const {
+    return cols[col].Get(row);
+  }
+  ResultSet ToRows() const;  // row view for the ValuesVector users
+  std::string cursor;  // resume key of a paged select, empty on its last page
+};
+typedef std::shared_ptr<ColumnarResult> ColumnarResultSet;
+
+typedef std::variant<ResultSet, ValueScalar, ColumnarResultSet> Value;
 struct AbstractFuture {
-  virtual ResultSet Get(double timeout = 0) = 0;  // timeout in seconds
+  // timeout in seconds, of this wait only, the request stays pending after it
+  // unless it has a deadline, see Connection::SetTimeout
+  virtual ResultSet Get(double timeout = 0) = 0;
+  virtual ColumnarResultSet GetColumns(double timeout = 0) = 0;
+  // Calls fn once, possibly on the io thread, when Get will not block, returns
+  // false without calling it if that is the case already
+  virtual bool OnReady(std::function<void()> fn) { return false; }
 };
 typedef std::shared_ptr<AbstractFuture> Future;
 typedef std::vector<ValueScalar> Args;
 typedef std::vector<Args> Argss;
 
+// Inverse of the columnar reply decoding, the block of a "load" request
+inline std::string EncodeColumnBlock(const ColumnarResult& res);
+
+// Totals of a bulk load as of the last block replied to
+struct LoadProgress {
+  std::size_t rows = 0;    // committed
+  std::size_t blocks = 0;  // replied to
+  std::size_t bytes = 0;   // of the input file consumed
+  double seconds = 0;      // since the load started
+  double RowsPerSecond() const { return seconds > 0 ? rows / seconds : 0; }
+};
+
+struct LoadOptions {
+  std::size_t block_rows = 50000;  // rows per "load" request of LoadCsv
+  std::size_t max_in_flight = 4;   // blocks awaiting their reply
+  char delimiter = ',';
+  bool header = false;  // the first csv line is skipped
+  // called on the loading thread each time a block is replied to
+  std::function<void(const LoadProgress&)> progress;
+};
+
+// Sends one block of EncodeColumnBlock, e.g. Connection::LoadBlockAsync
+typedef std::function<Future(std::string_view block)> BlockLoader;
+// Streams the rows of a memory-mapped csv file through load with up to
+// options.max_in_flight blocks in flight. types has one column type per
+// field: kInt64, kDouble, kTm as seconds since epoch with an optional
+// fraction, kBool as 1/0/true/false or kString, fields may be double-quoted,
+// an empty unquoted field is null. Stops at the first failed block and
+// throws once the others are replied to.
+inline LoadProgress LoadCsv(const std::string& path,
+                            const std::vector<Column::Type>& types,
+                            const LoadOptions& options,
+                            const BlockLoader& load);
+// The same for a file of [uint32 little-endian size][block] frames
+inline LoadProgress LoadFile(const std::string& path,
+                             const LoadOptions& options,
+                             const BlockLoader& load);
+
+// Columns of a struct for the typed Insert and Select of Connection, in the
+// order of the sql placeholders or select list, e.g.
+//   template <>
+//   struct opentick::Schema<Bar> {
+//     static constexpr auto fields = std::make_tuple(&Bar::sec, &Bar::tm, ...);
+//   };
+// Fields are arithmetic, std::string or Tm.
+template <typename T>
+struct Schema;
+
+// Structs of the rows of res, column by column straight from the typed
+// arrays, null cells leave the field value-initialized
+template <typename T>
+std::vector<T> ToStructs(const ColumnarResult& res);
+
+// Log-linear histogram in the spirit of HdrHistogram, every value lands in a
+// bucket within 1/8 of it, recording is lock free
+class Histogram {
+ public:
+  static constexpr int kSubBits = 3;
+  static constexpr int kSub = 1 << kSubBits;
+  static constexpr int kBuckets = (64 - kSubBits + 1) * kSub;
+  struct Snapshot {
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+    std::vector<std::uint64_t> counts;  // kBuckets entries if count > 0
+    double Mean() const { return count ? double(sum) / count : 0; }
+    // Highest value equivalent to the p-th percentile, p in [0, 100]
+    std::uint64_t Percentile(double p) const;
+    void Merge(const Snapshot& other);
+    json ToJson() const;
+  };
+  void Record(std::uint64_t v);
+  Snapshot Read() const;
+  static int Index(std::uint64_t v);
+  static std::uint64_t Lower(int index);
+
+ private:
+  std::atomic<std::uint64_t> counts_[kBuckets] = {};
+  std::atomic<std::uint64_t> count_ = 0;
+  std::atomic<std::uint64_t> sum_ = 0;
+  std::atomic<std::uint64_t> max_ = 0;
+};
+
+inline std::uint64_t NanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Records the nanoseconds elapsed in its scope
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Histogram& h)
+      : h_(h), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { h_.Record(NanosSince(start_)); }
+
+ private:
+  Histogram& h_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+enum Command { kRun, kBatch, kPrepare, kUse, kMany, kLoad, kNumCommands };
+static const char* const kCommandNames[kNumCommands] = {
+    "run", "batch", "prepare", "use", "many", "load"};
+
+// Counters of one connection, updated by the caller and io threads
+struct ConnectionMetrics {
+  struct PerCommand {
+    std::atomic<std::uint64_t> requests = 0;
+    std::atomic<std::uint64_t> errors = 0;
+    Histogram latency_ns;  // registered to reply
+  };
+  PerCommand commands[kNumCommands];
+  std::atomic<std::uint64_t> bytes_in = 0;
+  std::atomic<std::uint64_t> bytes_out = 0;
+  std::atomic<std::uint64_t> frames_in = 0;
+  std::atomic<std::uint64_t> frames_out = 0;
+  std::atomic<std::uint64_t> queued_bytes = 0;  // not handed to the socket yet
+  std::atomic<std::uint64_t> max_queued_bytes = 0;
+  std::atomic<std::uint64_t> reconnects = 0;
+  std::atomic<std::uint64_t> timeouts = 0;  // requests past their deadline
+  Histogram write_bytes;  // bytes per gathered socket write
+  Histogram encode_ns;
+  Histogram decode_ns;
+};
+
+// Point-in-time copy of ConnectionMetrics, see Connection::Metrics
+struct MetricsSnapshot {
+  struct PerCommand {
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0;
+    Histogram::Snapshot latency_ns;
+  };
+  PerCommand commands[kNumCommands];
+  std::uint64_t bytes_in = 0;
+  std::uint64_t bytes_out = 0;
+  std::uint64_t frames_in = 0;
+  std::uint64_t frames_out = 0;
+  std::uint64_t queued_bytes = 0;
+  std::uint64_t max_queued_bytes = 0;
+  std::uint64_t reconnects = 0;
+  std::uint64_t timeouts = 0;
+  Histogram::Snapshot write_bytes;
+  Histogram::Snapshot encode_ns;
+  Histogram::Snapshot decode_ns;
+  std::uint64_t in_flight = 0;  // requests waiting for their reply
+  std::uint64_t unclaimed_bytes = 0;
+  void Merge(const MetricsSnapshot& other);
+  json ToJson() const;
+};
+
+// Completion slot of one request, filled in directly by the io thread
+struct FutureState {
+  void Set(const Value& v);
+  std::mutex m;
+  std::condition_variable cv;
+  bool done = false;
+  bool consumed = false;
+  Value value;
+  std::function<void(const Value&)> callback;  // invoked once by Set
+  std::size_t bytes = 0;  // unclaimed reply size, guarded by owner's m_store_
+  int command = -1;       // Command whose latency is recorded, -1 for none
+  std::chrono::steady_clock::time_point registered;
+  Deadline deadline;  // failed with "Timeout" and forgotten once passed
+  // Request kept to be sent again after reconnecting, guarded by m_store_,
+  // with the sql to prepare again if it has a prepared id at id_offset
+  std::vector<std::uint8_t> frame;
+  std::string sql;
+  std::size_t id_offset = 0;
+};
+typedef std::shared_ptr<FutureState> FutureStatePtr;
+typedef std::function<void(int id, const std::string& error)> PrepareCallback;
+// Completion handler of a request, error is empty on success, result is null
+// for replies without rows
+typedef std::function<void(ColumnarResultSet result, const std::string& error)>
+    Callback;
+// Runs a completion handler elsewhere, e.g. posts it to a thread pool,
+// handlers without one run on the io thread and must not block
+typedef std::function<void(std::function<void()>)> Executor;
+struct FutureImpl;
+class Cursor;
+class Subscription;
+
+// FoundationDB rejects transactions above 10MB,
+// https://apple.github.io/foundationdb/known-limitations.html, the server
+// runs each "batch" in one transaction, the tuple-packed rows take about as
+// much room as their bson, so client-built batches stay under half of it
+static constexpr std::size_t kMaxBatchBytes = 5000000;
+
+// Whether sql starts with the lower-case keyword, in any case
+inline bool IsStatement(const std::string& sql, const char* keyword) {
+  auto n = strlen(keyword);
+  auto i = sql.find_first_not_of(" \t\r\n");
+  if (i == std::string::npos || sql.size() - i < n) return false;
+  return std::equal(sql.begin() + i, sql.begin() + i + n, keyword,
+                    [](char a, char b) { return std::tolower(a) == b; });
+}
+
+inline bool IsInsert(const std::string& sql) {
+  return IsStatement(sql, "insert");
+}
+
+inline bool IsSelect(const std::string& sql) {
+  return IsStatement(sql, "select");
+}
+
+// Length bit of a compressed frame, whose payload is the uint32 length of the
+// original body and then its zlib stream, see server.go
+static constexpr std::uint32_t kCompressedFrame = 0x80000000;
+static constexpr std::uint32_t kMaxInflatedFrame = 1 << 30;
+template <typename F>
+inline void EncodeFrame(std::vector<std::uint8_t>& buf, F&& encode);
+inline void CompressFrame(std::vector<std::uint8_t>& buf, std::size_t n0);
+inline void InflateFrame(const std::uint8_t* data, std::size_t n,
+                         std::vector<std::uint8_t>& out);
+
+struct CoalesceOptions {
+  std::size_t max_rows = 1000;
+  std::size_t max_bytes = 1000000;  // clamped to kMaxBatchBytes
+  unsigned max_delay_us = 1000;     // 0 means flushed by size only
+};
+
+// Byte-bounded LRU of select results over settled data, e.g. closed
+// historical windows, keyed by sql and args and shareable by connections.
+// Results are shared rather than copied and must not be modified. Entries
+// older than ttl seconds are dropped when looked up, 0 keeps them until
+// evicted or invalidated.
+class ResultCache {
+ public:
+  typedef std::shared_ptr<ResultCache> Ptr;
+  explicit ResultCache(std::size_t max_bytes, double ttl = 0)
+      : max_bytes_(max_bytes), ttl_(ttl) {}
+  struct Entry {
+    ColumnarResultSet columns;
+    ResultSet Rows();  // row view built on first use, then shared
+    std::size_t bytes = 0;  // of columns, the row view is not counted
+    std::chrono::steady_clock::time_point expiry;
+
+   private:
+    std::once_flag once_;
+    ResultSet rows_;
+  };
+  typedef std::shared_ptr<Entry> EntryPtr;
+  static std::string Key(const std::string& sql, const Args& args);
+  EntryPtr Find(const std::string& key);
+  // Results of requests sent before generation changed are not stored, so an
+  // invalidation is not undone by a reply in flight
+  EntryPtr Insert(const std::string& key, ColumnarResultSet columns,
+                  std::uint64_t generation);
+  std::uint64_t Generation() const { return generation_; }
+  void Invalidate(const std::string& sql, const Args& args);
+  void Invalidate(const std::string& sql);  // with any args
+  void Clear();
+  std::size_t Bytes() const;
+  std::uint64_t Hits() const { return hits_; }
+  std::uint64_t Misses() const { return misses_; }
+
+ private:
+  typedef std::list<std::pair<std::string, EntryPtr>> Lru;
+  void Erase(Lru::iterator it);
+  mutable std::mutex m_;
+  std::size_t max_bytes_;
+  double ttl_;
+  std::size_t bytes_ = 0;
+  Lru lru_;  // most recently used first
+  std::unordered_map<std::string, Lru::iterator> index_;
+  std::atomic<std::uint64_t> generation_ = 0;
+  std::atomic<std::uint64_t> hits_ = 0;
+  std::atomic<std::uint64_t> misses_ = 0;
+};
+
+struct WindowOptions {
+  enum Admission {
+    kBlock,  // the caller waits for room
+    kFail,   // the request fails at once, retry from Connection::OnCapacity
+  };
+  std::size_t max_requests = 0;  // awaiting their reply, 0 for no limit
+  std::size_t max_bytes = 0;  // encoded but not written yet, 0 for no limit
+  Admission admission = kBlock;
+};
+
+struct ReconnectOptions {
+  // In-flight requests sent again on the new session, the others fail with
+  // the error of the lost one. kReplayAll resends writes too, inserts
+  // overwrite rows of the same primary key so only sql that is not safe to
+  // run twice needs care. Coalesced inserts are never resent.
+  enum Replay { kReplayNone, kReplaySelects, kReplayAll };
+  unsigned min_delay_ms = 100;  // first retry, doubled up to max_delay_ms
+  unsigned max_delay_ms = 10000;
+  unsigned max_attempts = 0;  // then it gives up, 0 retries forever
+  Replay replay = kReplayNone;
+};
+
 class Connection : public std::enable_shared_from_this<Connection> {
  public:
   typedef std::shared_ptr<Connection> Ptr;
+  ~Connection();
   bool IsConnected() const;
   void Use(const std::string& dbName);
   Future ExecuteAsync(const std::string& sql, const Args& args = Args{});
   ResultSet Execute(const std::string& sql, const Args& args = Args{});
   Future BatchInsertAsync(const std::string& sql, const Argss& argss);
   void BatchInsert(const std::string& sql, const Argss& argss);
+  // Fails with "Timeout" at deadline (steady_clock) if no reply came by then,
+  // a late reply is dropped
+  Future ExecuteAsync(const std::string& sql, const Args& args,
+                      Deadline deadline);
+  // The server runs point reads, range reads and batches of a connection
+  // under separate concurrency budgets, and starts the requests waiting on
+  // one in the order of their priority (default 0, higher first)
+  Future ExecuteAsync(const std::string& sql, const Args& args, int priority,
+                      Deadline deadline = {});
+  // Complete by calling callback instead of through a Future
+  void ExecuteAsync(const std::string& sql, const Args& args,
+                    Callback callback, Executor executor = nullptr);
+  void BatchInsertAsync(const std::string& sql, const Argss& argss,
+                        Callback callback, Executor executor = nullptr);
+  // Sends the select once per parameter set, pipelined under one prepared id,
+  // and gathers the replies into one result, column arrays appended as
+  // blocks. sort_column >= 0 merges the rows on that column instead of
+  // appending the replies in order, each must be sorted by it already, as the
+  // rows of one symbol are by tm.
+  Future ExecuteManyAsync(const std::string& sql, const Argss& argss,
+                          int sort_column = -1);
+  ColumnarResultSet ExecuteMany(const std::string& sql, const Argss& argss,
+                                int sort_column = -1);
+  // ExecuteManyAsync as one "many" request, the server reads all the ranges
+  // concurrently in one transaction, one snapshot, and replies to each
+  // parameter set as it was sent alone. Not replayed on reconnect.
+  Future SelectManyAsync(const std::string& sql, const Argss& argss,
+                         int sort_column = -1);
+  ColumnarResultSet SelectMany(const std::string& sql, const Argss& argss,
+                               int sort_column = -1);
+  // Inserts the rows of block, one column per placeholder of the insert sql,
+  // as one "load" request. The server sorts them by primary key and commits
+  // them in parallel transactions of about 1MB each, so a failed load may be
+  // partly committed, and replies [[rows, transactions, bytes]] committed.
+  Future LoadAsync(const std::string& sql, const ColumnarResult& block);
+  // A block encoded by EncodeColumnBlock already
+  Future LoadBlockAsync(const std::string& sql, std::string_view block);
+  // The free LoadCsv and LoadFile through LoadBlockAsync
+  LoadProgress LoadCsv(const std::string& sql, const std::string& path,
+                       const std::vector<Column::Type>& types,
+                       const LoadOptions& options = {});
+  LoadProgress LoadFile(const std::string& sql, const std::string& path,
+                        const LoadOptions& options = {});
+  // Calls back with a null result once subscribed, then with the rows of the
+  // select committed through this server from then on, in commit order unless
+  // SetDecodeThreads reorders them. The where clause takes only = conditions
+  // on a primary key prefix. An error ends the subscription, e.g. falling
+  // behind the server's queue or a lost socket, it is not redone on
+  // reconnect. Returns the id to Unsubscribe with.
+  int Subscribe(const std::string& sql, const Args& args, Callback callback,
+                Executor executor = nullptr);
+  void Unsubscribe(int id);
+  // The pushed blocks queued for Subscription::Next instead
+  std::shared_ptr<Subscription> Subscribe(const std::string& sql,
+                                          const Args& args = Args{});
+  // ExecuteAsync for selects over data that no longer changes, served from
+  // the result cache if the same sql and args were read before
+  Future ExecuteCachedAsync(const std::string& sql, const Args& args = Args{});
+  // Opt-in cache of ExecuteCachedAsync, null turns it off
+  void SetResultCache(ResultCache::Ptr cache);
+  // Typed rows of a struct described by Schema<T>, encoded and decoded
+  // without ValueScalar, inserts are chunked as BatchInsertAsync does
+  template <typename T>
+  Future InsertAsync(const std::string& sql, const std::vector<T>& rows);
+  template <typename T>
+  void Insert(const std::string& sql, const std::vector<T>& rows);
+  template <typename T>
+  std::vector<T> Select(const std::string& sql, const Args& args = Args{});
+  // Pages through a select without a limit clause, chunk_rows rows per page
+  // in primary key order, or in reverse order if negative
+  std::shared_ptr<Cursor> Stream(const std::string& sql, const Args& args,
+                                 int chunk_rows);
   int Prepare(const std::string& sql);
+  // Calls back with the prepared id, right away if sql is cached, otherwise
+  // from the io thread, concurrent callers share one in-flight prepare
+  void PrepareAsync(const std::string& sql, PrepareCallback callback);
   void Close();
+  // Cap on the bytes of replies received but not yet claimed by Future::Get,
+  // the oldest unclaimed results are dropped beyond it, 0 means no limit
+  void SetMaxUnclaimedBytes(std::size_t n) { max_unclaimed_bytes_ = n; }
+  std::size_t UnclaimedBytes() const { return unclaimed_bytes_; }
+  // Opt-in, single-row inserts of ExecuteAsync are buffered per statement and
+  // sent as one "batch" once max_rows, max_bytes or max_delay_us is reached,
+  // each caller's future completes with the batch reply
+  void SetCoalescing(bool enable, const CoalesceOptions& options = {});
+  void FlushCoalesced();
+  // BatchInsertAsync splits argss into pipelined chunks of about this many
+  // encoded bytes, clamped to kMaxBatchBytes
+  void SetMaxBatchBytes(std::size_t n) {
+    max_batch_bytes_ = std::min(std::max<std::size_t>(n, 1), kMaxBatchBytes);
+  }
+  // Opt-in, reply frames of at least min_bytes are decoded by n threads of
+  // their own while the io thread keeps reading, so that small replies do not
+  // queue behind large selects and results complete out of order. Heartbeats
+  // and smaller frames are still handled on the io thread. Call at most once.
+  void SetDecodeThreads(int n, std::size_t min_bytes = 4096);
+  // Asks the server to send result sets in its columnar format, typed column
+  // blocks with int64 ns timestamps that decode with a memcpy per column,
+  // servers without it keep replying bson
+  void UseColumnarProtocol();
+  // Frames of at least min_bytes are zlib compressed both ways, for readers
+  // far from the server, 0 turns it off. Throws unless built with
+  // OPENTICK_ZLIB defined and zlib linked.
+  void SetCompression(std::size_t min_bytes = 4096);
+  // Opt-in, a lost socket is reconnected in the background with exponential
+  // backoff instead of failing every request from then on. The new session
+  // redoes use and the protocol negotiation, prepares the cached statements
+  // again and resends the in-flight requests options.replay allows, requests
+  // made meanwhile are queued behind them.
+  void SetReconnect(bool enable, const ReconnectOptions& options = {});
+  // Bounds the requests awaiting a reply and the bytes queued for the socket,
+  // requests of ExecuteAsync, Stream pages and each chunk of BatchInsertAsync
+  // and InsertAsync beyond it are held back as options.admission says.
+  // Requests made on the io or decoder threads, e.g. by completion handlers,
+  // are always admitted since waiting there would stall the replies.
+  void SetWindow(const WindowOptions& options);
+  // Calls fn once, possibly on the io thread, when the window has room again,
+  // returns false without calling it if it has room already
+  bool OnCapacity(std::function<void()> fn);
+  // Deadline of the requests the window applies to that do not bring their
+  // own, seconds after they are made, 0 for none. A request past it fails
+  // with "Timeout", leaves the window and its late reply is dropped.
+  void SetTimeout(double seconds);
+  // Cheap enough to scrape periodically, ToJson() for export
+  MetricsSnapshot Metrics();
 
  protected:
   Connection(const std::string& addr, int port);
+  static void Destroy(Connection* conn);
   void ReadHead();
-  void ReadBody(unsigned len);
-  template <typename T>
-  void Send(T&& msg);
+  void ReadBody(unsigned len, bool compressed = false);
+  // Sends a frame that is not bson, to negotiate the protocol
+  void SendRaw(const std::string& body);
+  void Decode(const std::uint8_t* data, std::size_t len);
+  void Broken(const std::string& error);
+  void Lost(int session, const std::string& error);
+  void ArmReconnect();
+  void Reconnect();
+  void Reconnected();
+  void Resume();
+  void GiveUp(const std::string& error);
+  bool Replayable(const std::string& sql) const;
+  void Keep(int ticker, const std::string& sql,
+            const std::vector<std::uint8_t>& frame, std::size_t id_offset);
+  // Serializes one frame in place at the end of msg_out_buf_,
+  // encode(BsonWriter&) writes the payload. A frame with a prepared id
+  // passes the prepared_epoch_ it was found in and is dropped, returning
+  // false, if a reconnect has reset the prepared ids since.
+  template <typename F>
+  bool Send(F&& encode, int epoch = -1);
+  // Queues a complete frame encoded beforehand, without copying it
+  bool SendFrame(std::vector<std::uint8_t>&& frame, int epoch = -1);
+  void ScheduleWrite();
+  void Queued(std::size_t bytes);
   void Write();
-  void Notify(int, const Value&);
+  void Notify(int, const Value&, std::size_t bytes = 0);
+  bool Push(int ticker, const Value& value);  // false if not a subscription
+  void EndSubscriptions(const std::string& error);
+  // With admitted, the request goes through the window and is only to be
+  // sent if *admitted is set
+  std::shared_ptr<FutureImpl> NewFuture(int ticker, Command command,
+                                        bool* admitted = nullptr,
+                                        Deadline deadline = {});
+  bool Register(int ticker, FutureStatePtr state, int command = -1,
+                bool admit = false);
+  bool HasRoom() const;
+  bool OnIoThread() const;
+  void WindowFreed();
+  void EraseDeadline(int ticker, const FutureState& state);
+  void ArmDeadlineTimer();
+  void ExpireDeadlines();
+  void Release(int ticker, FutureState& state);
+  void OnPrepared(const std::string& sql, const Value& value);
+  int FindPrepared(const std::string& sql, int* epoch = nullptr);
+  template <typename F>
+  void WhenPrepared(const std::string& sql, int ticker, F&& send);
+  template <typename A>
+  void SendPrepared(const std::string& sql, int ticker, const char* cmd,
+                    const A& args, bool keep = true);
+  struct CoalescedRows {
+    std::vector<std::uint8_t> rows;  // bson elements of the "3" array
+    std::vector<int> tickers;
+    std::size_t last_row_bytes = 0;
+  };
+  void SendRun(const std::string& sql, int ticker, const Args& args,
+               int priority = 0);
+  template <typename R>
+  std::size_t RowsPerChunk(const std::vector<R>& rows) const;
+  template <typename R>
+  Future SendBatch(const std::string& sql, const std::vector<R>& rows);
+  // Page of a Stream resuming right after cursor, from the start if empty
+  Future PageAsync(const std::string& sql, const Args& args,
+                   const std::string& cursor);
+  void Coalesce(const std::string& sql, int ticker, const Args& args);
+  void SendCoalesced(const std::string& sql, CoalescedRows& rows);
+  void ArmCoalesceTimer();
 
  private:
   std::vector<std::uint8_t> msg_in_buf_;
-  std::vector<std::uint8_t> msg_out_buf_;
-  std::vector<std::uint8_t> outbox_;
+  std::vector<std::uint8_t> zip_in_buf_;  // compressed body, inflated in place
+  std::atomic<std::size_t> compress_min_ = 0;  // 0 if not compressing
+  std::atomic<bool> columnar_ = false;
+  std::mutex m_out_;
+  std::vector<std::uint8_t> msg_out_buf_;          // frames serialized in place
+  std::vector<std::vector<std::uint8_t>> frames_;  // queued before msg_out_buf_
+  std::vector<std::vector<std::uint8_t>> outbox_;  // being written
+  std::vector<std::uint8_t> spare_;  // recycled for msg_out_buf_
+  bool writing_ = false;
+  bool broken_ = false;
   boost::asio::io_service io_service_;
   boost::asio::io_service::work worker_;
   boost::asio::ip::tcp::socket socket_;
+  boost::asio::steady_timer coalesce_timer_;
+  boost::asio::ip::tcp::endpoint endpoint_;
+  boost::asio::steady_timer reconnect_timer_;
+  boost::asio::steady_timer deadline_timer_;
   std::thread thread_;
   std::atomic<int> ticker_counter_ = 0;
-  std::condition_variable cv_;
-  std::mutex m_cv_;
+  std::mutex m_store_;
   std::mutex m_;
-  std::map<std::string, int> prepared_;
-  std::map<int, Value> store_;
+  struct PreparedStmt {
+    int id = -1;  // -1 while the prepare is in flight
+    std::vector<PrepareCallback> waiters;
+  };
+  std::map<std::string, PreparedStmt> prepared_;
+  // bumped under m_ by Lost along with the reset of the prepared ids
+  std::atomic<int> prepared_epoch_ = 0;
+  std::unordered_map<int, FutureStatePtr> store_;  // pending requests
+  // handlers of the pushes to subscriptions by ticker, guarded by m_store_
+  std::unordered_map<int, std::function<void(const Value&)>> subscriptions_;
+  std::atomic<std::size_t> num_subscriptions_ = 0;
+  std::deque<std::weak_ptr<FutureState>> unclaimed_;
+  std::atomic<std::size_t> unclaimed_bytes_ = 0;
+  std::atomic<std::size_t> max_unclaimed_bytes_ = 0;
+  WindowOptions window_;  // guarded by m_store_
+  std::condition_variable window_cv_;
+  std::vector<std::function<void()>> capacity_callbacks_;  // by m_store_
+  std::atomic<std::size_t> window_waiters_ = 0;  // blocked or called back
+  std::atomic<std::int64_t> timeout_ns_ = 0;
+  std::multimap<Deadline, int> deadlines_;  // of store_, guarded by m_store_
+  Deadline deadline_armed_ = Deadline::max();  // io thread only
+  std::string error_;  // set once the connection is broken
+  std::atomic<std::size_t> max_batch_bytes_ = kMaxBatchBytes;
+  std::atomic<bool> coalescing_ = false;
+  std::mutex m_coalesce_;
+  CoalesceOptions coalesce_options_;
+  std::map<std::string, CoalescedRows> coalesced_;
+  bool coalesce_timer_armed_ = false;
+  ConnectionMetrics metrics_;
+  ResultCache::Ptr cache_;  // guarded by m_
+  std::string db_;          // guarded by m_, the last Use
+  ReconnectOptions reconnect_options_;  // guarded by m_
+  std::atomic<bool> reconnect_ = false;
+  std::atomic<int> replay_ = ReconnectOptions::kReplayNone;
+  std::atomic<bool> reconnecting_ = false;
+  std::atomic<bool> closed_ = false;  // by Close, never reconnected
+  // io thread only, session_ is bumped whenever the socket is lost so that
+  // the handlers of the old one can tell
+  int session_ = 0;
+  unsigned reconnect_attempts_ = 0;
+  unsigned reconnect_delay_ms_ = 0;
+  std::vector<std::string> reprepare_;  // prepared on the new session
+  boost::asio::io_service decode_service_;
+  boost::asio::io_service::work decode_worker_;
+  std::vector<std::thread> decoders_;
+  std::atomic<std::size_t> min_pooled_decode_bytes_ = 0;  // 0 if no decoders_
+  std::mutex m_decode_;
+  std::size_t decoding_ = 0;  // frames handed to decoders_
+  bool decode_broken_ = false;
+  std::string decode_error_;  // reported once decoding_ drops to 0
   friend class FutureImpl;
+  friend class Cursor;
   friend Ptr Connect(const std::string&, int, const std::string&);
 };
 
 inline Connection::Ptr Connect(const std::string& addr, int port,
                                const std::string& db_name = "") {
-  Connection::Ptr conn(new Connection(addr, port));
+  Connection::Ptr conn(new Connection(addr, port), &Connection::Destroy);
   conn->ReadHead();
   if (db_name.size()) {
     conn->Use(db_name);
@@ -95,23 +722,251 @@ class Exception : public std::exception {
   std::string m_;
 };
 
+// Streaming reader of the bson replies, decodes straight into Value without
+// building a json tree, result sets come out columnar
+class BsonReader {
+ public:
+  BsonReader(const std::uint8_t* data, std::size_t n)
+      : p_(data), end_(data + n) {}
+  std::int64_t ReadReply(Value& value);  // returns the ticker
+
+ private:
+  void Need(std::size_t n) const {
+    if (std::size_t(end_ - p_) < n) throw Exception("Truncated bson");
+  }
+  template <typename T>
+  T Read() {
+    Need(sizeof(T));
+    T v;
+    memcpy(&v, p_, sizeof(T));
+    p_ += sizeof(T);
+    return boost::endian::little_to_native(v);
+  }
+  double ReadDouble() {
+    auto v = Read<std::uint64_t>();
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+  }
+  const char* ReadKey();
+  std::string_view ReadString();  // points into the frame
+  void Skip(std::uint8_t type);
+  bool ReadInt(std::uint8_t type, std::int64_t& v);
+  bool ReadTm(std::int64_t& v);
+  ColumnarResultSet ReadRows();
+  void ReadCell(std::uint8_t type, Column& col);
+  ColumnarResultSet ReadColumnar();
+  ColumnarResultSet ReadColumnBlock();
+  template <typename T>
+  void ReadArray(std::vector<T>& v, std::size_t n);
+  const std::uint8_t* p_;
+  const std::uint8_t* end_;
+};
+
+// Rows [begin, end) of an Argss or of a vector of Schema structs
+template <typename R>
+struct RowsSpan {
+  const R* begin;
+  const R* end;
+};
+typedef RowsSpan<Args> ArgssSpan;
+
+// Args of a paged select and the resume key returned with the previous page
+struct PageArgs {
+  const Args& args;
+  const std::string& cursor;
+};
+
+// Args of a request and its priority on the server
+struct PriorityArgs {
+  const Args& args;
+  int priority;
+};
+
+// Array whose elements are bson encoded already
+struct BsonRawArray {
+  const std::vector<std::uint8_t>& elements;
+};
+
+// Args of a "load" request, an array of one block of EncodeColumnBlock
+struct ColumnBlock {
+  std::string_view data;
+};
+
+// Writes bson documents straight from Args/Argss without building json,
+// integers are encoded as int32 when they fit, the same as nlohmann::json
+class BsonWriter {
+ public:
+  explicit BsonWriter(std::vector<std::uint8_t>& out) : out_(out) {}
+  std::size_t Begin();  // starts a document or an array, returns its offset
+  void End(std::size_t start);
+  void Write(const char* key, std::int64_t v);
+  void Write(const char* key, double v);
+  void Write(const char* key, bool v);
+  void Write(const char* key, std::nullptr_t);
+  void Write(const char* key, const std::string& v);
+  void Write(const char* key, const Tm& v);
+  void Write(const char* key, const ValueScalar& v);
+  void Write(const char* key, const Args& args);
+  void Write(const char* key, const Argss& argss);
+  template <typename R>
+  void Write(const char* key, const RowsSpan<R>& rows);
+  // One row as an array, Args or a struct described by Schema
+  void WriteRow(const char* key, const Args& args) { Write(key, args); }
+  template <typename T>
+  void WriteRow(const char* key, const T& row);
+  // Any arithmetic type, string, Tm or null
+  template <typename V>
+  void WriteCell(const char* key, const V& v);
+  void Write(const char* key, const BsonRawArray& array);
+  void Write(const char* key, const ColumnBlock& block);
+  void WriteBinary(const char* key, std::string_view v,
+                   std::uint8_t subtype = 0);
+  // Always int32, returns the offset of the value to patch it later
+  std::size_t WriteInt32(const char* key, std::int32_t v);
+  void Patch(std::size_t offset, std::int32_t v);
+  // {"0": ticker, "1": cmd, "2": sql or prepared id, "3": args, "4": resume
+  // key of PageArgs}, returns the offset of the prepared id if target is an int
+  template <typename T, typename A>
+  std::size_t WriteCommand(int ticker, const char* cmd, const T& target,
+                           const A& args);
+
+ private:
+  void Put(const void* data, std::size_t n) {
+    auto p = static_cast<const std::uint8_t*>(data);
+    out_.insert(out_.end(), p, p + n);
+  }
+  template <typename T>
+  void PutLittle(T v) {
+    v = boost::endian::native_to_little(v);
+    Put(&v, sizeof(v));
+  }
+  void Head(std::uint8_t type, const char* key) {
+    out_.push_back(type);
+    Put(key, strlen(key) + 1);
+  }
+  std::vector<std::uint8_t>& out_;
+};
+
+// Aggregate future of a BatchInsertAsync split into several chunks
+struct BatchFuture : public AbstractFuture {
+  struct Chunk {
+    std::size_t begin;  // rows [begin, end) of the argss
+    std::size_t end;
+    Future future;
+    std::string error;  // empty if the chunk was inserted
+  };
+  ResultSet Get(double timeout = 0) override;  // throws if any chunk failed
+  ColumnarResultSet GetColumns(double timeout = 0) override;
+  // Waits for all chunks and returns the failed ones
+  std::vector<Chunk> Failed(double timeout = 0);
+  bool OnReady(std::function<void()> fn) override;
+  std::vector<Chunk> chunks;
+  static std::string Error(const std::vector<Chunk>& failed, std::size_t n);
+
+ private:
+  void Wait(double timeout);
+  bool done_ = false;
+  std::mutex m_;
+};
+
+// Future of Connection::ExecuteManyAsync, the rows of all parameter sets in
+// one result, in their order or merged on a sort column
+struct ManyFuture : public AbstractFuture {
+  ResultSet Get(double timeout = 0) override;
+  // throws the first error, prefixed by the index of its parameter set
+  ColumnarResultSet GetColumns(double timeout = 0) override;
+  bool OnReady(std::function<void()> fn) override;
+  std::vector<Future> parts;
+  int sort_column = -1;
+
+ private:
+  std::mutex m_;
+  std::vector<ColumnarResultSet> results_;  // of the parts got so far
+  ColumnarResultSet result_;
+  bool done_ = false;
+};
+
+// Future of Connection::ExecuteCachedAsync, ready at once on a cache hit, on
+// a miss the reply is added to the cache by the first Get
+struct CachedFuture : public AbstractFuture {
+  ResultSet Get(double timeout = 0) override;
+  ColumnarResultSet GetColumns(double timeout = 0) override;
+  bool OnReady(std::function<void()> fn) override;
+  ResultCache::Ptr cache;
+  std::string key;
+  std::uint64_t generation = 0;
+  Future pending;  // null on a hit, left as set so that OnReady needs no lock
+  ResultCache::EntryPtr entry;  // guarded by m_ on a miss
+
+ private:
+  ResultCache::EntryPtr Fetch(double timeout);
+  std::mutex m_;
+};
+
+// Pulls the pages of Connection::Stream, the next page is requested once the
+// current one is handed out, so at most one page is held in flight
+class Cursor {
+ public:
+  Cursor(Connection::Ptr conn, const std::string& sql, const Args& args)
+      : conn_(std::move(conn)), sql_(sql), args_(args) {}
+  // Next page of rows, null once the range is exhausted
+  ColumnarResultSet Next(double timeout = 0);
+
+ private:
+  Connection::Ptr conn_;
+  std::string sql_;
+  Args args_;
+  Future pending_;
+  friend class Connection;
+};
+
+// Blocks pushed to a Connection::Subscribe, for readers that poll
+class Subscription {
+ public:
+  ~Subscription() { Cancel(); }
+  // Next block of rows, null after timeout seconds without one (0 waits
+  // forever), throws the error that ended the subscription once the blocks
+  // before it are read
+  ColumnarResultSet Next(double timeout = 0);
+  void Cancel();  // Unsubscribe, Next throws "Unsubscribed" from then on
+
+ private:
+  std::weak_ptr<Connection> conn_;
+  int id_ = -1;
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::deque<ColumnarResultSet> blocks_;
+  std::string error_;
+  friend class Connection;
+};
+
 struct FutureImpl : public AbstractFuture {
   ResultSet Get(double timeout = 0) override;
+  ColumnarResultSet GetColumns(double timeout = 0) override;
+  bool OnReady(std::function<void()> fn) override;
   Value Get_(double timeout = 0);
-  FutureImpl(int t, Connection::Ptr c) : ticker(t), conn(c) {}
+  FutureImpl(int t, Connection::Ptr c)
+      : ticker(t), conn(c), state(std::make_shared<FutureState>()) {}
+  ~FutureImpl() { conn->Release(ticker, *state); }
   int ticker;
   Connection::Ptr conn;
+  FutureStatePtr state;
 };
 
 inline Connection::Connection(const std::string& ip, int port)
     : worker_(io_service_),
       socket_(io_service_),
-      thread_([this]() { io_service_.run(); }) {
+      coalesce_timer_(io_service_),
+      reconnect_timer_(io_service_),
+      deadline_timer_(io_service_),
+      thread_([this]() { io_service_.run(); }),
+      decode_worker_(decode_service_) {
   try {
-    boost::asio::ip::tcp::endpoint end_pt(
+    endpoint_ = boost::asio::ip::tcp::endpoint(
         boost::asio::ip::address::from_string(ip), port);
     std::cerr << "OpenTick: connecting ..." << std::endl;
-    socket_.connect(end_pt);
+    socket_.connect(endpoint_);
     boost::asio::ip::tcp::no_delay option(true);
     socket_.set_option(option);
   } catch (std::exception& e) {
@@ -119,11 +974,82 @@ inline Connection::Connection(const std::string& ip, int port)
   }
 }
 
+// Never on the io thread or a decoder, see Destroy
+inline Connection::~Connection() {
+  io_service_.stop();
+  decode_service_.stop();
+  if (thread_.joinable()) thread_.join();
+  for (auto& thread : decoders_) {
+    if (thread.joinable()) thread.join();
+  }
+}
+
+// Deleter of the Ptr of Connect. The last reference is often dropped by a
+// handler on the io thread or a decoder, which cannot join itself and still
+// runs the services the members own, so it is destroyed on a thread of its
+// own then.
+inline void Connection::Destroy(Connection* conn) {
+  if (conn->OnIoThread())
+    std::thread([conn]() { delete conn; }).detach();
+  else
+    delete conn;
+}
+
+inline std::vector<std::uint8_t> RawFrame(const std::string& body) {
+  unsigned n = boost::endian::native_to_little(unsigned(body.size()));
+  std::vector<std::uint8_t> frame(4 + body.size());
+  memcpy(frame.data(), &n, 4);
+  memcpy(frame.data() + 4, body.data(), body.size());
+  return frame;
+}
+
+inline void Connection::SendRaw(const std::string& body) {
+  SendFrame(RawFrame(body));
+}
+
+inline void Connection::UseColumnarProtocol() {
+  columnar_ = true;
+  SendRaw("protocol=columnar");
+}
+
+inline void Connection::SetCompression(std::size_t min_bytes) {
+#ifndef OPENTICK_ZLIB
+  throw Exception("OpenTick is built without zlib, define OPENTICK_ZLIB");
+#endif
+  SendRaw("compress=" + std::to_string(min_bytes));
+  compress_min_ = min_bytes;
+}
+
+inline void Connection::SetDecodeThreads(int n, std::size_t min_bytes) {
+  if (n <= 0 || decoders_.size()) return;
+  for (auto i = 0; i < n; ++i) {
+    decoders_.emplace_back([this]() { decode_service_.run(); });
+  }
+  min_pooled_decode_bytes_ = std::max<std::size_t>(min_bytes, 1);
+}
+
 inline bool Connection::IsConnected() const { return socket_.is_open(); }
 
+inline void Connection::SetReconnect(bool enable,
+                                     const ReconnectOptions& options) {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    reconnect_options_ = options;
+    reconnect_options_.min_delay_ms = std::max(options.min_delay_ms, 1u);
+    reconnect_options_.max_delay_ms =
+        std::max(options.max_delay_ms, reconnect_options_.min_delay_ms);
+  }
+  replay_ = enable ? options.replay : ReconnectOptions::kReplayNone;
+  reconnect_ = enable;
+}
+
 inline void Connection::Close() {
+  closed_ = true;
+  FlushCoalesced();
   auto self = shared_from_this();
   io_service_.post([self]() {
+    self->reconnect_timer_.cancel();
+    self->deadline_timer_.cancel();
     boost::system::error_code ignoredCode;
     try {
       self->socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both,
@@ -135,248 +1061,3515 @@ inline void Connection::Close() {
 }
 
 inline void Connection::Use(const std::string& dbName) {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    db_ = dbName;
+  }
   auto ticker = ++ticker_counter_;
-  Send(json::to_bson(json{{"0", ticker}, {"1", "use"}, {"2", dbName}}));
-  FutureImpl(ticker, shared_from_this()).Get();
+  auto f = NewFuture(ticker, kUse);
+  std::vector<std::uint8_t> frame;
+  EncodeFrame(frame, [&](BsonWriter& w) {
+    w.WriteCommand(ticker, "use", dbName, nullptr);
+  });
+  if (reconnect_) Keep(ticker, "", frame, 0);
+  SendFrame(std::move(frame));
+  f->Get();
 }
 
 inline void Connection::ReadHead() {
   if (msg_in_buf_.size() < 4) msg_in_buf_.resize(4);
   auto self = shared_from_this();
+  auto session = session_;
   boost::asio::async_read(socket_, boost::asio::buffer(msg_in_buf_, 4),
-                          [=](const boost::system::error_code& e, size_t) {
+                          [self, session](const boost::system::error_code& e,
+                                          size_t) {
+                            // a head read just before the socket was lost
+                            if (session != self->session_) return;
                             if (e) {
                               std::cerr << "OpenTick: connection closed: "
                                         << e.message() << std::endl;
-                              self->Notify(-1, e.message());
+                              self->Lost(session, e.message());
                               return;
                             }
                             unsigned n;
-                            memcpy(&n, msg_in_buf_.data(), 4);
+                            memcpy(&n, self->msg_in_buf_.data(), 4);
                             n = boost::endian::little_to_native(n);
-                            if (n)
+                            self->metrics_.bytes_in += 4;
+                            if (!n) ++self->metrics_.frames_in;
+                            if (n & kCompressedFrame)
+                              self->ReadBody(n & ~kCompressedFrame, true);
+                            else if (n)
                               self->ReadBody(n);
                             else
                               self->ReadHead();
                           });
 }
 
-inline void Connection::ReadBody(unsigned len) {
-  msg_in_buf_.resize(len);
+inline void Connection::ReadBody(unsigned len, bool compressed) {
+  auto& buf = compressed ? zip_in_buf_ : msg_in_buf_;
+  buf.resize(len);
   auto self = shared_from_this();
+  auto session = session_;
   boost::asio::async_read(
-      socket_, boost::asio::buffer(msg_in_buf_, len),
-      [self, len](const boost::system::error_code& e, size_t) {
+      socket_, boost::asio::buffer(buf, len),
+      [self, session, len, compressed](const boost::system::error_code& e,
+                                       size_t) mutable {
+        if (session != self->session_) return;
         if (e) {
           std::cerr << "OpenTick: connection closed" << std::endl;
-          self->Notify(-1, e.message());
+          self->Lost(session, e.message());
           return;
         }
+        self->metrics_.bytes_in += len;
+        ++self->metrics_.frames_in;
+        if (compressed) {
+          auto& zip = self->zip_in_buf_;
+          try {
+            InflateFrame(zip.data(), zip.size(), self->msg_in_buf_);
+          } catch (Exception& e) {
+            std::cerr << "OpenTick: " << e.what() << std::endl;
+            self->Lost(session, e.what());
+            return;
+          }
+          len = self->msg_in_buf_.size();
+        }
         if (len == 1 && self->msg_in_buf_[0] == 'H') {
-          self->Send(std::string(""));
+          self->Send([](BsonWriter&) {});
           self->ReadHead();
           return;
         }
-        try {
-          auto j = json::from_bson(self->msg_in_buf_);
-          auto ticker = j["0"].get<std::int64_t>();
-          auto tmp = j["1"];
-          if (tmp.is_string()) {
-            self->Notify(ticker, tmp.get<std::string>());
-          } else if (tmp.is_number_integer()) {
-            self->Notify(ticker, tmp.get<std::int64_t>());
-          } else if (tmp.is_number_float()) {
-            self->Notify(ticker, tmp.get<double>());
-          } else if (tmp.is_boolean()) {
-            self->Notify(ticker, tmp.get<bool>());
-          } else if (tmp.is_null()) {
-            self->Notify(ticker, ValueScalar(nullptr));
-          } else {
-            auto v = std::make_shared<ValuesVector>();
-            v->resize(tmp.size());
-            for (auto i = 0u; i < tmp.size(); ++i) {
-              auto& tmp2 = tmp[i];
-              auto& v2 = (*v)[i];
-              v2.resize(tmp2.size());
-              for (auto j = 0u; j < tmp2.size(); ++j) {
-                auto& v3 = v2[j];
-                auto tmp3 = tmp2[j];
-                if (tmp3.is_string()) {
-                  v3 = tmp3.get<std::string>();
-                } else if (tmp3.is_number_integer()) {
-                  v3 = tmp3.get<std::int64_t>();
-                } else if (tmp3.is_number_float()) {
-                  v3 = tmp3.get<double>();
-                } else if (tmp3.is_boolean()) {
-                  v3 = tmp3.get<bool>();
-                } else if (tmp3.is_array() && tmp3.size() == 2) {
-                  auto sec = tmp3[0].get<std::int64_t>();
-                  auto nsec = tmp3[1].get<std::int64_t>();
-                  v3 = std::chrono::system_clock::from_time_t(sec) +
-                       std::chrono::nanoseconds(nsec);
-                } else {
-                  v3 = nullptr;
-                }
-              }
-            }
-            self->Notify(ticker, v);
-          }
-        } catch (nlohmann::detail::parse_error& e) {
-          std::cerr << "OpenTick: invalid bson" << std::endl;
-        } catch (nlohmann::detail::exception& e) {
-          std::cerr << "OpenTick: bson error: " << e.what() << std::endl;
+        auto min_bytes = self->min_pooled_decode_bytes_.load();
+        if (!min_bytes || len < min_bytes) {
+          self->Decode(self->msg_in_buf_.data(), len);
+          self->ReadHead();
+          return;
+        }
+        auto buf = std::make_shared<std::vector<std::uint8_t>>();
+        buf->swap(self->msg_in_buf_);
+        {
+          std::lock_guard<std::mutex> lk(self->m_decode_);
+          ++self->decoding_;
         }
+        self->decode_service_.post([self, buf]() {
+          self->Decode(buf->data(), buf->size());
+          bool broken;
+          {
+            std::lock_guard<std::mutex> lk(self->m_decode_);
+            broken = !--self->decoding_ && self->decode_broken_;
+          }
+          if (broken) self->Notify(-1, self->decode_error_);
+        });
         self->ReadHead();
       });
 }
 
-template <typename T>
-inline void Connection::Send(T&& msg) {
-  if (!IsConnected()) return;
-  auto self = shared_from_this();
-  io_service_.post([msg = std::move(msg), self]() {
-    auto& buf = self->msg_out_buf_;
-    auto n0 = buf.size();
-    buf.resize(n0 + 4 + msg.size());
-    unsigned n = boost::endian::native_to_little(msg.size());
-    memcpy(reinterpret_cast<void*>(buf.data() + n0), &n, 4);
-    memcpy(reinterpret_cast<void*>(buf.data() + n0 + 4), msg.data(),
-           msg.size());
-    if (self->outbox_.size()) return;
-    self->Write();
-  });
+inline void Connection::Decode(const std::uint8_t* data, std::size_t len) {
+  try {
+    Value v;
+    std::int64_t ticker;
+    {
+      ScopedTimer timer(metrics_.decode_ns);
+      ticker = BsonReader(data, len).ReadReply(v);
+    }
+    if (std::holds_alternative<ColumnarResultSet>(v))
+      Notify(ticker, v, len);
+    else
+      Notify(ticker, v);
+  } catch (Exception& e) {
+    std::cerr << "OpenTick: invalid bson: " << e.what() << std::endl;
+  }
 }
 
-inline void Connection::Write() {
-  assert(outbox_.empty());
-  outbox_.swap(msg_out_buf_);
-  auto self = shared_from_this();
-  boost::asio::async_write(
-      socket_, boost::asio::buffer(outbox_, outbox_.size()),
-      [self](const boost::system::error_code& e, std::size_t) {
-        if (e) {
-          std::cerr << "OpenTick: failed to send message. Error code: "
-                    << e.message() << std::endl;
-          self->Notify(-1, e.message());
-        } else {
-          self->outbox_.clear();
-          if (self->msg_out_buf_.size()) self->Write();
-        }
-      });
+// Fails all pending requests, after the replies still being decoded if any
+inline void Connection::Broken(const std::string& error) {
+  {
+    std::lock_guard<std::mutex> lk(m_decode_);
+    if (decoding_) {
+      decode_broken_ = true;
+      decode_error_ = error;
+      return;
+    }
+  }
+  Notify(-1, error);
 }
 
-inline int Connection::Prepare(const std::string& sql) {
+// On the io thread when the socket of session fails, the first report wins
+inline void Connection::Lost(int session, const std::string& error) {
+  if (session != session_) return;
+  ++session_;
+  boost::system::error_code ignored;
+  if (!reconnect_ || closed_) {
+    {
+      std::lock_guard<std::mutex> lk(m_out_);
+      broken_ = true;
+      frames_.clear();
+      msg_out_buf_.clear();
+    }
+    socket_.close(ignored);
+    Broken(error);
+    return;
+  }
+  reconnecting_ = true;
   {
+    // prepared ids are per session, a no-op waiter marks the prepare of each
+    // statement as in flight so that requests made meanwhile wait for it.
+    // Ended ahead of the clearing of the writes, a frame with an old id is
+    // either cleared or refused by Send.
     std::lock_guard<std::mutex> lock(m_);
-    auto it = prepared_.find(sql);
-    if (it != prepared_.end()) return it->second;
+    ++prepared_epoch_;
+    reprepare_.clear();
+    for (auto& pair : prepared_) {
+      auto& stmt = pair.second;
+      reprepare_.push_back(pair.first);
+      stmt.id = -1;
+      if (stmt.waiters.empty())
+        stmt.waiters.push_back([](int, const std::string&) {});
+    }
   }
-  auto ticker = ++ticker_counter_;
-  Send(json::to_bson(json{{"0", ticker}, {"1", "prepare"}, {"2", sql}}));
-  FutureImpl f(ticker, shared_from_this());
-  auto id = std::get<std::int64_t>(std::get<ValueScalar>(f.Get_()));
+  {
+    // writes are held until reconnected
+    std::lock_guard<std::mutex> lk(m_out_);
+    writing_ = true;
+    frames_.clear();
+    msg_out_buf_.clear();
+    metrics_.queued_bytes = 0;
+  }
+  socket_.close(ignored);
+  std::vector<FutureStatePtr> failed;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    for (auto it = store_.begin(); it != store_.end();) {
+      auto& state = it->second;
+      if (state->command == kPrepare) {
+        it = store_.erase(it);  // prepared again
+      } else if (state->frame.empty()) {
+        EraseDeadline(it->first, *state);
+        failed.push_back(std::move(state));
+        it = store_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto& state : failed) {
+    if (state->command >= 0) ++metrics_.commands[state->command].errors;
+    state->Set(ValueScalar(error));
+  }
+  EndSubscriptions(error);
+  WindowFreed();
   {
     std::lock_guard<std::mutex> lock(m_);
-    prepared_.emplace(sql, id);
+    reconnect_delay_ms_ = reconnect_options_.min_delay_ms;
   }
-  return id;
+  reconnect_attempts_ = 0;
+  ArmReconnect();
 }
 
-inline Value FutureImpl::Get_(double timeout) {
-  std::unique_lock<std::mutex> lk(conn->m_cv_);
-  auto start = std::chrono::system_clock::now();
-  while (true) {
-    auto it1 = conn->store_.find(ticker);
-    if (it1 != conn->store_.end()) {
-      if (auto ptr = std::get_if<ValueScalar>(&it1->second)) {
-        if (auto ptr2 = std::get_if<std::string>(ptr)) throw Exception(*ptr2);
-      }
-      return it1->second;
+inline void Connection::ArmReconnect() {
+  auto self = shared_from_this();
+  reconnect_timer_.expires_after(
+      std::chrono::milliseconds(reconnect_delay_ms_));
+  reconnect_timer_.async_wait([self](const boost::system::error_code&) {
+    if (self->closed_)
+      self->GiveUp("Connection closed");
+    else
+      self->Reconnect();
+  });
+}
+
+inline void Connection::Reconnect() {
+  std::cerr << "OpenTick: reconnecting ..." << std::endl;
+  auto self = shared_from_this();
+  socket_.async_connect(endpoint_, [self](const boost::system::error_code& e) {
+    if (!e && !self->closed_) {
+      self->Reconnected();
+      return;
     }
-    auto it2 = conn->store_.find(-1);
-    if (it2 != conn->store_.end()) {
-      throw Exception(
-          std::get<std::string>(std::get<ValueScalar>(it2->second)));
+    boost::system::error_code ignored;
+    self->socket_.close(ignored);
+    if (self->closed_) {
+      self->GiveUp("Connection closed");
+      return;
     }
-    using namespace std::chrono_literals;
-    conn->cv_.wait_for(lk, 1ms);
-    if (timeout > 0 &&
-        (std::chrono::system_clock::now() - start).count() >= timeout) {
-      throw Exception("Timeout");
+    std::cerr << "OpenTick: failed to reconnect: " << e.message() << std::endl;
+    ReconnectOptions options;
+    {
+      std::lock_guard<std::mutex> lock(self->m_);
+      options = self->reconnect_options_;
     }
+    if (options.max_attempts &&
+        ++self->reconnect_attempts_ >= options.max_attempts) {
+      self->GiveUp(e.message());
+      return;
+    }
+    self->reconnect_delay_ms_ =
+        std::min(self->reconnect_delay_ms_ * 2, options.max_delay_ms);
+    self->ArmReconnect();
+  });
+}
+
+// The new session starts with use, alone while the writes are still held:
+// the server runs the requests of a connection concurrently, so the
+// prepares made before its reply could resolve without the database
+inline void Connection::Reconnected() {
+  std::cerr << "OpenTick: reconnected" << std::endl;
+  ++metrics_.reconnects;
+  boost::system::error_code ignored;
+  socket_.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+  ReadHead();
+  std::string db;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    db = db_;
   }
-  return {};
+  if (db.empty()) {
+    Resume();
+    return;
+  }
+  auto self = shared_from_this();
+  auto session = session_;
+  auto ticker = ++ticker_counter_;
+  auto state = std::make_shared<FutureState>();
+  state->callback = [self, session, db](const Value& v) {
+    auto ptr = std::get_if<ValueScalar>(&v);
+    auto error = ptr ? std::get_if<std::string>(ptr) : nullptr;
+    if (error) std::cerr << "OpenTick: use " << db << ": " << *error
+                         << std::endl;
+    // also called when failed by the loss of session
+    self->io_service_.post([self, session]() {
+      if (session == self->session_) self->Resume();
+    });
+  };
+  Register(ticker, state);
+  auto frame = std::make_shared<std::vector<std::uint8_t>>();
+  EncodeFrame(*frame, [&](BsonWriter& w) {
+    w.WriteCommand(ticker, "use", db, nullptr);
+  });
+  boost::asio::async_write(
+      socket_, boost::asio::buffer(*frame),
+      [self, session, frame](const boost::system::error_code& e,
+                             std::size_t written) {
+        self->metrics_.bytes_out += written;
+        if (!e || session != self->session_) return;
+        std::cerr << "OpenTick: failed to send message. Error code: "
+                  << e.message() << std::endl;
+        self->Lost(session, e.message());
+      });
 }
 
-inline ResultSet FutureImpl::Get(double timeout) {
-  auto v = Get_(timeout);
-  if (auto ptr = std::get_if<ResultSet>(&v)) return *ptr;
-  return {};
+// Then the protocol negotiation, the prepares and the replayed requests
+// without a prepared id, ahead of anything queued meanwhile. The others are
+// patched with the id their prepare returns.
+inline void Connection::Resume() {
+  auto self = shared_from_this();
+  std::vector<std::vector<std::uint8_t>> frames;
+  auto add = [&](auto&& encode) {
+    frames.emplace_back();
+    EncodeFrame(frames.back(), encode);
+  };
+  if (columnar_) frames.push_back(RawFrame("protocol=columnar"));
+  if (auto min_bytes = compress_min_.load())
+    frames.push_back(RawFrame("compress=" + std::to_string(min_bytes)));
+  for (auto& sql : reprepare_) {
+    auto ticker = ++ticker_counter_;
+    auto state = std::make_shared<FutureState>();
+    state->callback = [self, sql](const Value& v) { self->OnPrepared(sql, v); };
+    Register(ticker, state, kPrepare);
+    add([&](BsonWriter& w) {
+      w.WriteCommand(ticker, "prepare", sql, nullptr);
+    });
+  }
+  reprepare_.clear();
+  struct Replay {
+    int ticker;
+    std::string sql;
+    std::vector<std::uint8_t> frame;
+    std::size_t id_offset;
+  };
+  std::vector<Replay> prepared;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    for (auto& pair : store_) {
+      auto& state = *pair.second;
+      if (state.frame.empty()) continue;
+      if (state.sql.empty())
+        frames.push_back(state.frame);
+      else
+        prepared.push_back(
+            {pair.first, state.sql, state.frame, state.id_offset});
+    }
+  }
+  auto min_bytes = compress_min_.load();
+  {
+    std::lock_guard<std::mutex> lk(m_out_);
+    for (auto& frame : frames) {
+      if (min_bytes && frame.size() >= min_bytes + 4) CompressFrame(frame, 0);
+      Queued(frame.size());
+    }
+    frames_.insert(frames_.begin(), std::make_move_iterator(frames.begin()),
+                   std::make_move_iterator(frames.end()));
+    reconnecting_ = false;
+    writing_ = false;
+    ScheduleWrite();
+  }
+  for (auto& r : prepared) {
+    WhenPrepared(r.sql, r.ticker,
+                 [this, offset = r.id_offset,
+                  frame = std::move(r.frame)](int id, int epoch) mutable {
+                   BsonWriter(frame).Patch(offset, id);
+                   return SendFrame(std::move(frame), epoch);
+                 });
+  }
 }
 
-inline void Connection::Notify(int ticker, const Value& value) {
-  std::lock_guard<std::mutex> lk(m_cv_);
-  store_[ticker] = value;
-  cv_.notify_all();
+// Fails everything pending once reconnecting is given up or closed
+inline void Connection::GiveUp(const std::string& error) {
+  {
+    std::lock_guard<std::mutex> lk(m_out_);
+    broken_ = true;
+    frames_.clear();
+    msg_out_buf_.clear();
+    writing_ = false;
+  }
+  reconnecting_ = false;
+  std::vector<PrepareCallback> waiters;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    for (auto& pair : prepared_) {
+      for (auto& callback : pair.second.waiters)
+        waiters.push_back(std::move(callback));
+    }
+    prepared_.clear();
+  }
+  Notify(-1, error);
+  for (auto& callback : waiters) callback(-1, error);
 }
 
-void ConvertArgs(const Args& args, json& jargs) {
-  for (auto& v : args) {
-    std::visit(
-        [&jargs](auto&& v2) {
-          using T = std::decay_t<decltype(v2)>;
-          if constexpr (std::is_same_v<T, Tm>) {
-            auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                         v2.time_since_epoch())
-                         .count();
-            jargs.push_back(json{d / 1000000000, d % 1000000000});
-          } else {
-            jargs.push_back(v2);
-          }
-        },
-        v);
+inline bool Connection::Replayable(const std::string& sql) const {
+  switch (replay_) {
+    case ReconnectOptions::kReplayAll:
+      return true;
+    case ReconnectOptions::kReplaySelects:
+      return IsSelect(sql);
+    default:
+      return false;
   }
 }
 
-inline Future Connection::ExecuteAsync(const std::string& sql,
-                                       const Args& args) {
-  auto prepared = -1;
-  json jargs;
-  if (args.size()) {
-    ConvertArgs(args, jargs);
-    prepared = Prepare(sql);
+inline void Connection::Keep(int ticker, const std::string& sql,
+                             const std::vector<std::uint8_t>& frame,
+                             std::size_t id_offset) {
+  std::lock_guard<std::mutex> lk(m_store_);
+  auto it = store_.find(ticker);
+  if (it == store_.end()) return;
+  auto& state = *it->second;
+  state.frame = frame;
+  state.sql = sql;
+  state.id_offset = id_offset;
+}
+
+// Replaces the frame that starts at offset n0 of buf, the last one, by its
+// compressed form if that is smaller
+inline void CompressFrame(std::vector<std::uint8_t>& buf, std::size_t n0) {
+#ifdef OPENTICK_ZLIB
+  auto raw = buf.size() - n0 - 4;
+  if (raw >= kMaxInflatedFrame) return;
+  thread_local std::vector<std::uint8_t> out;
+  uLongf n = compressBound(raw);
+  out.resize(8 + n);
+  if (compress2(out.data() + 8, &n, buf.data() + n0 + 4, raw, Z_BEST_SPEED) !=
+          Z_OK ||
+      n + 4 >= raw) {
+    return;
   }
-  auto ticker = ++ticker_counter_;
-  json j = {{"0", ticker}, {"1", "run"}, {"2", sql}, {"3", jargs}};
-  if (prepared >= 0) j["2"] = prepared;
-  Send(json::to_bson(j));
-  return Future(new FutureImpl(ticker, shared_from_this()));
+  auto head = boost::endian::native_to_little(std::uint32_t(n + 4) |
+                                              kCompressedFrame);
+  auto size = boost::endian::native_to_little(std::uint32_t(raw));
+  memcpy(out.data(), &head, 4);
+  memcpy(out.data() + 4, &size, 4);
+  buf.resize(n0);
+  buf.insert(buf.end(), out.begin(), out.begin() + 8 + n);
+#endif
 }
 
-inline ResultSet Connection::Execute(const std::string& sql, const Args& args) {
-  return ExecuteAsync(sql, args)->Get();
+// Inflates the payload of a compressed frame straight into out
+inline void InflateFrame(const std::uint8_t* data, std::size_t n,
+                         std::vector<std::uint8_t>& out) {
+#ifdef OPENTICK_ZLIB
+  std::uint32_t size;
+  if (n < 4) throw Exception("Truncated compressed frame");
+  memcpy(&size, data, 4);
+  size = boost::endian::little_to_native(size);
+  if (size > kMaxInflatedFrame) throw Exception("Compressed frame too large");
+  out.resize(size);
+  uLongf m = size;
+  if (uncompress(out.data(), &m, data + 4, n - 4) != Z_OK || m != size) {
+    throw Exception("Invalid compressed frame");
+  }
+#else
+  throw Exception("Compressed frame, built without zlib");
+#endif
 }
 
-inline Future Connection::BatchInsertAsync(const std::string& sql,
-                                           const Argss& argss) {
-  std::vector<json> data;
-  data.resize(argss.size());
-  auto i = 0u;
-  for (auto& args : argss) {
-    ConvertArgs(args, data[i++]);
+// Appends one 4-byte-length framed message to buf
+template <typename F>
+inline void EncodeFrame(std::vector<std::uint8_t>& buf, F&& encode) {
+  auto n0 = buf.size();
+  buf.resize(n0 + 4);
+  try {
+    BsonWriter w(buf);
+    encode(w);
+  } catch (...) {
+    buf.resize(n0);
+    throw;
   }
-  auto prepared = Prepare(sql);
-  auto ticker = ++ticker_counter_;
-  Send(json::to_bson(
-      json{{"0", ticker}, {"1", "batch"}, {"2", prepared}, {"3", data}}));
-  return Future(new FutureImpl(ticker, shared_from_this()));
+  unsigned n = boost::endian::native_to_little(unsigned(buf.size() - n0 - 4));
+  memcpy(buf.data() + n0, &n, 4);
 }
 
-inline void Connection::BatchInsert(const std::string& sql,
-                                    const Argss& argss) {
-  BatchInsertAsync(sql, argss)->Get();
+template <typename F>
+inline bool Connection::Send(F&& encode, int epoch) {
+  if (!IsConnected() && !reconnecting_) return true;
+  std::lock_guard<std::mutex> lk(m_out_);
+  if (broken_) return true;
+  if (epoch >= 0 && epoch != prepared_epoch_) return false;
+  auto n0 = msg_out_buf_.size();
+  {
+    ScopedTimer timer(metrics_.encode_ns);
+    EncodeFrame(msg_out_buf_, std::forward<F>(encode));
+    auto min_bytes = compress_min_.load();
+    if (min_bytes && msg_out_buf_.size() - n0 - 4 >= min_bytes)
+      CompressFrame(msg_out_buf_, n0);
+  }
+  Queued(msg_out_buf_.size() - n0);
+  ScheduleWrite();
+  return true;
 }
 
+// A refused frame is left as it was, to be patched with the new id
+inline bool Connection::SendFrame(std::vector<std::uint8_t>&& frame,
+                                  int epoch) {
+  if (!IsConnected() && !reconnecting_) return true;
+  auto min_bytes = compress_min_.load();
+  auto compress = min_bytes && frame.size() >= min_bytes + 4;
+  if (compress && epoch < 0) CompressFrame(frame, 0);
+  std::lock_guard<std::mutex> lk(m_out_);
+  if (broken_) return true;
+  if (epoch >= 0) {
+    if (epoch != prepared_epoch_) return false;
+    if (compress) CompressFrame(frame, 0);
+  }
+  if (msg_out_buf_.size()) {
+    frames_.push_back(std::move(msg_out_buf_));
+    msg_out_buf_.swap(spare_);
+  }
+  Queued(frame.size());
+  frames_.push_back(std::move(frame));
+  ScheduleWrite();
+  return true;
+}
+
+// Posts Write unless one is already scheduled, m_out_ must be held
+inline void Connection::ScheduleWrite() {
+  if (writing_) return;
+  writing_ = true;
+  auto self = shared_from_this();
+  io_service_.post([self]() { self->Write(); });
+}
+
+// m_out_ must be held
+inline void Connection::Queued(std::size_t bytes) {
+  auto& m = metrics_;
+  ++m.frames_out;
+  auto n = m.queued_bytes += bytes;
+  if (n > m.max_queued_bytes) m.max_queued_bytes = n;
+}
+
+inline void Connection::Write() {
+  std::vector<boost::asio::const_buffer> bufs;
+  std::size_t n = 0;
+  {
+    std::lock_guard<std::mutex> lk(m_out_);
+    assert(outbox_.empty());
+    // posted before the socket was lost, left to Reconnected, writing_ stays
+    // set meanwhile
+    if (reconnecting_) return;
+    if (frames_.empty() && msg_out_buf_.empty()) {
+      writing_ = false;
+      return;
+    }
+    outbox_.swap(frames_);
+    if (msg_out_buf_.size()) {
+      outbox_.push_back(std::move(msg_out_buf_));
+      msg_out_buf_.swap(spare_);
+    }
+  }
+  bufs.reserve(outbox_.size());
+  for (auto& buf : outbox_) {
+    bufs.push_back(boost::asio::buffer(buf));
+    n += buf.size();
+  }
+  metrics_.queued_bytes -= n;
+  metrics_.write_bytes.Record(n);
+  WindowFreed();
+  auto self = shared_from_this();
+  auto session = session_;
+  boost::asio::async_write(
+      socket_, bufs,
+      [self, session](const boost::system::error_code& e,
+                      std::size_t written) {
+        self->metrics_.bytes_out += written;
+        if (e || session != self->session_) {
+          {
+            std::lock_guard<std::mutex> lk(self->m_out_);
+            self->outbox_.clear();
+          }
+          if (session != self->session_) return;  // rewritten if replayable
+          std::cerr << "OpenTick: failed to send message. Error code: "
+                    << e.message() << std::endl;
+          self->Lost(session, e.message());
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lk(self->m_out_);
+          auto& last = self->outbox_.back();
+          if (last.capacity() > self->spare_.capacity()) {
+            last.clear();
+            self->spare_.swap(last);
+          }
+        }
+        self->outbox_.clear();
+        self->Write();
+      });
+}
+
+inline int Connection::Prepare(const std::string& sql) {
+  auto state = std::make_shared<FutureState>();
+  PrepareAsync(sql, [state](int id, const std::string& error) {
+    if (error.size())
+      state->Set(ValueScalar(error));
+    else
+      state->Set(ValueScalar(std::int64_t(id)));
+  });
+  std::unique_lock<std::mutex> lk(state->m);
+  state->cv.wait(lk, [&state]() { return state->done; });
+  auto& v = std::get<ValueScalar>(state->value);
+  if (auto ptr = std::get_if<std::string>(&v)) throw Exception(*ptr);
+  return std::get<std::int64_t>(v);
+}
+
+inline void Connection::PrepareAsync(const std::string& sql,
+                                     PrepareCallback callback) {
+  {
+    std::unique_lock<std::mutex> lock(m_);
+    auto& stmt = prepared_[sql];
+    if (stmt.id >= 0) {
+      auto id = stmt.id;
+      lock.unlock();
+      callback(id, "");
+      return;
+    }
+    stmt.waiters.push_back(std::move(callback));
+    if (stmt.waiters.size() > 1) return;
+  }
+  auto ticker = ++ticker_counter_;
+  auto state = std::make_shared<FutureState>();
+  auto self = shared_from_this();
+  state->callback = [self, sql](const Value& v) { self->OnPrepared(sql, v); };
+  Register(ticker, state, kPrepare);
+  Send([&](BsonWriter& w) {
+    w.WriteCommand(ticker, "prepare", sql, nullptr);
+  });
+}
+
+inline void Connection::OnPrepared(const std::string& sql,
+                                   const Value& value) {
+  auto id = -1;
+  std::string error = "Invalid prepare reply";
+  if (auto ptr = std::get_if<ValueScalar>(&value)) {
+    if (auto ptr2 = std::get_if<std::int64_t>(ptr)) {
+      id = *ptr2;
+      error.clear();
+    } else if (auto ptr2 = std::get_if<std::string>(ptr)) {
+      error = *ptr2;
+    }
+  }
+  std::vector<PrepareCallback> waiters;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    auto it = prepared_.find(sql);
+    if (it == prepared_.end()) return;
+    waiters.swap(it->second.waiters);
+    if (id >= 0)
+      it->second.id = id;
+    else
+      prepared_.erase(it);  // allow retrying later
+  }
+  for (auto& callback : waiters) callback(id, error);
+}
+
+// The id of sql, -1 if not prepared, and with epoch the prepared_epoch_ of
+// the id
+inline int Connection::FindPrepared(const std::string& sql, int* epoch) {
+  std::lock_guard<std::mutex> lock(m_);
+  if (epoch) *epoch = prepared_epoch_;
+  auto it = prepared_.find(sql);
+  return it == prepared_.end() ? -1 : it->second.id;
+}
+
+// Calls send(id, epoch) once sql is prepared, again once prepared anew if it
+// returns false, the id being reset by a reconnect meanwhile. A failed
+// prepare fails ticker instead.
+template <typename F>
+inline void Connection::WhenPrepared(const std::string& sql, int ticker,
+                                     F&& send) {
+  auto self = shared_from_this();
+  PrepareAsync(sql, [self, sql, ticker, send = std::forward<F>(send)](
+                        int id, const std::string& error) mutable {
+    if (error.size()) {
+      self->Notify(ticker, ValueScalar(error));
+      return;
+    }
+    int epoch;
+    if (self->FindPrepared(sql, &epoch) == id && send(id, epoch)) return;
+    self->WhenPrepared(sql, ticker, std::move(send));
+  });
+}
+
+// Serializes in place if sql is prepared already, otherwise encodes the frame
+// with an id placeholder and sends it once the prepare returns
+template <typename A>
+inline void Connection::SendPrepared(const std::string& sql, int ticker,
+                                     const char* cmd, const A& args,
+                                     bool keep) {
+  int epoch;
+  auto id = FindPrepared(sql, &epoch);
+  auto replayable = keep && Replayable(sql);
+  if (id >= 0 && !replayable) {
+    if (Send([&](BsonWriter& w) { w.WriteCommand(ticker, cmd, id, args); },
+             epoch))
+      return;
+    id = -1;  // reset by a reconnect, waits for the new id
+  }
+  std::vector<std::uint8_t> frame;
+  std::size_t offset;
+  {
+    ScopedTimer timer(metrics_.encode_ns);
+    EncodeFrame(frame, [&](BsonWriter& w) {
+      offset = w.WriteCommand(ticker, cmd, -1, args);
+    });
+  }
+  if (replayable) Keep(ticker, sql, frame, offset);
+  if (id >= 0) {
+    BsonWriter(frame).Patch(offset, id);
+    if (SendFrame(std::move(frame), epoch)) return;
+  }
+  WhenPrepared(sql, ticker, [this, offset, frame = std::move(frame)](
+                                int id, int epoch) mutable {
+    BsonWriter(frame).Patch(offset, id);
+    return SendFrame(std::move(frame), epoch);
+  });
+}
+
+inline Value FutureImpl::Get_(double timeout) {
+  std::unique_lock<std::mutex> lk(state->m);
+  auto done = [this]() { return state->done; };
+  if (timeout > 0) {
+    if (!state->cv.wait_for(lk, std::chrono::duration<double>(timeout), done))
+      throw Exception("Timeout");
+  } else {
+    state->cv.wait(lk, done);
+  }
+  if (auto ptr = std::get_if<ValueScalar>(&state->value)) {
+    if (auto ptr2 = std::get_if<std::string>(ptr)) throw Exception(*ptr2);
+  }
+  if (state->consumed) throw Exception("Result already consumed");
+  state->consumed = true;
+  auto v = std::move(state->value);
+  state->value = ValueScalar(nullptr);
+  lk.unlock();
+  conn->Release(-1, *state);
+  return v;
+}
+
+inline ResultSet FutureImpl::Get(double timeout) {
+  auto v = Get_(timeout);
+  if (auto ptr = std::get_if<ColumnarResultSet>(&v)) return (*ptr)->ToRows();
+  if (auto ptr = std::get_if<ResultSet>(&v)) return *ptr;
+  return {};
+}
+
+inline void BatchFuture::Wait(double timeout) {
+  std::lock_guard<std::mutex> lk(m_);
+  if (done_) return;
+  typedef std::chrono::duration<double> Seconds;
+  auto start = std::chrono::steady_clock::now();
+  for (auto& chunk : chunks) {
+    if (!chunk.future) continue;
+    auto left = timeout;
+    if (timeout > 0) {
+      left -= Seconds(std::chrono::steady_clock::now() - start).count();
+      if (left <= 0) throw Exception("Timeout");
+    }
+    try {
+      chunk.future->Get(left);
+    } catch (Exception& e) {
+      if (!strcmp(e.what(), "Timeout")) throw;
+      chunk.error = e.what();
+    }
+    chunk.future.reset();
+  }
+  done_ = true;
+}
+
+inline bool BatchFuture::OnReady(std::function<void()> fn) {
+  // one extra count so that fn cannot run before every chunk is hooked
+  auto left = std::make_shared<std::atomic<std::size_t>>(chunks.size() + 1);
+  auto done = [left, fn = std::move(fn)]() {
+    if (!--*left) fn();
+  };
+  for (auto& chunk : chunks) {
+    if (!chunk.future || !chunk.future->OnReady(done)) --*left;
+  }
+  return --*left != 0;
+}
+
+inline std::vector<BatchFuture::Chunk> BatchFuture::Failed(double timeout) {
+  Wait(timeout);
+  std::vector<Chunk> failed;
+  for (auto& chunk : chunks) {
+    if (chunk.error.size()) failed.push_back(chunk);
+  }
+  return failed;
+}
+
+// Summary of the failed chunks out of n
+inline std::string BatchFuture::Error(const std::vector<Chunk>& failed,
+                                      std::size_t n) {
+  std::string msg = std::to_string(failed.size()) + " of " +
+                    std::to_string(n) + " batch chunks failed";
+  for (auto& chunk : failed) {
+    msg += "; rows [" + std::to_string(chunk.begin) + ", " +
+           std::to_string(chunk.end) + "): " + chunk.error;
+  }
+  return msg;
+}
+
+inline ResultSet BatchFuture::Get(double timeout) {
+  auto failed = Failed(timeout);
+  if (failed.empty()) return {};
+  throw Exception(Error(failed, chunks.size()));
+}
+
+inline ColumnarResultSet BatchFuture::GetColumns(double timeout) {
+  Get(timeout);
+  return {};
+}
+
+// Chained after the callbacks of the earlier calls, each awaiter resumes
+inline bool FutureImpl::OnReady(std::function<void()> fn) {
+  std::lock_guard<std::mutex> lk(state->m);
+  if (state->done) return false;
+  state->callback = [before = std::move(state->callback),
+                     fn = std::move(fn)](const Value& v) {
+    if (before) before(v);
+    fn();
+  };
+  return true;
+}
+
+inline ColumnarResultSet FutureImpl::GetColumns(double timeout) {
+  auto v = Get_(timeout);
+  if (auto ptr = std::get_if<ColumnarResultSet>(&v)) return *ptr;
+  return {};
+}
+
+inline ValueScalar Column::Get(std::size_t row) const {
+  if (IsNull(row)) return nullptr;
+  switch (type) {
+    case kInt64:
+      return ints[row];
+    case kBool:
+      return ints[row] != 0;
+    case kTm:
+      return Tm(std::chrono::duration_cast<Tm::duration>(
+          std::chrono::nanoseconds(ints[row])));
+    case kDouble:
+      return doubles[row];
+    case kString:
+      return std::string(String(row));
+    case kMixed:
+      return values[row];
+    default:
+      return nullptr;
+  }
+}
+
+// Switches an all-null column to type t, or a column of another type to
+// kMixed, returns false if the cell must go to values
+inline bool Column::Switch(Type t) {
+  if (type == t) return true;
+  if (type == kNull) {
+    type = t;
+    if (t == kDouble)
+      doubles.resize(size);
+    else if (t == kString)
+      ends.resize(size);
+    else
+      ints.resize(size);
+    return true;
+  }
+  if (type != kMixed) {
+    values.reserve(size + 1);
+    for (auto i = 0u; i < size; ++i) values.push_back(Get(i));
+    ints = {};
+    doubles = {};
+    chars = {};
+    ends = {};
+    type = kMixed;
+  }
+  return false;
+}
+
+inline void Column::AppendNull() {
+  if (nulls.size() <= size / 64) nulls.resize(size / 64 + 1);
+  nulls[size / 64] |= std::uint64_t(1) << (size % 64);
+  switch (type) {
+    case kNull:
+      break;
+    case kDouble:
+      doubles.push_back(0);
+      break;
+    case kString:
+      ends.push_back(chars.size());
+      break;
+    case kMixed:
+      values.emplace_back(std::in_place_type<std::nullptr_t>, nullptr);
+      break;
+    default:
+      ints.push_back(0);
+  }
+  ++size;
+}
+
+inline void Column::Append(Type t, std::int64_t v) {
+  if (Switch(t)) {
+    ints.push_back(v);
+  } else if (t == kBool) {
+    values.push_back(v != 0);
+  } else if (t == kTm) {
+    values.push_back(Tm(std::chrono::duration_cast<Tm::duration>(
+        std::chrono::nanoseconds(v))));
+  } else {
+    values.push_back(v);
+  }
+  ++size;
+}
+
+inline void Column::Append(double v) {
+  if (Switch(kDouble))
+    doubles.push_back(v);
+  else
+    values.push_back(v);
+  ++size;
+}
+
+inline void Column::Append(std::string_view v) {
+  if (Switch(kString)) {
+    chars.append(v.data(), v.size());
+    ends.push_back(chars.size());
+  } else {
+    values.push_back(std::string(v));
+  }
+  ++size;
+}
+
+inline void Column::AppendCell(const Column& other, std::size_t row) {
+  if (other.IsNull(row)) {
+    AppendNull();
+    return;
+  }
+  switch (other.type) {
+    case kDouble:
+      Append(other.doubles[row]);
+      break;
+    case kString:
+      Append(other.String(row));
+      break;
+    case kMixed:
+      if (type == kNull) {
+        values.resize(size, ValueScalar(nullptr));
+        type = kMixed;
+      } else {
+        Switch(kMixed);
+      }
+      values.push_back(other.values[row]);
+      ++size;
+      break;
+    default:
+      Append(other.type, other.ints[row]);
+  }
+}
+
+inline void Column::Append(const Column& other, std::size_t begin,
+                           std::size_t end) {
+  if (type == kNull && !size) type = other.type;
+  if (type != other.type || type == kNull || type == kMixed) {
+    for (auto i = begin; i < end; ++i) AppendCell(other, i);
+    return;
+  }
+  auto n0 = size;
+  if (type == kDouble) {
+    doubles.insert(doubles.end(), other.doubles.begin() + begin,
+                   other.doubles.begin() + end);
+  } else if (type == kString) {
+    std::uint32_t from = begin ? other.ends[begin - 1] : 0;
+    auto offset = std::uint32_t(chars.size()) - from;
+    chars.append(other.chars, from, (end ? other.ends[end - 1] : 0) - from);
+    for (auto i = begin; i < end; ++i) ends.push_back(other.ends[i] + offset);
+  } else {
+    ints.insert(ints.end(), other.ints.begin() + begin,
+                other.ints.begin() + end);
+  }
+  size += end - begin;
+  if (other.nulls.empty()) return;
+  for (auto i = begin; i < end; ++i) {
+    if (!other.IsNull(i)) continue;
+    auto row = n0 + i - begin;
+    if (nulls.size() <= row / 64) nulls.resize(row / 64 + 1);
+    nulls[row / 64] |= std::uint64_t(1) << (row % 64);
+  }
+}
+
+inline void Column::Reserve(std::size_t rows) {
+  switch (type) {
+    case kNull:
+      break;
+    case kDouble:
+      doubles.reserve(rows);
+      break;
+    case kString:
+      ends.reserve(rows);
+      if (size) chars.reserve(chars.size() * rows / size);
+      break;
+    case kMixed:
+      values.reserve(rows);
+      break;
+    default:
+      ints.reserve(rows);
+  }
+}
+
+// Fills field of every row from col, the type is checked once per column
+template <typename T, typename V>
+inline void FillField(const Column& col, std::size_t j, V T::*field,
+                      std::vector<T>& rows) {
+  auto n = std::min(rows.size(), col.size);
+  auto type = col.type;
+  if (type == Column::kNull) return;
+  if constexpr (std::is_same_v<V, std::string>) {
+    if (type == Column::kString) {
+      for (auto i = 0u; i < n; ++i) rows[i].*field = col.String(i);
+      return;
+    }
+  } else if constexpr (std::is_same_v<V, Tm>) {
+    if (type == Column::kTm) {
+      for (auto i = 0u; i < n; ++i) {
+        rows[i].*field = Tm(std::chrono::duration_cast<Tm::duration>(
+            std::chrono::nanoseconds(col.ints[i])));
+      }
+      return;
+    }
+  } else if constexpr (std::is_arithmetic_v<V>) {
+    if (type == Column::kDouble) {
+      for (auto i = 0u; i < n; ++i) rows[i].*field = V(col.doubles[i]);
+      return;
+    }
+    if (type == Column::kInt64 || type == Column::kBool) {
+      for (auto i = 0u; i < n; ++i) rows[i].*field = V(col.ints[i]);
+      return;
+    }
+  }
+  for (auto i = 0u; i < n && type == Column::kMixed; ++i) {
+    std::visit(
+        [&](auto&& v) {
+          using X = std::decay_t<decltype(v)>;
+          if constexpr (std::is_arithmetic_v<V> && std::is_arithmetic_v<X>) {
+            rows[i].*field = V(v);
+          } else if constexpr (std::is_same_v<V, X>) {
+            rows[i].*field = v;
+          } else if constexpr (!std::is_same_v<X, std::nullptr_t>) {
+            throw Exception("Column " + std::to_string(j) + " row " +
+                            std::to_string(i) + " does not match its field");
+          }
+        },
+        col.values[i]);
+  }
+  if (type != Column::kMixed) {
+    throw Exception("Column " + std::to_string(j) +
+                    " does not match its field");
+  }
+}
+
+template <typename T>
+inline std::vector<T> ToStructs(const ColumnarResult& res) {
+  constexpr auto n = std::tuple_size_v<decltype(Schema<T>::fields)>;
+  if (res.num_rows && res.cols.size() < n) {
+    throw Exception("Expected " + std::to_string(n) + " columns, got " +
+                    std::to_string(res.cols.size()));
+  }
+  std::vector<T> rows(res.num_rows);
+  if (rows.empty()) return rows;
+  std::apply(
+      [&](auto... fields) {
+        auto j = 0u;
+        ((FillField(res.cols[j], j, fields, rows), ++j), ...);
+      },
+      Schema<T>::fields);
+  return rows;
+}
+
+inline ResultSet ColumnarResult::ToRows() const {
+  auto rows = std::make_shared<ValuesVector>(num_rows);
+  for (auto i = 0u; i < num_rows; ++i) {
+    auto& row = (*rows)[i];
+    row.reserve(cols.size());
+    for (auto& col : cols) row.push_back(col.Get(i));
+  }
+  return rows;
+}
+
+namespace bson_type {
+enum : std::uint8_t {
+  kDouble = 0x01,
+  kString = 0x02,
+  kDocument = 0x03,
+  kArray = 0x04,
+  kBinary = 0x05,
+  kObjectId = 0x07,
+  kBool = 0x08,
+  kDateTime = 0x09,
+  kNull = 0x0A,
+  kInt32 = 0x10,
+  kTimestamp = 0x11,
+  kInt64 = 0x12,
+};
+}  // namespace bson_type
+
+// Column types of a "protocol=columnar" reply, see columnar.go
+namespace columnar {
+static constexpr std::uint8_t kSubtype = 0x80;  // bson binary subtype
+enum : std::uint8_t {
+  kNull,
+  kInt64,
+  kDouble,
+  kTime,
+  kBool,
+  kString,
+  kMixed,
+};
+}  // namespace columnar
+
+inline const char* BsonReader::ReadKey() {
+  auto key = reinterpret_cast<const char*>(p_);
+  auto end = static_cast<const std::uint8_t*>(memchr(p_, 0, end_ - p_));
+  if (!end) throw Exception("Unterminated bson key");
+  p_ = end + 1;
+  return key;
+}
+
+inline std::string_view BsonReader::ReadString() {
+  auto n = Read<std::int32_t>();
+  if (n < 1) throw Exception("Invalid bson string");
+  Need(n);
+  std::string_view str(reinterpret_cast<const char*>(p_), n - 1);
+  p_ += n;
+  return str;
+}
+
+inline void BsonReader::Skip(std::uint8_t type) {
+  std::int32_t n;
+  switch (type) {
+    case bson_type::kDouble:
+    case bson_type::kDateTime:
+    case bson_type::kTimestamp:
+    case bson_type::kInt64:
+      n = 8;
+      break;
+    case bson_type::kInt32:
+      n = 4;
+      break;
+    case bson_type::kBool:
+      n = 1;
+      break;
+    case bson_type::kNull:
+      n = 0;
+      break;
+    case bson_type::kObjectId:
+      n = 12;
+      break;
+    case bson_type::kString:
+      n = Read<std::int32_t>();
+      break;
+    case bson_type::kBinary:
+      n = Read<std::int32_t>() + 1;
+      break;
+    case bson_type::kDocument:
+    case bson_type::kArray:
+      Need(4);
+      memcpy(&n, p_, 4);
+      n = boost::endian::little_to_native(n);
+      break;
+    default:
+      throw Exception("Unsupported bson type " + std::to_string(type));
+  }
+  if (n < 0) throw Exception("Invalid bson length");
+  Need(n);
+  p_ += n;
+}
+
+inline bool BsonReader::ReadInt(std::uint8_t type, std::int64_t& v) {
+  if (type == bson_type::kInt32) {
+    v = Read<std::int32_t>();
+  } else if (type == bson_type::kInt64) {
+    v = Read<std::int64_t>();
+  } else {
+    Skip(type);
+    return false;
+  }
+  return true;
+}
+
+// timestamp is encoded as [sec, nsec]
+inline bool BsonReader::ReadTm(std::int64_t& v) {
+  auto start = p_;
+  auto n = Read<std::int32_t>();
+  if (n < 5 || std::size_t(end_ - start) < std::size_t(n)) {
+    throw Exception("Invalid bson array");
+  }
+  auto end = start + n;
+  std::int64_t parts[2];
+  auto i = 0;
+  auto ok = true;
+  std::uint8_t type;
+  while ((type = Read<std::uint8_t>())) {
+    ReadKey();
+    std::int64_t tmp;
+    if (ReadInt(type, tmp) && i < 2)
+      parts[i] = tmp;
+    else
+      ok = false;
+    ++i;
+  }
+  if (p_ != end) throw Exception("Invalid bson array");
+  if (!ok || i != 2) return false;
+  v = parts[0] * 1000000000 + parts[1];
+  return true;
+}
+
+inline void BsonReader::ReadCell(std::uint8_t type, Column& col) {
+  switch (type) {
+    case bson_type::kDouble:
+      col.Append(ReadDouble());
+      break;
+    case bson_type::kString:
+      col.Append(ReadString());
+      break;
+    case bson_type::kInt32:
+      col.Append(Column::kInt64, Read<std::int32_t>());
+      break;
+    case bson_type::kInt64:
+      col.Append(Column::kInt64, Read<std::int64_t>());
+      break;
+    case bson_type::kBool:
+      col.Append(Column::kBool, Read<std::uint8_t>());
+      break;
+    case bson_type::kArray: {
+      std::int64_t v;
+      if (ReadTm(v))
+        col.Append(Column::kTm, v);
+      else
+        col.AppendNull();
+      break;
+    }
+    default:
+      Skip(type);
+      col.AppendNull();
+  }
+}
+
+inline ColumnarResultSet BsonReader::ReadRows() {
+  auto res = std::make_shared<ColumnarResult>();
+  auto& cols = res->cols;
+  auto start = p_;
+  auto n = Read<std::int32_t>();
+  if (n < 5) throw Exception("Invalid bson array");
+  auto end = start + std::min<std::size_t>(n, end_ - start);
+  std::uint8_t type;
+  while ((type = Read<std::uint8_t>())) {
+    auto row_start = p_ - 1;
+    ReadKey();
+    auto row = res->num_rows++;
+    auto j = 0u;
+    if (type != bson_type::kArray) {
+      Skip(type);
+    } else {
+      Read<std::int32_t>();
+      std::uint8_t type2;
+      while ((type2 = Read<std::uint8_t>())) {
+        ReadKey();
+        if (j == cols.size()) {
+          cols.emplace_back();
+          for (auto i = 0u; i < row; ++i) cols.back().AppendNull();
+        }
+        ReadCell(type2, cols[j++]);
+      }
+    }
+    for (; j < cols.size(); ++j) cols[j].AppendNull();
+    if (!row && end > p_) {
+      // rows are alike, so the first one tells how many are left
+      auto rows = 1 + std::size_t(end - p_) / std::size_t(p_ - row_start);
+      for (auto& col : cols) col.Reserve(rows);
+    }
+  }
+  return res;
+}
+
+template <typename T>
+inline void BsonReader::ReadArray(std::vector<T>& v, std::size_t n) {
+  Need(n * sizeof(T));
+  v.resize(n);
+  if (n) memcpy(v.data(), p_, n * sizeof(T));
+  p_ += n * sizeof(T);
+  if constexpr (boost::endian::order::native != boost::endian::order::little) {
+    for (auto& x : v) boost::endian::little_to_native_inplace(x);
+  }
+}
+
+// Result set of a columnar reply, null for other binaries
+inline ColumnarResultSet BsonReader::ReadColumnar() {
+  auto n = Read<std::int32_t>();
+  if (n < 0) throw Exception("Invalid bson binary");
+  Need(n + 1);
+  auto subtype = *p_++;
+  BsonReader block(p_, n);
+  p_ += n;
+  if (subtype != columnar::kSubtype) return nullptr;
+  return block.ReadColumnBlock();
+}
+
+// The typed arrays of each column are copied in one go. As decodeColumnar
+// of the server, the counts are checked against the payload before anything
+// is allocated from them, a block of nulls only is rejected since its row
+// count is not backed by any data.
+inline ColumnarResultSet BsonReader::ReadColumnBlock() {
+  auto res = std::make_shared<ColumnarResult>();
+  auto rows = res->num_rows = Read<std::uint32_t>();
+  auto ncols = Read<std::uint32_t>();
+  if (ncols > std::size_t(end_ - p_) / 2) {
+    throw Exception("Invalid columnar block");
+  }
+  res->cols.resize(ncols);
+  auto backed = rows == 0;
+  for (auto& col : res->cols) {
+    auto type = Read<std::uint8_t>();
+    if (type != columnar::kNull) backed = true;
+    if (Read<std::uint8_t>()) ReadArray(col.nulls, (rows + 63) / 64);
+    col.size = rows;
+    switch (type) {
+      case columnar::kNull:
+        break;
+      case columnar::kInt64:
+        col.type = Column::kInt64;
+        ReadArray(col.ints, rows);
+        break;
+      case columnar::kTime:
+        col.type = Column::kTm;
+        ReadArray(col.ints, rows);
+        break;
+      case columnar::kDouble:
+        col.type = Column::kDouble;
+        ReadArray(col.doubles, rows);
+        break;
+      case columnar::kBool:
+        col.type = Column::kBool;
+        Need(rows);
+        col.ints.assign(p_, p_ + rows);
+        p_ += rows;
+        break;
+      case columnar::kString: {
+        col.type = Column::kString;
+        ReadArray(col.ends, rows);
+        std::uint32_t end = 0;
+        for (auto e : col.ends) {
+          if (e < end) throw Exception("Invalid columnar string offsets");
+          end = e;
+        }
+        Need(end);
+        col.chars.assign(reinterpret_cast<const char*>(p_), end);
+        p_ += end;
+        break;
+      }
+      case columnar::kMixed: {
+        col.size = 0;
+        col.nulls.clear();
+        auto start = p_;
+        auto n = Read<std::int32_t>();
+        if (n < 5 || std::size_t(end_ - start) < std::size_t(n)) {
+          throw Exception("Invalid bson document");
+        }
+        std::uint8_t type2;
+        while ((type2 = Read<std::uint8_t>())) {
+          ReadKey();
+          ReadCell(type2, col);
+        }
+        if (p_ != start + n || col.size != rows) {
+          throw Exception("Invalid columnar mixed column");
+        }
+        break;
+      }
+      default:
+        throw Exception("Unsupported column type " + std::to_string(type));
+    }
+  }
+  if (!backed) throw Exception("Invalid columnar block");
+  return res;
+}
+
+inline std::int64_t BsonReader::ReadReply(Value& value) {
+  auto n = Read<std::int32_t>();
+  if (n < 5 || std::size_t(n) != std::size_t(end_ - p_ + 4)) {
+    throw Exception("Invalid bson document size");
+  }
+  std::int64_t ticker = -1;
+  auto has_ticker = false;
+  std::string cursor;
+  value = ValueScalar(nullptr);
+  std::uint8_t type;
+  while ((type = Read<std::uint8_t>())) {
+    auto key = ReadKey();
+    if (!strcmp(key, "0")) {
+      has_ticker = ReadInt(type, ticker);
+    } else if (!strcmp(key, "1")) {
+      switch (type) {
+        case bson_type::kString:
+          value = ValueScalar(std::string(ReadString()));
+          break;
+        case bson_type::kInt32:
+        case bson_type::kInt64: {
+          std::int64_t v;
+          ReadInt(type, v);
+          value = ValueScalar(v);
+          break;
+        }
+        case bson_type::kDouble:
+          value = ValueScalar(ReadDouble());
+          break;
+        case bson_type::kBool:
+          value = ValueScalar(Read<std::uint8_t>() != 0);
+          break;
+        case bson_type::kArray:
+          value = ReadRows();
+          break;
+        case bson_type::kBinary:
+          value = ReadColumnar();
+          break;
+        default:
+          Skip(type);
+      }
+    } else if (!strcmp(key, "2") && type == bson_type::kBinary) {
+      auto n = Read<std::int32_t>();
+      if (n < 0) throw Exception("Invalid bson binary");
+      Need(n + 1);
+      cursor.assign(reinterpret_cast<const char*>(p_ + 1), n);
+      p_ += n + 1;
+    } else {
+      Skip(type);
+    }
+  }
+  if (!has_ticker) throw Exception("Missing ticker");
+  // the server does not order the keys of a reply
+  auto rows = std::get_if<ColumnarResultSet>(&value);
+  if (rows && *rows) (*rows)->cursor = std::move(cursor);
+  return ticker;
+}
+
+inline void FutureState::Set(const Value& v) {
+  std::function<void(const Value&)> cb;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    value = v;
+    done = true;
+    cb.swap(callback);
+  }
+  cv.notify_all();
+  if (cb) cb(v);
+}
+
+inline int Histogram::Index(std::uint64_t v) {
+  if (v < kSub) return v;
+  int msb = 63;
+  while (!(v >> msb)) --msb;
+  return (msb - kSubBits + 1) * kSub + ((v >> (msb - kSubBits)) & (kSub - 1));
+}
+
+inline std::uint64_t Histogram::Lower(int index) {
+  if (index < kSub) return index;
+  auto shift = index / kSub - 1;
+  return std::uint64_t(kSub + index % kSub) << shift;
+}
+
+inline void Histogram::Record(std::uint64_t v) {
+  counts_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(v, std::memory_order_relaxed);
+  auto max = max_.load(std::memory_order_relaxed);
+  while (v > max && !max_.compare_exchange_weak(max, v)) {
+  }
+}
+
+inline Histogram::Snapshot Histogram::Read() const {
+  Snapshot s;
+  s.count = count_.load(std::memory_order_relaxed);
+  s.sum = sum_.load(std::memory_order_relaxed);
+  s.max = max_.load(std::memory_order_relaxed);
+  if (!s.count) return s;
+  s.counts.resize(kBuckets);
+  for (auto i = 0; i < kBuckets; ++i) {
+    s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+inline std::uint64_t Histogram::Snapshot::Percentile(double p) const {
+  std::uint64_t total = 0;
+  for (auto c : counts) total += c;
+  if (!total) return 0;
+  auto rank = std::max<std::uint64_t>(std::ceil(p / 100 * total), 1);
+  std::uint64_t n = 0;
+  for (auto i = 0; i < kBuckets; ++i) {
+    n += counts[i];
+    if (n < rank) continue;
+    if (i + 1 == kBuckets) return max;
+    return std::min(Lower(i + 1) - 1, max);
+  }
+  return max;
+}
+
+inline void Histogram::Snapshot::Merge(const Snapshot& other) {
+  if (!other.count) return;
+  if (counts.empty()) counts.resize(kBuckets);
+  for (auto i = 0; i < kBuckets; ++i) counts[i] += other.counts[i];
+  count += other.count;
+  sum += other.sum;
+  max = std::max(max, other.max);
+}
+
+inline json Histogram::Snapshot::ToJson() const {
+  return json{{"count", count},
+              {"mean", Mean()},
+              {"p50", Percentile(50)},
+              {"p90", Percentile(90)},
+              {"p99", Percentile(99)},
+              {"p999", Percentile(99.9)},
+              {"max", max}};
+}
+
+inline void MetricsSnapshot::Merge(const MetricsSnapshot& other) {
+  for (auto i = 0; i < kNumCommands; ++i) {
+    commands[i].requests += other.commands[i].requests;
+    commands[i].errors += other.commands[i].errors;
+    commands[i].latency_ns.Merge(other.commands[i].latency_ns);
+  }
+  bytes_in += other.bytes_in;
+  bytes_out += other.bytes_out;
+  frames_in += other.frames_in;
+  frames_out += other.frames_out;
+  queued_bytes += other.queued_bytes;
+  max_queued_bytes = std::max(max_queued_bytes, other.max_queued_bytes);
+  reconnects += other.reconnects;
+  timeouts += other.timeouts;
+  write_bytes.Merge(other.write_bytes);
+  encode_ns.Merge(other.encode_ns);
+  decode_ns.Merge(other.decode_ns);
+  in_flight += other.in_flight;
+  unclaimed_bytes += other.unclaimed_bytes;
+}
+
+inline json MetricsSnapshot::ToJson() const {
+  json j;
+  for (auto i = 0; i < kNumCommands; ++i) {
+    j[kCommandNames[i]] = {{"requests", commands[i].requests},
+                           {"errors", commands[i].errors},
+                           {"latency_ns", commands[i].latency_ns.ToJson()}};
+  }
+  j["bytes_in"] = bytes_in;
+  j["bytes_out"] = bytes_out;
+  j["frames_in"] = frames_in;
+  j["frames_out"] = frames_out;
+  j["queued_bytes"] = queued_bytes;
+  j["max_queued_bytes"] = max_queued_bytes;
+  j["reconnects"] = reconnects;
+  j["timeouts"] = timeouts;
+  j["write_bytes"] = write_bytes.ToJson();
+  j["encode_ns"] = encode_ns.ToJson();
+  j["decode_ns"] = decode_ns.ToJson();
+  j["in_flight"] = in_flight;
+  j["unclaimed_bytes"] = unclaimed_bytes;
+  return j;
+}
+
+inline MetricsSnapshot Connection::Metrics() {
+  MetricsSnapshot s;
+  auto& m = metrics_;
+  for (auto i = 0; i < kNumCommands; ++i) {
+    s.commands[i].requests = m.commands[i].requests;
+    s.commands[i].errors = m.commands[i].errors;
+    s.commands[i].latency_ns = m.commands[i].latency_ns.Read();
+  }
+  s.bytes_in = m.bytes_in;
+  s.bytes_out = m.bytes_out;
+  s.frames_in = m.frames_in;
+  s.frames_out = m.frames_out;
+  s.queued_bytes = m.queued_bytes;
+  s.max_queued_bytes = m.max_queued_bytes;
+  s.reconnects = m.reconnects;
+  s.timeouts = m.timeouts;
+  s.write_bytes = m.write_bytes.Read();
+  s.encode_ns = m.encode_ns.Read();
+  s.decode_ns = m.decode_ns.Read();
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    s.in_flight = store_.size();
+  }
+  s.unclaimed_bytes = unclaimed_bytes_;
+  return s;
+}
+
+inline std::shared_ptr<FutureImpl> Connection::NewFuture(int ticker,
+                                                       Command command,
+                                                       bool* admitted,
+                                                       Deadline deadline) {
+  auto f = std::make_shared<FutureImpl>(ticker, shared_from_this());
+  f->state->deadline = deadline;
+  auto ok = Register(ticker, f->state, command, admitted != nullptr);
+  if (admitted) *admitted = ok;
+  return f;
+}
+
+// False if the state failed at once, broken connection or full window
+inline bool Connection::Register(int ticker, FutureStatePtr state,
+                                 int command, bool admit) {
+  if (command >= 0) {
+    ++metrics_.commands[command].requests;
+    state->command = command;
+    state->registered = std::chrono::steady_clock::now();
+  }
+  auto timeout = timeout_ns_.load();
+  if (admit && timeout && state->deadline == Deadline()) {
+    state->deadline =
+        std::chrono::steady_clock::now() + std::chrono::nanoseconds(timeout);
+  }
+  std::string error;
+  {
+    std::unique_lock<std::mutex> lk(m_store_);
+    if (admit && error_.empty() && !HasRoom() && !OnIoThread()) {
+      if (window_.admission == WindowOptions::kBlock) {
+        ++window_waiters_;
+        window_cv_.wait(lk, [this]() { return HasRoom() || error_.size(); });
+        --window_waiters_;
+      } else {
+        error = "Too many requests in flight";
+      }
+    }
+    if (error.empty() && error_.empty()) {
+      auto deadline = state->deadline;
+      store_.emplace(ticker, std::move(state));
+      if (deadline != Deadline()) {
+        auto first =
+            deadlines_.empty() || deadline < deadlines_.begin()->first;
+        deadlines_.emplace(deadline, ticker);
+        if (first) {
+          auto self = shared_from_this();
+          io_service_.post([self]() { self->ArmDeadlineTimer(); });
+        }
+      }
+      return true;
+    }
+    if (error.empty()) error = error_;
+  }
+  if (command >= 0) ++metrics_.commands[command].errors;
+  state->Set(ValueScalar(error));
+  return false;
+}
+
+// m_store_ must be held
+inline bool Connection::HasRoom() const {
+  return (!window_.max_requests || store_.size() < window_.max_requests) &&
+         (!window_.max_bytes || metrics_.queued_bytes < window_.max_bytes);
+}
+
+inline bool Connection::OnIoThread() const {
+  auto id = std::this_thread::get_id();
+  if (id == thread_.get_id()) return true;
+  for (auto& thread : decoders_) {
+    if (id == thread.get_id()) return true;
+  }
+  return false;
+}
+
+inline void Connection::SetWindow(const WindowOptions& options) {
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    window_ = options;
+  }
+  WindowFreed();  // the limits may have grown
+}
+
+inline bool Connection::OnCapacity(std::function<void()> fn) {
+  std::lock_guard<std::mutex> lk(m_store_);
+  if (error_.size() || HasRoom()) return false;
+  capacity_callbacks_.push_back(std::move(fn));
+  ++window_waiters_;
+  return true;
+}
+
+// Wakes whoever waits for room once there is, m_store_ must not be held
+inline void Connection::WindowFreed() {
+  if (!window_waiters_) return;
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    if (!HasRoom() && error_.empty()) return;
+    window_cv_.notify_all();
+    callbacks.swap(capacity_callbacks_);
+    window_waiters_ -= callbacks.size();
+  }
+  for (auto& fn : callbacks) fn();
+}
+
+inline void Connection::SetTimeout(double seconds) {
+  timeout_ns_ = std::int64_t(std::max(seconds, 0.) * 1e9);
+}
+
+// m_store_ must be held
+inline void Connection::EraseDeadline(int ticker, const FutureState& state) {
+  if (state.deadline == Deadline()) return;
+  auto range = deadlines_.equal_range(state.deadline);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == ticker) {
+      deadlines_.erase(it);
+      return;
+    }
+  }
+}
+
+// Moves the timer earlier if the earliest deadline is
+inline void Connection::ArmDeadlineTimer() {
+  Deadline earliest;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    if (deadlines_.empty()) return;
+    earliest = deadlines_.begin()->first;
+  }
+  if (earliest >= deadline_armed_) return;
+  deadline_armed_ = earliest;
+  deadline_timer_.expires_at(earliest);
+  auto self = shared_from_this();
+  deadline_timer_.async_wait([self](const boost::system::error_code& e) {
+    if (e) return;  // moved earlier
+    self->deadline_armed_ = Deadline::max();
+    self->ExpireDeadlines();
+    self->ArmDeadlineTimer();
+  });
+}
+
+inline void Connection::ExpireDeadlines() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<FutureStatePtr> expired;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    auto it = deadlines_.begin();
+    for (; it != deadlines_.end() && it->first <= now; ++it) {
+      auto s = store_.find(it->second);
+      if (s == store_.end()) continue;
+      expired.push_back(std::move(s->second));
+      store_.erase(s);
+    }
+    deadlines_.erase(deadlines_.begin(), it);
+  }
+  for (auto& state : expired) {
+    ++metrics_.timeouts;
+    if (state->command >= 0) ++metrics_.commands[state->command].errors;
+    state->Set(ValueScalar(std::string("Timeout")));
+  }
+  if (expired.size()) WindowFreed();
+}
+
+// ticker < 0: only give back the unclaimed bytes of the state
+inline void Connection::Release(int ticker, FutureState& state) {
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    if (ticker >= 0 && store_.erase(ticker)) EraseDeadline(ticker, state);
+    unclaimed_bytes_ -= state.bytes;
+    state.bytes = 0;
+  }
+  if (ticker >= 0) WindowFreed();
+}
+
+inline void Connection::Notify(int ticker, const Value& value,
+                               std::size_t bytes) {
+  if (ticker < 0) {
+    decltype(store_) broken;
+    {
+      std::lock_guard<std::mutex> lk(m_store_);
+      error_ = std::get<std::string>(std::get<ValueScalar>(value));
+      broken.swap(store_);
+      deadlines_.clear();
+    }
+    for (auto& pair : broken) {
+      auto command = pair.second->command;
+      if (command >= 0) ++metrics_.commands[command].errors;
+      pair.second->Set(value);
+    }
+    EndSubscriptions(std::get<std::string>(std::get<ValueScalar>(value)));
+    WindowFreed();
+    return;
+  }
+  if (num_subscriptions_ && Push(ticker, value)) return;
+  FutureStatePtr state;
+  std::vector<FutureStatePtr> evicted;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    auto it = store_.find(ticker);
+    if (it == store_.end()) return;  // future destroyed or past its deadline
+    state = std::move(it->second);
+    store_.erase(it);
+    EraseDeadline(ticker, *state);
+    {
+      std::lock_guard<std::mutex> lk2(state->m);
+      if (state->callback) bytes = 0;  // handed over, never unclaimed
+    }
+    state->bytes = bytes;
+    unclaimed_bytes_ += bytes;
+    auto max_bytes = max_unclaimed_bytes_.load();
+    if (max_bytes && bytes) {
+      unclaimed_.push_back(state);
+      // always keep the newest one, even if it alone exceeds the cap
+      while (unclaimed_.size() > 1) {
+        auto old = unclaimed_.front().lock();
+        if (old && old->bytes && unclaimed_bytes_ <= max_bytes) break;
+        unclaimed_.pop_front();
+        if (!old || !old->bytes) continue;
+        unclaimed_bytes_ -= old->bytes;
+        old->bytes = 0;
+        evicted.push_back(std::move(old));
+      }
+    }
+  }
+  if (state->command >= 0) {
+    auto& m = metrics_.commands[state->command];
+    m.latency_ns.Record(NanosSince(state->registered));
+    auto v = std::get_if<ValueScalar>(&value);
+    if (v && std::holds_alternative<std::string>(*v)) ++m.errors;
+  }
+  state->Set(value);
+  for (auto& old : evicted) {
+    old->Set(ValueScalar(std::string(
+        "Result dropped, unclaimed results exceed the byte limit")));
+  }
+  WindowFreed();
+}
+
+inline bool Connection::Push(int ticker, const Value& value) {
+  std::function<void(const Value&)> push;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    auto it = subscriptions_.find(ticker);
+    if (it == subscriptions_.end()) return false;
+    auto v = std::get_if<ValueScalar>(&value);
+    if (v && std::holds_alternative<std::string>(*v)) {
+      push = std::move(it->second);
+      subscriptions_.erase(it);
+      --num_subscriptions_;
+    } else {
+      push = it->second;
+    }
+  }
+  push(value);
+  return true;
+}
+
+inline void Connection::EndSubscriptions(const std::string& error) {
+  decltype(subscriptions_) ended;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    ended.swap(subscriptions_);
+    num_subscriptions_ = 0;
+  }
+  for (auto& pair : ended) pair.second(ValueScalar(error));
+}
+
+inline std::size_t BsonWriter::Begin() {
+  auto start = out_.size();
+  out_.resize(start + 4);
+  return start;
+}
+
+inline void BsonWriter::End(std::size_t start) {
+  out_.push_back(0);
+  auto n = boost::endian::native_to_little(
+      static_cast<std::int32_t>(out_.size() - start));
+  memcpy(out_.data() + start, &n, 4);
+}
+
+inline void BsonWriter::Write(const char* key, std::int64_t v) {
+  if (v >= std::numeric_limits<std::int32_t>::min() &&
+      v <= std::numeric_limits<std::int32_t>::max()) {
+    Head(bson_type::kInt32, key);
+    PutLittle(static_cast<std::int32_t>(v));
+  } else {
+    Head(bson_type::kInt64, key);
+    PutLittle(v);
+  }
+}
+
+inline std::size_t BsonWriter::WriteInt32(const char* key, std::int32_t v) {
+  Head(bson_type::kInt32, key);
+  auto offset = out_.size();
+  PutLittle(v);
+  return offset;
+}
+
+inline void BsonWriter::Patch(std::size_t offset, std::int32_t v) {
+  v = boost::endian::native_to_little(v);
+  memcpy(out_.data() + offset, &v, 4);
+}
+
+inline void BsonWriter::Write(const char* key, double v) {
+  Head(bson_type::kDouble, key);
+  std::uint64_t tmp;
+  memcpy(&tmp, &v, 8);
+  PutLittle(tmp);
+}
+
+inline void BsonWriter::Write(const char* key, bool v) {
+  Head(bson_type::kBool, key);
+  out_.push_back(v ? 1 : 0);
+}
+
+inline void BsonWriter::Write(const char* key, std::nullptr_t) {
+  Head(bson_type::kNull, key);
+}
+
+inline void BsonWriter::Write(const char* key, const std::string& v) {
+  Head(bson_type::kString, key);
+  PutLittle(static_cast<std::int32_t>(v.size() + 1));
+  Put(v.c_str(), v.size() + 1);
+}
+
+// timestamp is encoded as [sec, nsec]
+inline void BsonWriter::Write(const char* key, const Tm& v) {
+  auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               v.time_since_epoch())
+               .count();
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  Write("0", std::int64_t(d / 1000000000));
+  Write("1", std::int64_t(d % 1000000000));
+  End(start);
+}
+
+template <typename V>
+inline void BsonWriter::WriteCell(const char* key, const V& v) {
+  if constexpr (std::is_same_v<V, std::uint64_t>) {
+    if (v > std::uint64_t(std::numeric_limits<std::int64_t>::max())) {
+      throw Exception("Integer out of range of int64");
+    }
+    Write(key, std::int64_t(v));
+  } else if constexpr (std::is_integral_v<V> && !std::is_same_v<V, bool>) {
+    Write(key, std::int64_t(v));
+  } else if constexpr (std::is_floating_point_v<V>) {
+    Write(key, double(v));
+  } else {
+    Write(key, v);
+  }
+}
+
+inline void BsonWriter::Write(const char* key, const ValueScalar& v) {
+  std::visit([this, key](auto&& v2) { WriteCell(key, v2); }, v);
+}
+
+// array keys are "0", "1", ...
+struct ArrayKey {
+  explicit ArrayKey(std::size_t i) {
+    auto p = buf + sizeof(buf) - 1;
+    *p = 0;
+    do {
+      *--p = '0' + i % 10;
+      i /= 10;
+    } while (i);
+    str = p;
+  }
+  char buf[24];
+  const char* str;
+};
+
+inline void BsonWriter::Write(const char* key, const Args& args) {
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  for (auto i = 0u; i < args.size(); ++i) Write(ArrayKey(i).str, args[i]);
+  End(start);
+}
+
+inline void BsonWriter::Write(const char* key, const Argss& argss) {
+  Write(key, ArgssSpan{argss.data(), argss.data() + argss.size()});
+}
+
+template <typename R>
+inline void BsonWriter::Write(const char* key, const RowsSpan<R>& rows) {
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  for (auto it = rows.begin; it != rows.end; ++it) {
+    WriteRow(ArrayKey(it - rows.begin).str, *it);
+  }
+  End(start);
+}
+
+template <typename T>
+inline void BsonWriter::WriteRow(const char* key, const T& row) {
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  std::apply(
+      [&](auto... fields) {
+        auto i = 0u;
+        (WriteCell(ArrayKey(i++).str, row.*fields), ...);
+      },
+      Schema<T>::fields);
+  End(start);
+}
+
+inline void BsonWriter::WriteBinary(const char* key, std::string_view v,
+                                    std::uint8_t subtype) {
+  Head(bson_type::kBinary, key);
+  PutLittle(static_cast<std::int32_t>(v.size()));
+  out_.push_back(subtype);
+  Put(v.data(), v.size());
+}
+
+inline void BsonWriter::Write(const char* key, const BsonRawArray& array) {
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  Put(array.elements.data(), array.elements.size());
+  End(start);
+}
+
+inline void BsonWriter::Write(const char* key, const ColumnBlock& block) {
+  Head(bson_type::kArray, key);
+  auto start = Begin();
+  WriteBinary("0", block.data, columnar::kSubtype);
+  End(start);
+}
+
+// Null cells are zero in the values, as the server writes them
+inline std::string EncodeColumnBlock(const ColumnarResult& res) {
+  static constexpr auto kLittle =
+      boost::endian::order::native == boost::endian::order::little;
+  std::string out;
+  auto put = [&out](auto v) {
+    v = boost::endian::native_to_little(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  };
+  auto rows = res.num_rows;
+  put(std::uint32_t(rows));
+  put(std::uint32_t(res.cols.size()));
+  for (auto& col : res.cols) {
+    if (col.type != Column::kNull && col.size != rows) {
+      throw Exception("Columns must have num_rows cells");
+    }
+    static const std::uint8_t kTypes[] = {
+        columnar::kNull, columnar::kInt64,  columnar::kDouble, columnar::kTime,
+        columnar::kBool, columnar::kString, columnar::kMixed};
+    out.push_back(kTypes[col.type]);
+    auto has_nulls = col.type != Column::kNull && col.type != Column::kMixed &&
+                     std::any_of(col.nulls.begin(), col.nulls.end(),
+                                 [](std::uint64_t w) { return w != 0; });
+    out.push_back(has_nulls);
+    if (has_nulls) {
+      for (auto i = 0u; i < (rows + 63) / 64; ++i) {
+        put(i < col.nulls.size() ? col.nulls[i] : std::uint64_t(0));
+      }
+    }
+    switch (col.type) {
+      case Column::kNull:
+        break;
+      case Column::kInt64:
+      case Column::kTm:
+        if (kLittle) {
+          out.append(reinterpret_cast<const char*>(col.ints.data()), rows * 8);
+        } else {
+          for (auto i = 0u; i < rows; ++i) put(col.ints[i]);
+        }
+        break;
+      case Column::kDouble:
+        if (kLittle) {
+          out.append(reinterpret_cast<const char*>(col.doubles.data()),
+                     rows * 8);
+        } else {
+          for (auto i = 0u; i < rows; ++i) {
+            std::uint64_t v;
+            memcpy(&v, &col.doubles[i], sizeof(v));
+            put(v);
+          }
+        }
+        break;
+      case Column::kBool:
+        for (auto i = 0u; i < rows; ++i) out.push_back(col.ints[i] != 0);
+        break;
+      case Column::kString:
+        for (auto i = 0u; i < rows; ++i) put(col.ends[i]);
+        out.append(col.chars, 0, rows ? col.ends[rows - 1] : 0);
+        break;
+      case Column::kMixed: {
+        std::vector<std::uint8_t> doc;
+        BsonWriter w(doc);
+        auto start = w.Begin();
+        for (auto i = 0u; i < rows; ++i) {
+          w.Write(ArrayKey(i).str, col.values[i]);
+        }
+        w.End(start);
+        out.append(reinterpret_cast<const char*>(doc.data()), doc.size());
+        break;
+      }
+    }
+  }
+  return out;
+}
+
+template <typename T, typename A>
+inline std::size_t BsonWriter::WriteCommand(int ticker, const char* cmd,
+                                            const T& target, const A& args) {
+  auto start = Begin();
+  Write("0", std::int64_t(ticker));
+  Write("1", std::string(cmd));
+  std::size_t offset = 0;
+  if constexpr (std::is_same_v<T, int>) {
+    offset = WriteInt32("2", target);
+  } else {
+    Write("2", target);
+  }
+  if constexpr (std::is_same_v<A, PageArgs>) {
+    Write("3", args.args);
+    WriteBinary("4", args.cursor);
+  } else if constexpr (std::is_same_v<A, PriorityArgs>) {
+    Write("3", args.args);
+    WriteInt32("5", args.priority);
+  } else if constexpr (!std::is_same_v<A, std::nullptr_t>) {
+    Write("3", args);
+  }
+  End(start);
+  return offset;
+}
+
+inline void Connection::SetCoalescing(bool enable,
+                                      const CoalesceOptions& options) {
+  {
+    std::lock_guard<std::mutex> lk(m_coalesce_);
+    coalesce_options_ = options;
+    coalesce_options_.max_rows = std::max<std::size_t>(options.max_rows, 1);
+    coalesce_options_.max_bytes = std::min(options.max_bytes, kMaxBatchBytes);
+    coalescing_ = enable;
+  }
+  if (!enable) FlushCoalesced();
+}
+
+inline void Connection::Coalesce(const std::string& sql, int ticker,
+                                 const Args& args) {
+  CoalescedRows full[2];
+  auto n = 0;
+  {
+    std::lock_guard<std::mutex> lk(m_coalesce_);
+    auto& opts = coalesce_options_;
+    auto& c = coalesced_[sql];
+    // flush first if this row would push the batch over max_bytes
+    if (c.tickers.size() && c.rows.size() + c.last_row_bytes > opts.max_bytes)
+      std::swap(full[n++], c);
+    auto n0 = c.rows.size();
+    {
+      ScopedTimer timer(metrics_.encode_ns);
+      BsonWriter(c.rows).Write(ArrayKey(c.tickers.size()).str, args);
+    }
+    c.last_row_bytes = c.rows.size() - n0;
+    c.tickers.push_back(ticker);
+    if (c.tickers.size() >= opts.max_rows || c.rows.size() >= opts.max_bytes)
+      std::swap(full[n++], c);
+    else if (opts.max_delay_us)
+      ArmCoalesceTimer();
+  }
+  for (auto i = 0; i < n; ++i) SendCoalesced(sql, full[i]);
+}
+
+inline void Connection::FlushCoalesced() {
+  decltype(coalesced_) all;
+  {
+    std::lock_guard<std::mutex> lk(m_coalesce_);
+    all.swap(coalesced_);
+  }
+  for (auto& pair : all) {
+    if (pair.second.tickers.size()) SendCoalesced(pair.first, pair.second);
+  }
+}
+
+inline void Connection::SendCoalesced(const std::string& sql,
+                                      CoalescedRows& rows) {
+  auto ticker = ++ticker_counter_;
+  auto state = std::make_shared<FutureState>();
+  auto self = shared_from_this();
+  state->callback = [self, tickers = std::move(rows.tickers)](const Value& v) {
+    for (auto t : tickers) self->Notify(t, v);
+  };
+  Register(ticker, state, kBatch);
+  SendPrepared(sql, ticker, "batch", BsonRawArray{rows.rows});
+}
+
+// m_coalesce_ must be held
+inline void Connection::ArmCoalesceTimer() {
+  if (coalesce_timer_armed_) return;
+  coalesce_timer_armed_ = true;
+  auto self = shared_from_this();
+  auto delay = std::chrono::microseconds(coalesce_options_.max_delay_us);
+  io_service_.post([self, delay]() {
+    self->coalesce_timer_.expires_from_now(delay);
+    self->coalesce_timer_.async_wait([self](const boost::system::error_code&) {
+      {
+        std::lock_guard<std::mutex> lk(self->m_coalesce_);
+        self->coalesce_timer_armed_ = false;
+      }
+      self->FlushCoalesced();
+    });
+  });
+}
+
+// Completion slot calling callback, through executor if given
+inline FutureStatePtr MakeCallbackState(Callback callback, Executor executor) {
+  auto state = std::make_shared<FutureState>();
+  state->callback = [callback = std::move(callback),
+                     executor = std::move(executor)](const Value& v) {
+    ColumnarResultSet result;
+    std::string error;
+    if (auto ptr = std::get_if<ColumnarResultSet>(&v)) {
+      result = *ptr;
+    } else if (auto ptr = std::get_if<ValueScalar>(&v)) {
+      if (auto ptr2 = std::get_if<std::string>(ptr)) error = *ptr2;
+    }
+    auto run = [callback, result = std::move(result),
+                error = std::move(error)]() {
+      try {
+        callback(result, error);
+      } catch (std::exception& e) {
+        std::cerr << "OpenTick: callback threw: " << e.what() << std::endl;
+      }
+    };
+    if (executor)
+      executor(std::move(run));
+    else
+      run();
+  };
+  return state;
+}
+
+inline void Connection::SendRun(const std::string& sql, int ticker,
+                                const Args& args, int priority) {
+  if (priority && args.empty()) {
+    std::vector<std::uint8_t> frame;
+    EncodeFrame(frame, [&](BsonWriter& w) {
+      w.WriteCommand(ticker, "run", sql, PriorityArgs{args, priority});
+    });
+    if (Replayable(sql)) Keep(ticker, "", frame, 0);
+    SendFrame(std::move(frame));
+  } else if (priority) {
+    // not coalesced, the batch would not keep the priority
+    SendPrepared(sql, ticker, "run", PriorityArgs{args, priority});
+  } else if (args.empty() && Replayable(sql)) {
+    std::vector<std::uint8_t> frame;
+    EncodeFrame(frame, [&](BsonWriter& w) {
+      w.WriteCommand(ticker, "run", sql, nullptr);
+    });
+    Keep(ticker, "", frame, 0);
+    SendFrame(std::move(frame));
+  } else if (args.empty()) {
+    Send([&](BsonWriter& w) { w.WriteCommand(ticker, "run", sql, nullptr); });
+  } else if (coalescing_ && IsInsert(sql)) {
+    Coalesce(sql, ticker, args);
+  } else {
+    SendPrepared(sql, ticker, "run", args);
+  }
+}
+
+inline Future Connection::ExecuteAsync(const std::string& sql,
+                                       const Args& args) {
+  return ExecuteAsync(sql, args, Deadline());
+}
+
+inline Future Connection::ExecuteAsync(const std::string& sql,
+                                       const Args& args, Deadline deadline) {
+  auto ticker = ++ticker_counter_;
+  bool admitted;
+  auto f = NewFuture(ticker, kRun, &admitted, deadline);
+  if (admitted) SendRun(sql, ticker, args);
+  return f;
+}
+
+inline Future Connection::ExecuteAsync(const std::string& sql,
+                                       const Args& args, int priority,
+                                       Deadline deadline) {
+  auto ticker = ++ticker_counter_;
+  bool admitted;
+  auto f = NewFuture(ticker, kRun, &admitted, deadline);
+  if (admitted) SendRun(sql, ticker, args, priority);
+  return f;
+}
+
+inline void Connection::ExecuteAsync(const std::string& sql, const Args& args,
+                                     Callback callback, Executor executor) {
+  auto ticker = ++ticker_counter_;
+  if (Register(ticker,
+               MakeCallbackState(std::move(callback), std::move(executor)),
+               kRun, true)) {
+    SendRun(sql, ticker, args);
+  }
+}
+
+inline Future Connection::PageAsync(const std::string& sql, const Args& args,
+                                    const std::string& cursor) {
+  auto ticker = ++ticker_counter_;
+  bool admitted;
+  auto f = NewFuture(ticker, kRun, &admitted);
+  if (admitted) SendPrepared(sql, ticker, "run", PageArgs{args, cursor});
+  return f;
+}
+
+inline std::shared_ptr<Cursor> Connection::Stream(const std::string& sql,
+                                                  const Args& args,
+                                                  int chunk_rows) {
+  if (!chunk_rows) throw Exception("chunk_rows must not be 0");
+  auto cursor = std::make_shared<Cursor>(
+      shared_from_this(), sql + " limit " + std::to_string(chunk_rows), args);
+  cursor->pending_ = PageAsync(cursor->sql_, args, "");
+  return cursor;
+}
+
+inline ColumnarResultSet Cursor::Next(double timeout) {
+  if (!pending_) return nullptr;
+  auto page = pending_->GetColumns(timeout);
+  pending_.reset();
+  if (page && page->cursor.size()) {
+    pending_ = conn_->PageAsync(sql_, args_, page->cursor);
+  }
+  return page;
+}
+
+// Rows of parts one after the other, or merged on sort_column, runs of rows
+// of one part are appended as blocks
+inline ColumnarResultSet MergeResults(
+    const std::vector<ColumnarResultSet>& parts, int sort_column) {
+  std::size_t ncols = 0;
+  std::size_t nrows = 0;
+  std::vector<const ColumnarResult*> inputs;
+  for (auto& part : parts) {
+    if (!part || !part->num_rows) continue;
+    inputs.push_back(part.get());
+    ncols = std::max(ncols, part->cols.size());
+    nrows += part->num_rows;
+  }
+  if (inputs.size() == 1) {
+    for (auto& part : parts) {
+      if (part.get() == inputs[0]) return part;
+    }
+  }
+  auto res = std::make_shared<ColumnarResult>();
+  res->num_rows = nrows;
+  res->cols.resize(ncols);
+  struct Run {
+    std::size_t part, begin, end;
+  };
+  std::vector<Run> runs;
+  if (sort_column < 0 || std::size_t(sort_column) >= ncols) {
+    for (auto i = 0u; i < inputs.size(); ++i)
+      runs.push_back({i, 0, inputs[i]->num_rows});
+  } else {
+    for (auto input : inputs) {
+      if (std::size_t(sort_column) >= input->cols.size())
+        throw Exception("Not all parts have the column to merge on");
+      auto t = input->cols[sort_column].type;
+      if (t == Column::kString || t == Column::kMixed)
+        throw Exception("Can only merge on a numeric or timestamp column");
+    }
+    // (part, row), nulls first, ties in the order of the parts
+    typedef std::pair<std::size_t, std::size_t> Cursor;
+    auto less = [&](Cursor a, Cursor b) {
+      auto& x = inputs[a.first]->cols[sort_column];
+      auto& y = inputs[b.first]->cols[sort_column];
+      auto xn = x.IsNull(a.second);
+      auto yn = y.IsNull(b.second);
+      if (xn || yn) return xn != yn ? xn : a.first < b.first;
+      if (x.type != Column::kDouble && y.type != Column::kDouble) {
+        auto u = x.ints[a.second];
+        auto v = y.ints[b.second];
+        return u < v || (u == v && a.first < b.first);
+      }
+      auto u = x.type == Column::kDouble ? x.doubles[a.second]
+                                         : double(x.ints[a.second]);
+      auto v = y.type == Column::kDouble ? y.doubles[b.second]
+                                         : double(y.ints[b.second]);
+      return u < v || (u == v && a.first < b.first);
+    };
+    auto greater = [&](Cursor a, Cursor b) { return less(b, a); };
+    std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heap(
+        greater);
+    for (auto i = 0u; i < inputs.size(); ++i) heap.push({i, 0});
+    while (heap.size()) {
+      auto top = heap.top();
+      heap.pop();
+      if (runs.size() && runs.back().part == top.first)
+        ++runs.back().end;
+      else
+        runs.push_back({top.first, top.second, top.second + 1});
+      if (++top.second < inputs[top.first]->num_rows) heap.push(top);
+    }
+  }
+  for (auto j = 0u; j < ncols; ++j) {
+    auto& col = res->cols[j];
+    std::size_t chars = 0;
+    auto type = Column::kNull;  // of the first part that has the column
+    for (auto input : inputs) {
+      if (j >= input->cols.size()) continue;
+      chars += input->cols[j].chars.size();
+      if (type == Column::kNull) type = input->cols[j].type;
+    }
+    switch (type) {
+      case Column::kNull:
+        break;
+      case Column::kDouble:
+        col.doubles.reserve(nrows);
+        break;
+      case Column::kString:
+        col.ends.reserve(nrows);
+        col.chars.reserve(chars);
+        break;
+      case Column::kMixed:
+        col.values.reserve(nrows);
+        break;
+      default:
+        col.ints.reserve(nrows);
+    }
+    for (auto& run : runs) {
+      auto input = inputs[run.part];
+      if (j < input->cols.size()) {
+        col.Append(input->cols[j], run.begin, run.end);
+      } else {
+        for (auto i = run.begin; i < run.end; ++i) col.AppendNull();
+      }
+    }
+  }
+  return res;
+}
+
+inline ColumnarResultSet ManyFuture::GetColumns(double timeout) {
+  std::lock_guard<std::mutex> lk(m_);
+  if (done_) return result_;
+  typedef std::chrono::duration<double> Seconds;
+  auto start = std::chrono::steady_clock::now();
+  while (results_.size() < parts.size()) {
+    auto left = timeout;
+    if (timeout > 0) {
+      left -= Seconds(std::chrono::steady_clock::now() - start).count();
+      if (left <= 0) throw Exception("Timeout");
+    }
+    auto i = results_.size();
+    try {
+      results_.push_back(parts[i]->GetColumns(left));
+    } catch (Exception& e) {
+      if (!strcmp(e.what(), "Timeout") && timeout > 0) throw;
+      throw Exception("argss[" + std::to_string(i) + "]: " + e.what());
+    }
+  }
+  result_ = MergeResults(results_, sort_column);
+  results_.clear();
+  parts.clear();
+  done_ = true;
+  return result_;
+}
+
+inline ResultSet ManyFuture::Get(double timeout) {
+  auto res = GetColumns(timeout);
+  return res ? res->ToRows() : nullptr;
+}
+
+inline bool ManyFuture::OnReady(std::function<void()> fn) {
+  // one extra count so that fn cannot run before every part is hooked
+  auto left = std::make_shared<std::atomic<std::size_t>>(parts.size() + 1);
+  auto done = [left, fn = std::move(fn)]() {
+    if (!--*left) fn();
+  };
+  for (auto& part : parts) {
+    if (!part->OnReady(done)) --*left;
+  }
+  return --*left != 0;
+}
+
+inline Future Connection::ExecuteManyAsync(const std::string& sql,
+                                           const Argss& argss,
+                                           int sort_column) {
+  auto f = std::make_shared<ManyFuture>();
+  f->sort_column = sort_column;
+  f->parts.reserve(argss.size());
+  for (auto& args : argss) f->parts.push_back(ExecuteAsync(sql, args));
+  return f;
+}
+
+inline ColumnarResultSet Connection::ExecuteMany(const std::string& sql,
+                                                 const Argss& argss,
+                                                 int sort_column) {
+  return ExecuteManyAsync(sql, argss, sort_column)->GetColumns();
+}
+
+inline Future Connection::SelectManyAsync(const std::string& sql,
+                                          const Argss& argss,
+                                          int sort_column) {
+  // the rows of argss[i] come back as ticker + 1 + i, then nil or the error
+  // failing all of them as ticker
+  int n = argss.size();
+  auto ticker = ticker_counter_.fetch_add(n + 1) + 1;
+  auto f = std::make_shared<ManyFuture>();
+  f->sort_column = sort_column;
+  f->parts.reserve(n);
+  auto self = shared_from_this();
+  for (auto i = 1; i <= n; ++i) {
+    auto part = std::make_shared<FutureImpl>(ticker + i, self);
+    Register(ticker + i, part->state, -1, false);
+    f->parts.push_back(part);
+  }
+  auto state = std::make_shared<FutureState>();
+  state->callback = [self, ticker, n](const Value& v) {
+    auto ptr = std::get_if<ValueScalar>(&v);
+    if (!ptr || !std::get_if<std::string>(ptr)) return;
+    for (auto i = 1; i <= n; ++i) self->Notify(ticker + i, v);
+  };
+  if (Register(ticker, state, kMany, true)) {
+    SendPrepared(sql, ticker, "many", argss, false);
+  }
+  return f;
+}
+
+inline ColumnarResultSet Connection::SelectMany(const std::string& sql,
+                                                const Argss& argss,
+                                                int sort_column) {
+  return SelectManyAsync(sql, argss, sort_column)->GetColumns();
+}
+
+inline int Connection::Subscribe(const std::string& sql, const Args& args,
+                                 Callback callback, Executor executor) {
+  auto ticker = ++ticker_counter_;
+  auto push =
+      MakeCallbackState(std::move(callback), std::move(executor))->callback;
+  std::string error;
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    error = error_;
+    if (error.empty()) {
+      subscriptions_.emplace(ticker, push);
+      ++num_subscriptions_;
+    }
+  }
+  if (error.size()) {
+    push(ValueScalar(error));
+  } else {
+    SendPrepared(sql, ticker, "subscribe", args, false);
+  }
+  return ticker;
+}
+
+inline void Connection::Unsubscribe(int id) {
+  {
+    std::lock_guard<std::mutex> lk(m_store_);
+    if (!subscriptions_.erase(id)) return;  // ended already
+    --num_subscriptions_;
+  }
+  auto ticker = ++ticker_counter_;
+  Send([&](BsonWriter& w) {
+    w.WriteCommand(ticker, "unsubscribe", std::string(), Args{id});
+  });
+}
+
+inline std::shared_ptr<Subscription> Connection::Subscribe(
+    const std::string& sql, const Args& args) {
+  auto sub = std::make_shared<Subscription>();
+  sub->conn_ = shared_from_this();
+  std::weak_ptr<Subscription> weak = sub;
+  sub->id_ = Subscribe(sql, args, [weak](ColumnarResultSet rows,
+                                         const std::string& error) {
+    auto sub = weak.lock();
+    if (!sub) return;
+    std::lock_guard<std::mutex> lk(sub->m_);
+    if (error.size()) {
+      sub->error_ = error;
+    } else if (rows) {
+      sub->blocks_.push_back(std::move(rows));
+    }
+    sub->cv_.notify_all();
+  });
+  return sub;
+}
+
+inline ColumnarResultSet Subscription::Next(double timeout) {
+  std::unique_lock<std::mutex> lk(m_);
+  auto ready = [this]() { return blocks_.size() || error_.size(); };
+  if (timeout > 0) {
+    if (!cv_.wait_for(lk, std::chrono::duration<double>(timeout), ready)) {
+      return {};
+    }
+  } else {
+    cv_.wait(lk, ready);
+  }
+  if (blocks_.empty()) throw Exception(error_);
+  auto rows = std::move(blocks_.front());
+  blocks_.pop_front();
+  return rows;
+}
+
+inline void Subscription::Cancel() {
+  if (auto conn = conn_.lock()) conn->Unsubscribe(id_);
+  conn_.reset();
+  std::lock_guard<std::mutex> lk(m_);
+  if (error_.empty()) error_ = "Unsubscribed";
+  cv_.notify_all();
+}
+
+inline Future Connection::LoadAsync(const std::string& sql,
+                                    const ColumnarResult& block) {
+  return LoadBlockAsync(sql, EncodeColumnBlock(block));
+}
+
+inline Future Connection::LoadBlockAsync(const std::string& sql,
+                                         std::string_view block) {
+  auto ticker = ++ticker_counter_;
+  bool admitted;
+  auto f = NewFuture(ticker, kLoad, &admitted);
+  if (admitted) SendPrepared(sql, ticker, "load", ColumnBlock{block});
+  return f;
+}
+
+inline LoadProgress Connection::LoadCsv(const std::string& sql,
+                                        const std::string& path,
+                                        const std::vector<Column::Type>& types,
+                                        const LoadOptions& options) {
+  return opentick::LoadCsv(path, types, options, [&](std::string_view block) {
+    return LoadBlockAsync(sql, block);
+  });
+}
+
+inline LoadProgress Connection::LoadFile(const std::string& sql,
+                                         const std::string& path,
+                                         const LoadOptions& options) {
+  return opentick::LoadFile(path, options, [&](std::string_view block) {
+    return LoadBlockAsync(sql, block);
+  });
+}
+
+// Read-only mapping of a whole file, an empty file maps nothing
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path);
+  const char* data() const {
+    return static_cast<const char*>(region_.get_address());
+  }
+  std::size_t size() const { return region_.get_size(); }
+
+ private:
+  boost::interprocess::file_mapping file_;
+  boost::interprocess::mapped_region region_;
+};
+
+inline MappedFile::MappedFile(const std::string& path) {
+  namespace ipc = boost::interprocess;
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) throw Exception("Cannot open " + path);
+  if (in.tellg() <= 0) return;
+  try {
+    file_ = ipc::file_mapping(path.c_str(), ipc::read_only);
+    region_ = ipc::mapped_region(file_, ipc::read_only);
+    region_.advise(ipc::mapped_region::advice_sequential);
+  } catch (ipc::interprocess_exception& e) {
+    throw Exception(path + ": " + e.what());
+  }
+}
+
+// Sends the blocks of next until it returns an empty one, next sets the input
+// bytes consumed so far
+inline LoadProgress LoadBlocks(
+    const BlockLoader& load,
+    const std::function<std::string_view(std::size_t&)>& next,
+    const LoadOptions& options) {
+  auto start = std::chrono::steady_clock::now();
+  LoadProgress progress;
+  std::string error;
+  std::deque<std::pair<Future, std::size_t>> futs;  // and the bytes consumed
+  auto wait = [&]() {
+    auto [fut, bytes] = std::move(futs.front());
+    futs.pop_front();
+    try {
+      auto res = fut->Get();
+      if (res && res->size() && res->front().size()) {
+        if (auto n = std::get_if<std::int64_t>(&res->front()[0])) {
+          progress.rows += *n;
+        }
+      }
+    } catch (Exception& e) {
+      if (error.empty()) error = e.what();
+      return;
+    }
+    ++progress.blocks;
+    progress.bytes = bytes;
+    progress.seconds = NanosSince(start) / 1e9;
+    if (options.progress) options.progress(progress);
+  };
+  auto max_in_flight = std::max<std::size_t>(options.max_in_flight, 1);
+  std::size_t bytes = 0;
+  while (error.empty()) {
+    auto block = next(bytes);
+    if (block.empty()) break;
+    while (futs.size() >= max_in_flight) wait();
+    futs.emplace_back(load(block), bytes);
+  }
+  while (futs.size()) wait();
+  if (error.size()) {
+    throw Exception(std::to_string(progress.rows) +
+                    " rows loaded, then a block failed: " + error);
+  }
+  return progress;
+}
+
+// "1500000000.25" as ns since epoch
+inline bool ParseEpochNanos(std::string_view v, std::int64_t& ns) {
+  auto negative = v.size() && v[0] == '-';
+  auto p = v.data() + negative;
+  auto end = v.data() + v.size();
+  std::int64_t sec = 0;
+  auto r = std::from_chars(p, end, sec);
+  if (r.ec != std::errc() || sec < 0) return false;
+  p = r.ptr;
+  std::int64_t frac = 0;
+  if (p < end && *p == '.') {
+    auto digits = 0;
+    for (++p; p < end && isdigit(*p); ++p) {
+      if (digits++ < 9) frac = frac * 10 + (*p - '0');
+    }
+    for (; digits < 9; ++digits) frac *= 10;
+  }
+  if (p != end) return false;
+  ns = sec * 1000000000 + frac;
+  if (negative) ns = -ns;
+  return true;
+}
+
+// Appends field to col of the type given by LoadCsv
+inline void AppendCsvCell(Column& col, std::string_view v, bool quoted,
+                          std::string& buf) {
+  if (v.empty() && !quoted) {
+    col.AppendNull();
+    return;
+  }
+  auto ok = true;
+  switch (col.type) {
+    case Column::kInt64: {
+      std::int64_t x = 0;
+      auto r = std::from_chars(v.data(), v.data() + v.size(), x);
+      ok = r.ec == std::errc() && r.ptr == v.data() + v.size();
+      col.Append(Column::kInt64, x);
+      break;
+    }
+    case Column::kDouble: {
+      buf.assign(v);
+      char* end;
+      col.Append(strtod(buf.c_str(), &end));
+      ok = buf.size() && end == buf.c_str() + buf.size();
+      break;
+    }
+    case Column::kTm: {
+      std::int64_t ns = 0;
+      ok = ParseEpochNanos(v, ns);
+      col.Append(Column::kTm, ns);
+      break;
+    }
+    case Column::kBool: {
+      auto is = [v](const char* s) {
+        return v.size() == strlen(s) &&
+               std::equal(v.begin(), v.end(), s, [](char a, char b) {
+                 return tolower(a) == b;
+               });
+      };
+      auto yes = v == "1" || is("true");
+      ok = yes || v == "0" || is("false");
+      col.Append(Column::kBool, yes);
+      break;
+    }
+    default:
+      col.Append(v);
+  }
+  if (!ok) throw Exception("Invalid value \"" + std::string(v) + "\"");
+}
+
+// Next field at p, unquoted into buf if quoted, p moves past its delimiter or
+// line end, eol tells which one it was
+inline std::string_view NextCsvField(const char*& p, const char* end,
+                                     char delimiter, std::string& buf,
+                                     bool& quoted, bool& eol) {
+  std::string_view field;
+  quoted = p < end && *p == '"';
+  if (quoted) {
+    buf.clear();
+    for (++p; p < end; ++p) {
+      if (*p == '"') {
+        if (p + 1 == end || p[1] != '"') {
+          ++p;
+          break;
+        }
+        ++p;
+      }
+      buf += *p;
+    }
+    while (p < end && *p != delimiter && *p != '\n' && *p != '\r') ++p;
+    field = buf;
+  } else {
+    auto start = p;
+    while (p < end && *p != delimiter && *p != '\n') ++p;
+    field = std::string_view(start, p - start);
+    if (field.size() && field.back() == '\r') field.remove_suffix(1);
+  }
+  eol = p == end || *p != delimiter;
+  if (p < end && *p == '\r') ++p;
+  if (p < end) ++p;
+  return field;
+}
+
+inline LoadProgress LoadCsv(const std::string& path,
+                            const std::vector<Column::Type>& types,
+                            const LoadOptions& options,
+                            const BlockLoader& load) {
+  if (types.empty()) throw Exception("No csv column types");
+  for (auto t : types) {
+    if (t == Column::kNull || t == Column::kMixed) {
+      throw Exception("Unsupported csv column type " + std::to_string(t));
+    }
+  }
+  MappedFile file(path);
+  auto p = file.data();
+  auto end = p + file.size();
+  std::size_t line = 0;
+  if (options.header) {
+    while (p < end && *p++ != '\n') {
+    }
+    ++line;
+  }
+  auto block_rows = std::max<std::size_t>(options.block_rows, 1);
+  ColumnarResult block;
+  std::string encoded, buf;
+  auto next = [&](std::size_t& bytes) -> std::string_view {
+    block.num_rows = 0;
+    block.cols.assign(types.size(), Column());
+    for (auto j = 0u; j < types.size(); ++j) {
+      block.cols[j].type = types[j];
+      block.cols[j].Reserve(block_rows);
+    }
+    while (p < end && block.num_rows < block_rows) {
+      ++line;
+      if (*p == '\n' || *p == '\r') {  // blank line
+        p += *p == '\r' && p + 1 < end && p[1] == '\n' ? 2 : 1;
+        continue;
+      }
+      for (auto j = 0u; j < types.size(); ++j) {
+        bool quoted, eol;
+        auto field = NextCsvField(p, end, options.delimiter, buf, quoted, eol);
+        auto where = [&]() {
+          return path + ":" + std::to_string(line) + ": ";
+        };
+        if (eol != (j + 1 == types.size())) {
+          throw Exception(where() + "expected " +
+                          std::to_string(types.size()) + " fields");
+        }
+        try {
+          AppendCsvCell(block.cols[j], field, quoted, buf);
+        } catch (Exception& e) {
+          throw Exception(where() + e.what());
+        }
+      }
+      ++block.num_rows;
+    }
+    bytes = p - file.data();
+    if (!block.num_rows) return {};
+    encoded = EncodeColumnBlock(block);
+    return encoded;
+  };
+  return LoadBlocks(load, next, options);
+}
+
+inline LoadProgress LoadFile(const std::string& path,
+                             const LoadOptions& options,
+                             const BlockLoader& load) {
+  MappedFile file(path);
+  std::size_t offset = 0;
+  auto next = [&](std::size_t& bytes) -> std::string_view {
+    if (offset == file.size()) return {};
+    std::uint32_t n;
+    if (file.size() - offset < sizeof(n)) {
+      throw Exception(path + ": truncated block size");
+    }
+    memcpy(&n, file.data() + offset, sizeof(n));
+    n = boost::endian::little_to_native(n);
+    offset += sizeof(n);
+    if (file.size() - offset < n) throw Exception(path + ": truncated block");
+    std::string_view block(file.data() + offset, n);
+    bytes = offset += n;
+    return block;
+  };
+  return LoadBlocks(load, next, options);
+}
+
+// Approximate memory held by res
+inline std::size_t ResultBytes(const ColumnarResult& res) {
+  auto n = sizeof(res);
+  for (auto& col : res.cols) {
+    n += sizeof(col) + col.ints.size() * 8 + col.doubles.size() * 8 +
+         col.chars.size() + col.ends.size() * 4 + col.nulls.size() * 8 +
+         col.values.size() * sizeof(ValueScalar);
+  }
+  return n;
+}
+
+inline ResultSet ResultCache::Entry::Rows() {
+  std::call_once(once_, [this]() {
+    if (columns) rows_ = columns->ToRows();
+  });
+  return rows_;
+}
+
+inline std::string ResultCache::Key(const std::string& sql, const Args& args) {
+  std::vector<std::uint8_t> buf(sql.begin(), sql.end());
+  buf.push_back(0);
+  BsonWriter(buf).Write("", args);
+  return std::string(buf.begin(), buf.end());
+}
+
+inline ResultCache::EntryPtr ResultCache::Find(const std::string& key) {
+  std::lock_guard<std::mutex> lk(m_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  auto entry = it->second->second;
+  if (ttl_ > 0 && std::chrono::steady_clock::now() >= entry->expiry) {
+    Erase(it->second);
+    ++misses_;
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  ++hits_;
+  return entry;
+}
+
+inline ResultCache::EntryPtr ResultCache::Insert(const std::string& key,
+                                                 ColumnarResultSet columns,
+                                                 std::uint64_t generation) {
+  auto entry = std::make_shared<Entry>();
+  entry->bytes = key.size() + (columns ? ResultBytes(*columns) : 0);
+  entry->columns = std::move(columns);
+  entry->expiry = std::chrono::steady_clock::now() +
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::duration<double>(ttl_));
+  if (!entry->columns || entry->bytes > max_bytes_) return entry;
+  std::lock_guard<std::mutex> lk(m_);
+  if (generation != generation_) return entry;
+  auto it = index_.find(key);
+  if (it != index_.end()) Erase(it->second);
+  lru_.emplace_front(key, entry);
+  index_.emplace(key, lru_.begin());
+  bytes_ += entry->bytes;
+  while (bytes_ > max_bytes_) Erase(std::prev(lru_.end()));
+  return entry;
+}
+
+inline void ResultCache::Erase(Lru::iterator it) {
+  bytes_ -= it->second->bytes;
+  index_.erase(it->first);
+  lru_.erase(it);
+}
+
+inline void ResultCache::Invalidate(const std::string& sql, const Args& args) {
+  auto key = Key(sql, args);
+  std::lock_guard<std::mutex> lk(m_);
+  ++generation_;
+  auto it = index_.find(key);
+  if (it != index_.end()) Erase(it->second);
+}
+
+inline void ResultCache::Invalidate(const std::string& sql) {
+  std::string prefix = sql + '\0';
+  std::lock_guard<std::mutex> lk(m_);
+  ++generation_;
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    auto next = std::next(it);
+    if (!it->first.compare(0, prefix.size(), prefix)) Erase(it);
+    it = next;
+  }
+}
+
+inline void ResultCache::Clear() {
+  std::lock_guard<std::mutex> lk(m_);
+  ++generation_;
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
+
+inline std::size_t ResultCache::Bytes() const {
+  std::lock_guard<std::mutex> lk(m_);
+  return bytes_;
+}
+
+inline ResultCache::EntryPtr CachedFuture::Fetch(double timeout) {
+  std::lock_guard<std::mutex> lk(m_);
+  if (!entry) {
+    auto columns = pending->GetColumns(timeout);
+    entry = cache->Insert(key, std::move(columns), generation);
+  }
+  return entry;
+}
+
+inline ResultSet CachedFuture::Get(double timeout) {
+  return Fetch(timeout)->Rows();
+}
+
+inline ColumnarResultSet CachedFuture::GetColumns(double timeout) {
+  return Fetch(timeout)->columns;
+}
+
+inline bool CachedFuture::OnReady(std::function<void()> fn) {
+  return pending && pending->OnReady(std::move(fn));
+}
+
+inline void Connection::SetResultCache(ResultCache::Ptr cache) {
+  std::lock_guard<std::mutex> lock(m_);
+  cache_ = std::move(cache);
+}
+
+inline Future Connection::ExecuteCachedAsync(const std::string& sql,
+                                             const Args& args) {
+  ResultCache::Ptr cache;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    cache = cache_;
+  }
+  if (!cache) return ExecuteAsync(sql, args);
+  auto f = std::make_shared<CachedFuture>();
+  f->key = ResultCache::Key(sql, args);
+  f->generation = cache->Generation();
+  f->entry = cache->Find(f->key);
+  if (!f->entry) f->pending = ExecuteAsync(sql, args);
+  f->cache = std::move(cache);
+  return f;
+}
+
+inline ResultSet Connection::Execute(const std::string& sql, const Args& args) {
+  return ExecuteAsync(sql, args)->Get();
+}
+
+// Estimated encoded size of one row, the largest of a few sampled rows
+template <typename R>
+inline std::size_t EstimateRowBytes(const std::vector<R>& rows) {
+  std::vector<std::uint8_t> tmp;
+  std::size_t n = 0;
+  auto step = std::max<std::size_t>(rows.size() / 8, 1);
+  for (auto i = 0u; i < rows.size(); i += step) {
+    tmp.clear();
+    BsonWriter(tmp).WriteRow(ArrayKey(rows.size()).str, rows[i]);
+    n = std::max(n, tmp.size());
+  }
+  tmp.clear();
+  BsonWriter(tmp).WriteRow(ArrayKey(rows.size()).str, rows.back());
+  return std::max(n, tmp.size());
+}
+
+template <typename R>
+inline std::size_t Connection::RowsPerChunk(const std::vector<R>& rows) const {
+  if (rows.size() <= 1) return rows.size();
+  return std::max<std::size_t>(max_batch_bytes_ / EstimateRowBytes(rows), 1);
+}
+
+template <typename R>
+inline Future Connection::SendBatch(const std::string& sql,
+                                    const std::vector<R>& rows) {
+  auto rows_per_chunk = RowsPerChunk(rows);
+  auto data = rows.data();
+  if (rows_per_chunk >= rows.size()) {
+    auto ticker = ++ticker_counter_;
+    bool admitted;
+    auto f = NewFuture(ticker, kBatch, &admitted);
+    if (admitted) {
+      SendPrepared(sql, ticker, "batch",
+                   RowsSpan<R>{data, data + rows.size()});
+    }
+    return f;
+  }
+  auto f = std::make_shared<BatchFuture>();
+  for (auto i = 0u; i < rows.size(); i += rows_per_chunk) {
+    auto end = std::min(i + rows_per_chunk, rows.size());
+    auto ticker = ++ticker_counter_;
+    bool admitted;
+    f->chunks.push_back({i, end, NewFuture(ticker, kBatch, &admitted), ""});
+    if (admitted)
+      SendPrepared(sql, ticker, "batch", RowsSpan<R>{data + i, data + end});
+  }
+  return f;
+}
+
+inline Future Connection::BatchInsertAsync(const std::string& sql,
+                                           const Argss& argss) {
+  return SendBatch(sql, argss);
+}
+
+template <typename T>
+inline Future Connection::InsertAsync(const std::string& sql,
+                                      const std::vector<T>& rows) {
+  return SendBatch(sql, rows);
+}
+
+template <typename T>
+inline void Connection::Insert(const std::string& sql,
+                               const std::vector<T>& rows) {
+  InsertAsync(sql, rows)->Get();
+}
+
+template <typename T>
+inline std::vector<T> Connection::Select(const std::string& sql,
+                                         const Args& args) {
+  auto res = ExecuteAsync(sql, args)->GetColumns();
+  return res ? ToStructs<T>(*res) : std::vector<T>();
+}
+
+inline void Connection::BatchInsertAsync(const std::string& sql,
+                                         const Argss& argss, Callback callback,
+                                         Executor executor) {
+  auto rows_per_chunk = RowsPerChunk(argss);
+  if (rows_per_chunk >= argss.size()) {
+    auto ticker = ++ticker_counter_;
+    if (Register(ticker,
+                 MakeCallbackState(std::move(callback), std::move(executor)),
+                 kBatch, true)) {
+      SendPrepared(sql, ticker, "batch", argss);
+    }
+    return;
+  }
+  // the last chunk to complete reports all failed ones
+  struct Pending {
+    std::mutex m;
+    std::size_t left;
+    std::size_t n;
+    std::vector<BatchFuture::Chunk> failed;
+    FutureStatePtr done;
+  };
+  auto pending = std::make_shared<Pending>();
+  pending->n = pending->left = (argss.size() - 1) / rows_per_chunk + 1;
+  pending->done = MakeCallbackState(std::move(callback), std::move(executor));
+  for (auto i = 0u; i < argss.size(); i += rows_per_chunk) {
+    auto end = std::min(i + rows_per_chunk, argss.size());
+    auto ticker = ++ticker_counter_;
+    auto state = std::make_shared<FutureState>();
+    state->callback = [pending, i, end](const Value& v) {
+      std::unique_lock<std::mutex> lk(pending->m);
+      auto ptr = std::get_if<ValueScalar>(&v);
+      auto error = ptr ? std::get_if<std::string>(ptr) : nullptr;
+      if (error) pending->failed.push_back({i, end, nullptr, *error});
+      if (--pending->left) return;
+      lk.unlock();
+      if (pending->failed.empty()) {
+        pending->done->Set(ValueScalar(nullptr));
+      } else {
+        pending->done->Set(ValueScalar(
+            BatchFuture::Error(pending->failed, pending->n)));
+      }
+    };
+    if (Register(ticker, state, kBatch, true)) {
+      SendPrepared(sql, ticker, "batch",
+                   ArgssSpan{argss.data() + i, argss.data() + end});
+    }
+  }
+}
+
+inline void Connection::BatchInsert(const std::string& sql,
+                                    const Argss& argss) {
+  BatchInsertAsync(sql, argss)->Get();
+}
+
+// N connections to the same server, ExecuteAsync/BatchInsertAsync are spread
+// across them round-robin, or by hashing the first argument (the symbol key)
+// so that requests of one symbol stay on one connection in order
+class ConnectionPool {
+ public:
+  typedef std::shared_ptr<ConnectionPool> Ptr;
+  enum Policy { kRoundRobin, kHashKey };
+  ConnectionPool(std::vector<Connection::Ptr> conns, Policy policy)
+      : conns_(std::move(conns)), policy_(policy) {}
+  std::size_t Size() const { return conns_.size(); }
+  const Connection::Ptr& operator[](std::size_t i) const { return conns_[i]; }
+  bool IsConnected() const;
+  void Use(const std::string& dbName);
+  Future ExecuteAsync(const std::string& sql, const Args& args = Args{});
+  ResultSet Execute(const std::string& sql, const Args& args = Args{});
+  Future BatchInsertAsync(const std::string& sql, const Argss& argss);
+  void BatchInsert(const std::string& sql, const Argss& argss);
+  void ExecuteAsync(const std::string& sql, const Args& args,
+                    Callback callback, Executor executor = nullptr);
+  void BatchInsertAsync(const std::string& sql, const Argss& argss,
+                        Callback callback, Executor executor = nullptr);
+  // The parameter sets are spread over the sockets as by ExecuteAsync
+  Future ExecuteManyAsync(const std::string& sql, const Argss& argss,
+                          int sort_column = -1);
+  ColumnarResultSet ExecuteMany(const std::string& sql, const Argss& argss,
+                                int sort_column = -1);
+  // One request on one socket
+  Future SelectManyAsync(const std::string& sql, const Argss& argss,
+                         int sort_column = -1);
+  ColumnarResultSet SelectMany(const std::string& sql, const Argss& argss,
+                               int sort_column = -1);
+  // Blocks spread over the sockets in turn
+  Future LoadAsync(const std::string& sql, const ColumnarResult& block);
+  Future LoadBlockAsync(const std::string& sql, std::string_view block);
+  LoadProgress LoadCsv(const std::string& sql, const std::string& path,
+                       const std::vector<Column::Type>& types,
+                       const LoadOptions& options = {});
+  LoadProgress LoadFile(const std::string& sql, const std::string& path,
+                        const LoadOptions& options = {});
+  Future ExecuteCachedAsync(const std::string& sql, const Args& args = Args{});
+  void SetResultCache(ResultCache::Ptr cache);  // one cache for all sockets
+  void SetWindow(const WindowOptions& options);  // per socket
+  void SetTimeout(double seconds);
+  Future ExecuteAsync(const std::string& sql, const Args& args,
+                      Deadline deadline);
+  Future ExecuteAsync(const std::string& sql, const Args& args, int priority,
+                      Deadline deadline = {});
+  std::shared_ptr<Cursor> Stream(const std::string& sql, const Args& args,
+                                 int chunk_rows);
+  // kHashKey picks the connection by the first field of the first row
+  template <typename T>
+  Future InsertAsync(const std::string& sql, const std::vector<T>& rows);
+  template <typename T>
+  void Insert(const std::string& sql, const std::vector<T>& rows);
+  template <typename T>
+  std::vector<T> Select(const std::string& sql, const Args& args = Args{});
+  void Close();
+  void SetDecodeThreads(int n, std::size_t min_bytes = 4096);  // per socket
+  void UseColumnarProtocol();
+  void SetCompression(std::size_t min_bytes = 4096);
+  MetricsSnapshot Metrics();  // merged over all connections
+
+ protected:
+  const Connection::Ptr& Pick(const Args* args);
+  void Prepare(const std::string& sql);
+
+ private:
+  std::vector<Connection::Ptr> conns_;
+  Policy policy_;
+  std::atomic<std::size_t> next_ = 0;
+  std::mutex m_;
+  std::set<std::string> prepared_;
+};
+
+inline ConnectionPool::Ptr ConnectPool(
+    const std::string& addr, int port, std::size_t n,
+    const std::string& db_name = "",
+    ConnectionPool::Policy policy = ConnectionPool::kRoundRobin) {
+  std::vector<Connection::Ptr> conns;
+  for (auto i = 0u; i < std::max<std::size_t>(n, 1); ++i) {
+    conns.push_back(Connect(addr, port));
+  }
+  auto pool = std::make_shared<ConnectionPool>(std::move(conns), policy);
+  if (db_name.size()) pool->Use(db_name);
+  return pool;
+}
+
+inline bool ConnectionPool::IsConnected() const {
+  for (auto& conn : conns_) {
+    if (!conn->IsConnected()) return false;
+  }
+  return true;
+}
+
+inline void ConnectionPool::Use(const std::string& dbName) {
+  for (auto& conn : conns_) conn->Use(dbName);
+}
+
+inline void ConnectionPool::Close() {
+  for (auto& conn : conns_) conn->Close();
+}
+
+inline void ConnectionPool::UseColumnarProtocol() {
+  for (auto& conn : conns_) conn->UseColumnarProtocol();
+}
+
+inline void ConnectionPool::SetWindow(const WindowOptions& options) {
+  for (auto& conn : conns_) conn->SetWindow(options);
+}
+
+inline void ConnectionPool::SetTimeout(double seconds) {
+  for (auto& conn : conns_) conn->SetTimeout(seconds);
+}
+
+inline void ConnectionPool::SetResultCache(ResultCache::Ptr cache) {
+  for (auto& conn : conns_) conn->SetResultCache(cache);
+}
+
+inline void ConnectionPool::SetCompression(std::size_t min_bytes) {
+  for (auto& conn : conns_) conn->SetCompression(min_bytes);
+}
+
+inline void ConnectionPool::SetDecodeThreads(int n, std::size_t min_bytes) {
+  for (auto& conn : conns_) conn->SetDecodeThreads(n, min_bytes);
+}
+
+inline MetricsSnapshot ConnectionPool::Metrics() {
+  MetricsSnapshot s;
+  for (auto& conn : conns_) s.Merge(conn->Metrics());
+  return s;
+}
+
+inline const Connection::Ptr& ConnectionPool::Pick(const Args* args) {
+  if (policy_ == kHashKey && args && args->size()) {
+    auto h = std::visit(
+        [](auto&& v) -> std::size_t {
+          using T = std::decay_t<decltype(v)>;
+          if constexpr (std::is_same_v<T, Tm>) {
+            return std::hash<Tm::rep>()(v.time_since_epoch().count());
+          } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+            return 0;
+          } else {
+            return std::hash<T>()(v);
+          }
+        },
+        (*args)[0]);
+    return conns_[h % conns_.size()];
+  }
+  return conns_[next_++ % conns_.size()];
+}
+
+// Prepares a new statement on every connection in the background, so each of
+// them has its own server-side id cached before it is picked
+inline void ConnectionPool::Prepare(const std::string& sql) {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (!prepared_.insert(sql).second) return;
+  }
+  for (auto& conn : conns_) {
+    conn->PrepareAsync(sql, [](int, const std::string&) {});
+  }
+}
+
+inline Future ConnectionPool::ExecuteAsync(const std::string& sql,
+                                           const Args& args) {
+  if (args.size()) Prepare(sql);
+  return Pick(&args)->ExecuteAsync(sql, args);
+}
+
+inline Future ConnectionPool::ExecuteAsync(const std::string& sql,
+                                           const Args& args,
+                                           Deadline deadline) {
+  if (args.size()) Prepare(sql);
+  return Pick(&args)->ExecuteAsync(sql, args, deadline);
+}
+
+inline Future ConnectionPool::ExecuteAsync(const std::string& sql,
+                                           const Args& args, int priority,
+                                           Deadline deadline) {
+  if (args.size()) Prepare(sql);
+  return Pick(&args)->ExecuteAsync(sql, args, priority, deadline);
+}
+
+inline Future ConnectionPool::ExecuteManyAsync(const std::string& sql,
+                                               const Argss& argss,
+                                               int sort_column) {
+  auto f = std::make_shared<ManyFuture>();
+  f->sort_column = sort_column;
+  f->parts.reserve(argss.size());
+  for (auto& args : argss) f->parts.push_back(ExecuteAsync(sql, args));
+  return f;
+}
+
+inline ColumnarResultSet ConnectionPool::ExecuteMany(const std::string& sql,
+                                                     const Argss& argss,
+                                                     int sort_column) {
+  return ExecuteManyAsync(sql, argss, sort_column)->GetColumns();
+}
+
+inline Future ConnectionPool::SelectManyAsync(const std::string& sql,
+                                              const Argss& argss,
+                                              int sort_column) {
+  Prepare(sql);
+  return Pick(nullptr)->SelectManyAsync(sql, argss, sort_column);
+}
+
+inline ColumnarResultSet ConnectionPool::SelectMany(const std::string& sql,
+                                                    const Argss& argss,
+                                                    int sort_column) {
+  return SelectManyAsync(sql, argss, sort_column)->GetColumns();
+}
+
+inline Future ConnectionPool::LoadAsync(const std::string& sql,
+                                        const ColumnarResult& block) {
+  return LoadBlockAsync(sql, EncodeColumnBlock(block));
+}
+
+inline Future ConnectionPool::LoadBlockAsync(const std::string& sql,
+                                             std::string_view block) {
+  Prepare(sql);
+  return Pick(nullptr)->LoadBlockAsync(sql, block);
+}
+
+inline LoadProgress ConnectionPool::LoadCsv(
+    const std::string& sql, const std::string& path,
+    const std::vector<Column::Type>& types, const LoadOptions& options) {
+  return opentick::LoadCsv(path, types, options, [&](std::string_view block) {
+    return LoadBlockAsync(sql, block);
+  });
+}
+
+inline LoadProgress ConnectionPool::LoadFile(const std::string& sql,
+                                             const std::string& path,
+                                             const LoadOptions& options) {
+  return opentick::LoadFile(path, options, [&](std::string_view block) {
+    return LoadBlockAsync(sql, block);
+  });
+}
+
+inline Future ConnectionPool::ExecuteCachedAsync(const std::string& sql,
+                                                 const Args& args) {
+  if (args.size()) Prepare(sql);
+  return Pick(&args)->ExecuteCachedAsync(sql, args);
+}
+
+inline void ConnectionPool::ExecuteAsync(const std::string& sql,
+                                         const Args& args, Callback callback,
+                                         Executor executor) {
+  if (args.size()) Prepare(sql);
+  Pick(&args)->ExecuteAsync(sql, args, std::move(callback),
+                            std::move(executor));
+}
+
+inline void ConnectionPool::BatchInsertAsync(const std::string& sql,
+                                             const Argss& argss,
+                                             Callback callback,
+                                             Executor executor) {
+  Prepare(sql);
+  Pick(argss.empty() ? nullptr : &argss[0])
+      ->BatchInsertAsync(sql, argss, std::move(callback), std::move(executor));
+}
+
+inline ResultSet ConnectionPool::Execute(const std::string& sql,
+                                         const Args& args) {
+  return ExecuteAsync(sql, args)->Get();
+}
+
+inline Future ConnectionPool::BatchInsertAsync(const std::string& sql,
+                                               const Argss& argss) {
+  Prepare(sql);
+  return Pick(argss.empty() ? nullptr : &argss[0])
+      ->BatchInsertAsync(sql, argss);
+}
+
+inline std::shared_ptr<Cursor> ConnectionPool::Stream(const std::string& sql,
+                                                      const Args& args,
+                                                      int chunk_rows) {
+  return Pick(&args)->Stream(sql, args, chunk_rows);
+}
+
+inline void ConnectionPool::BatchInsert(const std::string& sql,
+                                        const Argss& argss) {
+  BatchInsertAsync(sql, argss)->Get();
+}
+
+template <typename T>
+inline Future ConnectionPool::InsertAsync(const std::string& sql,
+                                          const std::vector<T>& rows) {
+  Prepare(sql);
+  if (rows.empty()) return Pick(nullptr)->InsertAsync(sql, rows);
+  Args key{ValueScalar(rows[0].*std::get<0>(Schema<T>::fields))};
+  return Pick(&key)->InsertAsync(sql, rows);
+}
+
+template <typename T>
+inline void ConnectionPool::Insert(const std::string& sql,
+                                   const std::vector<T>& rows) {
+  InsertAsync(sql, rows)->Get();
+}
+
+template <typename T>
+inline std::vector<T> ConnectionPool::Select(const std::string& sql,
+                                             const Args& args) {
+  if (args.size()) Prepare(sql);
+  return Pick(&args)->Select<T>(sql, args);
+}
+
+#ifdef OPENTICK_HAS_COROUTINES
+// co_await on a Future suspends until its reply arrives and returns the
+// columnar result, throwing Exception on error. The coroutine resumes on the
+// io thread, where it must not block, unless an executor is given with On.
+struct FutureAwaiter {
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    return future->OnReady([handle, executor = executor]() {
+      if (executor) {
+        executor([handle]() { handle.resume(); });
+      } else {
+        handle.resume();
+      }
+    });
+  }
+  ColumnarResultSet await_resume() { return future->GetColumns(); }
+  Future future;
+  Executor executor;
+};
+
+inline FutureAwaiter operator co_await(Future future) {
+  return FutureAwaiter{std::move(future), nullptr};
+}
+
+// co_await On(conn->ExecuteAsync(...), executor) to resume through executor
+inline FutureAwaiter On(Future future, Executor executor) {
+  return FutureAwaiter{std::move(future), std::move(executor)};
+}
+
+// Fire-and-forget coroutine, started eagerly and destroyed when it returns,
+// exceptions escaping the body are logged
+struct Task {
+  struct promise_type {
+    Task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept {
+      try {
+        throw;
+      } catch (std::exception& e) {
+        std::cerr << "OpenTick: uncaught exception in task: " << e.what()
+                  << std::endl;
+      } catch (...) {
+        std::cerr << "OpenTick: uncaught exception in task" << std::endl;
+      }
+    }
+  };
+};
+#endif  // OPENTICK_HAS_COROUTINES
+
 }  // namespace opentick
 
 #endif  // OPENTICK_CONNECTION_H_
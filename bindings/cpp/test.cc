@@ -81,6 +81,27 @@ int main() {
     diff = duration_cast<microseconds>(now3 - now).count() / 1e6;
     LOG(diff2 << "s " << diff << "s " << i << ' ' << futs.size()
               << " all batch insert futures get done");
+    // the same rows again as one columnar block, the server commits it in
+    // parallel transactions
+    ColumnarResult block;
+    block.num_rows = n1 * n2;
+    block.cols.resize(9);
+    for (auto k = 0; k < n1 * n2; ++k) {
+      auto ns = duration_cast<nanoseconds>(tm.time_since_epoch()) +
+                microseconds(k);
+      block.cols[0].Append(Column::kInt64, 1);
+      block.cols[1].Append(Column::kInt64, i);
+      block.cols[2].Append(Column::kTm, ns.count());
+      auto j = 3;
+      for (auto v : {2.2, 2.4, 2.1, 2.3, 1000000., 2.25}) {
+        block.cols[j++].Append(v);
+      }
+    }
+    now = system_clock::now();
+    auto loaded = conn->LoadAsync(kInsert, block)->Get();
+    diff = duration_cast<microseconds>(system_clock::now() - now).count() / 1e6;
+    LOG(diff << "s " << std::get<std::int64_t>((*loaded)[0][0])
+              << " loaded in one block");
     auto res = conn->Execute(
         "select tm from test where sec=1 and interval=? and tm=?", Args{i, tm});
     assert(std::get<Tm>((*res)[0][0]) == tm);
@@ -104,6 +125,15 @@ int main() {
     now2 = system_clock::now();
     diff = duration_cast<microseconds>(now2 - now).count() / 1e6;
     LOG(diff << "s " << res2.size() << " retrieved with async");
+    Argss argss;
+    for (auto j = 0; j <= i; ++j) argss.push_back(Args{j});
+    now = system_clock::now();
+    auto res3 = conn->ExecuteMany(
+        "select * from test where sec=1 and interval=?", argss);
+    now2 = system_clock::now();
+    diff = duration_cast<microseconds>(now2 - now).count() / 1e6;
+    assert(res3->num_rows == res2.size());
+    LOG(diff << "s " << res3->num_rows << " retrieved with ExecuteMany");
     std::cerr << std::endl;
   }
   return 0;
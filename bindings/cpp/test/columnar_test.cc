@@ -0,0 +1,75 @@
+// Decoding of the columnar reply blocks, see columnar.go of the server: a
+// malformed block throws Exception before anything is allocated from its
+// counts.
+
+#include "mock_server.h"
+#include "opentick.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace opentick;
+using namespace opentick::mock;
+
+// assert is compiled out of the default Release build
+#define CHECK(cond)                                                   \
+  if (!(cond)) {                                                      \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl; \
+    std::exit(1);                                                     \
+  }
+
+// The reply of ticker 1 with block as its result
+static ColumnarResultSet Decode(const std::string& block) {
+  std::vector<std::uint8_t> buf;
+  BsonWriter w(buf);
+  auto start = w.Begin();
+  w.Write("0", std::int64_t(1));
+  w.WriteBinary("1", block, columnar::kSubtype);
+  w.End(start);
+  Value v;
+  BsonReader(buf.data(), buf.size()).ReadReply(v);
+  return std::get<ColumnarResultSet>(v);
+}
+
+static bool Rejected(const std::string& block) {
+  try {
+    Decode(block);
+  } catch (Exception& e) {
+    return true;
+  }
+  return false;
+}
+
+static std::string Header(std::uint32_t num_rows, std::uint32_t num_cols) {
+  std::string out(8, '\0');
+  boost::endian::store_little_u32(
+      reinterpret_cast<unsigned char*>(&out[0]), num_rows);
+  boost::endian::store_little_u32(
+      reinterpret_cast<unsigned char*>(&out[4]), num_cols);
+  return out;
+}
+
+// A column of type without nulls, followed by its data
+static std::string Col(std::uint8_t type, const std::string& data = "") {
+  return std::string{char(type), 0} + data;
+}
+
+int main() {
+  auto res = Decode(EncodeColumnar(Argss{Bar(0), Bar(1)}));
+  CHECK(res->num_rows == 2 && res->cols.size() == 9);
+  CHECK(res->cols[2].type == Column::kTm && res->cols[3].doubles[1] == 2.2);
+  res = Decode(Header(0, 1) + Col(columnar::kNull));
+  CHECK(res->num_rows == 0 && res->cols.size() == 1);
+
+  // a column count far past the payload
+  CHECK(Rejected(Header(1, 0xffffffff) + std::string(64, '\0')));
+  // rows backed by no column, or by null columns only
+  CHECK(Rejected(Header(5, 0)));
+  CHECK(Rejected(Header(0xffffffff, 1) + Col(columnar::kNull)));
+  CHECK(Rejected(Header(0xffffffff, 2) + Col(columnar::kNull) +
+                 Col(columnar::kNull)));
+  // an int column short of its rows
+  CHECK(Rejected(Header(3, 1) + Col(columnar::kInt64, std::string(8, '\0'))));
+  std::cout << "ok" << std::endl;
+  return 0;
+}
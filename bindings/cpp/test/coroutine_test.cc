@@ -0,0 +1,138 @@
+// co_await of Futures inside Tasks, built as C++20 by CMakeLists.txt when the
+// compiler supports it. The futures are completed by hand, or are those of
+// requests to the MockServer.
+
+#include "mock_server.h"
+#include "opentick.h"
+
+#include <cstdlib>
+#include <iostream>
+
+#ifndef OPENTICK_HAS_COROUTINES
+#error "coroutine_test needs C++20 coroutines"
+#endif
+
+using namespace opentick;
+using namespace opentick::mock;
+
+// assert is compiled out of the default Release build
+#define CHECK(cond)                                                   \
+  if (!(cond)) {                                                      \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl; \
+    std::exit(1);                                                     \
+  }
+
+// Completed by Complete or Fail, resumes its awaiter right there
+struct ManualFuture : public AbstractFuture {
+  ResultSet Get(double timeout = 0) override {
+    return GetColumns(timeout)->ToRows();
+  }
+  ColumnarResultSet GetColumns(double timeout = 0) override {
+    if (error.size()) throw Exception(error);
+    return result;
+  }
+  bool OnReady(std::function<void()> fn) override {
+    ready = std::move(fn);
+    return true;
+  }
+  void Complete(std::size_t num_rows) {
+    result = std::make_shared<ColumnarResult>();
+    result->num_rows = num_rows;
+    ready();
+  }
+  void Fail(const std::string& e) {
+    error = e;
+    ready();
+  }
+  ColumnarResultSet result;
+  std::string error;
+  std::function<void()> ready;
+};
+
+static Task AwaitBoth(Future a, Future b, std::size_t& rows,
+                      std::string& error) {
+  rows += (co_await a)->num_rows;
+  try {
+    rows += (co_await b)->num_rows;
+  } catch (Exception& e) {
+    error = e.what();
+  }
+}
+
+static Task AwaitOn(Future f, Executor executor, std::size_t& rows) {
+  rows += (co_await On(f, executor))->num_rows;
+}
+
+// On the io thread, counts each resumption in done
+static Task AwaitRows(Future f, std::atomic<std::size_t>& rows,
+                      std::atomic<int>& failed, std::atomic<int>& done) {
+  try {
+    rows += (co_await f)->num_rows;
+  } catch (Exception& e) {
+    ++failed;
+  }
+  ++done;
+}
+
+static void WaitFor(std::atomic<int>& done, int n) {
+  for (auto i = 0; i < 5000 && done < n; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+static Task Throw(Future f, bool std_exception) {
+  co_await f;
+  if (std_exception) throw std::runtime_error("std");
+  throw 42;
+}
+
+int main() {
+  auto a = std::make_shared<ManualFuture>();
+  auto b = std::make_shared<ManualFuture>();
+  std::size_t rows = 0;
+  std::string error;
+  AwaitBoth(a, b, rows, error);
+  CHECK(rows == 0);
+  a->Complete(3);
+  CHECK(rows == 3);
+  b->Fail("failed");
+  CHECK(rows == 3 && error == "failed");
+
+  std::vector<std::function<void()>> queued;
+  auto c = std::make_shared<ManualFuture>();
+  AwaitOn(c, [&](std::function<void()> fn) { queued.push_back(fn); }, rows);
+  c->Complete(4);
+  CHECK(rows == 3 && queued.size() == 1);
+  queued[0]();
+  CHECK(rows == 7);
+
+  // logged, neither escapes the task
+  for (auto std_exception : {true, false}) {
+    auto d = std::make_shared<ManualFuture>();
+    Throw(d, std_exception);
+    d->Complete(0);
+  }
+
+  // the FutureImpl of a real request
+  auto& mock = *new MockServer;  // its threads are detached, kept until exit
+  auto conn = Connect("127.0.0.1", mock.Port());
+  std::atomic<std::size_t> real_rows = 0;
+  std::atomic<int> failed = 0, done = 0;
+  AwaitRows(conn->ExecuteAsync("select 1"), real_rows, failed, done);
+  WaitFor(done, 1);
+  CHECK(done == 1 && failed == 0 && real_rows == std::size_t(kSelectRows));
+  // awaited twice while in flight, each awaiter resumes, with the error as
+  // the connection is closed before the reply
+  auto received = mock.Received();
+  mock.Hold(true);
+  auto held = conn->ExecuteAsync("select 1");
+  while (mock.Received() == received)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  AwaitRows(held, real_rows, failed, done);
+  AwaitRows(held, real_rows, failed, done);
+  CHECK(held->OnReady([&done]() { ++done; }));
+  conn->Close();
+  WaitFor(done, 4);
+  CHECK(done == 4 && failed == 2);
+  std::cout << "ok" << std::endl;
+  return 0;
+}
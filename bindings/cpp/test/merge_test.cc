@@ -0,0 +1,117 @@
+// MergeResults of the parts of a fanned-out select, by hand-built columns:
+// the rows of the parts interleave on the sort column, nulls first and ties
+// in the order of the parts, and the columns not in a part come out null.
+
+#include "opentick.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace opentick;
+
+// assert is compiled out of the default Release build
+#define CHECK(cond)                                                   \
+  if (!(cond)) {                                                      \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl; \
+    std::exit(1);                                                     \
+  }
+
+static ColumnarResultSet Part(std::vector<Column> cols) {
+  auto res = std::make_shared<ColumnarResult>();
+  res->num_rows = cols.size() ? cols[0].size : 0;
+  res->cols = std::move(cols);
+  return res;
+}
+
+static Column Ints(std::vector<std::int64_t> v) {
+  Column col;
+  for (auto x : v) col.Append(Column::kInt64, x);
+  return col;
+}
+
+static Column Doubles(std::vector<double> v) {
+  Column col;
+  for (auto x : v) col.Append(x);
+  return col;
+}
+
+// "" is a null cell
+static Column Strings(std::vector<std::string> v) {
+  Column col;
+  for (auto& x : v) {
+    if (x.empty())
+      col.AppendNull();
+    else
+      col.Append(x);
+  }
+  return col;
+}
+
+static std::int64_t Int(const Column& col, std::size_t row) {
+  auto v = col.Get(row);
+  return std::get<std::int64_t>(v);
+}
+
+int main() {
+  // parts of different widths, the second one lacks the last column
+  auto a = Part({Ints({1, 4, 7}), Strings({"a", "bb", "ccc"}),
+                 Ints({10, 40, 70})});
+  auto b = Part({Ints({2, 3, 8}), Strings({"dddd", "", "e"})});
+  auto res = MergeResults({a, b}, 0);
+  CHECK(res->num_rows == 6 && res->cols.size() == 3);
+  std::int64_t keys[] = {1, 2, 3, 4, 7, 8};
+  for (auto i = 0u; i < 6; ++i) CHECK(Int(res->cols[0], i) == keys[i]);
+  // string runs appended block by block, offset past the chars before them
+  auto& s = res->cols[1];
+  CHECK(s.type == Column::kString);
+  CHECK(s.String(0) == "a" && s.String(1) == "dddd" && s.IsNull(2));
+  CHECK(s.String(3) == "bb" && s.String(4) == "ccc" && s.String(5) == "e");
+  CHECK(s.chars == "addddbbccce");
+  auto& wide = res->cols[2];
+  CHECK(Int(wide, 0) == 10 && wide.IsNull(1) && wide.IsNull(2));
+  CHECK(Int(wide, 3) == 40 && Int(wide, 4) == 70 && wide.IsNull(5));
+
+  // null sort keys first, ties in the order of the parts
+  Column nulls;
+  nulls.AppendNull();
+  nulls.AppendNull();
+  auto c = Part({Ints({0, 5}), Ints({100, 101})});
+  auto d = Part({std::move(nulls), Ints({200, 201})});
+  auto e = Part({Ints({5}), Ints({300})});
+  res = MergeResults({c, d, e}, 0);
+  CHECK(res->num_rows == 5);
+  auto& tag = res->cols[1];
+  CHECK(Int(tag, 0) == 200 && Int(tag, 1) == 201);
+  CHECK(res->cols[0].IsNull(0) && res->cols[0].IsNull(1));
+  CHECK(Int(tag, 2) == 100 && Int(tag, 3) == 101 && Int(tag, 4) == 300);
+
+  // an int and a double sort column compare by value, the merged column
+  // holds both
+  auto f = Part({Ints({1, 3, 5}), Ints({0, 1, 2})});
+  auto g = Part({Doubles({2.5, 3.0, 4.5}), Ints({3, 4, 5})});
+  res = MergeResults({f, g}, 0);
+  CHECK(res->num_rows == 6);
+  std::int64_t order[] = {0, 3, 1, 4, 5, 2};
+  for (auto i = 0u; i < 6; ++i) CHECK(Int(res->cols[1], i) == order[i]);
+  auto& mixed = res->cols[0];
+  CHECK(mixed.type == Column::kMixed);
+  CHECK(std::get<std::int64_t>(mixed.Get(0)) == 1);
+  CHECK(std::get<double>(mixed.Get(1)) == 2.5);
+
+  // without a sort column the parts are concatenated, an empty part skipped
+  res = MergeResults({g, Part({}), f}, -1);
+  CHECK(res->num_rows == 6 && Int(res->cols[1], 0) == 3);
+  CHECK(Int(res->cols[1], 3) == 0);
+  CHECK(MergeResults({Part({}), f}, 0) == f);
+
+  // only numeric columns merge
+  auto threw = false;
+  try {
+    MergeResults({a, b}, 1);
+  } catch (Exception& e) {
+    threw = true;
+  }
+  CHECK(threw);
+  std::cout << "ok" << std::endl;
+  return 0;
+}
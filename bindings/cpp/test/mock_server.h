@@ -0,0 +1,308 @@
+// In-process mock of the server for the benchmarks and the tests of the
+// client, see MockServer
+
+#ifndef OPENTICK_MOCK_SERVER_H_
+#define OPENTICK_MOCK_SERVER_H_
+
+#include "opentick.h"
+
+#include <sys/socket.h>
+
+namespace opentick {
+namespace mock {
+
+using namespace std::chrono;
+using boost::asio::ip::tcp;
+
+const int kSelectRows = 1000;
+const int kStreamRows = 100000;  // rows of a paged select of the mock
+
+inline Args Bar(int i) {
+  auto tm = Tm(seconds(1500000000) + microseconds(i));
+  return Args{1, 1, tm, 2.2, 2.4, 2.1, 2.3, 1000000, 2.25};
+}
+
+// Columnar reply block of rows of int, double and Tm cells, see columnar.go
+inline std::string EncodeColumnar(const Argss& rows) {
+  std::string out;
+  auto put = [&](auto v) {
+    v = boost::endian::native_to_little(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  };
+  auto ncols = rows.empty() ? 0 : rows[0].size();
+  put(std::uint32_t(rows.size()));
+  put(std::uint32_t(ncols));
+  for (auto j = 0u; j < ncols; ++j) {
+    auto& first = rows[0][j];
+    auto type = std::holds_alternative<double>(first) ? columnar::kDouble
+                : std::holds_alternative<Tm>(first)   ? columnar::kTime
+                                                      : columnar::kInt64;
+    out.push_back(type);
+    out.push_back(0);  // no nulls
+    for (auto& row : rows) {
+      if (type == columnar::kDouble) {
+        std::uint64_t v;
+        memcpy(&v, &std::get<double>(row[j]), sizeof(v));
+        put(v);
+      } else if (type == columnar::kTime) {
+        put(std::int64_t(
+            duration_cast<nanoseconds>(std::get<Tm>(row[j]).time_since_epoch())
+                .count()));
+      } else {
+        put(std::int64_t(std::get<int>(row[j])));
+      }
+    }
+  }
+  return out;
+}
+
+// Answers requests with canned replies: ids for "prepare", kSelectRows rows
+// for any select, pages of kStreamRows rows for a select with a limit, null
+// otherwise, rows are columnar once a socket sends "protocol=columnar".
+// Each socket hands out prepared ids from the number of sockets before it,
+// so that a reconnected session gets other ids than the lost one. Like the
+// server, which runs the requests of a socket concurrently, a prepare read
+// along with an earlier "use", before its reply, fails.
+class MockServer {
+ public:
+  MockServer() : acceptor_(io_service_, tcp::endpoint(tcp::v4(), 0)) {
+    Argss rows;
+    for (auto i = 0; i < kSelectRows; ++i) rows.push_back(Bar(i));
+    BsonWriter w(rows_);
+    for (auto i = 0u; i < rows.size(); ++i) w.Write(ArrayKey(i).str, rows[i]);
+    columns_ = EncodeColumnar(rows);
+    std::thread([this]() {
+      for (;;) {
+        auto socket = std::make_shared<tcp::socket>(io_service_);
+        acceptor_.accept(*socket);
+        socket->set_option(tcp::no_delay(true));
+        {
+          std::lock_guard<std::mutex> lk(m_);
+          sockets_.push_back(socket);
+        }
+        std::thread([this, socket]() { Serve(*socket); }).detach();
+      }
+    }).detach();
+  }
+  int Port() const { return acceptor_.local_endpoint().port(); }
+  // Shuts down the open sockets as a lost connection
+  void Drop() {
+    std::lock_guard<std::mutex> lk(m_);
+    for (auto& weak : sockets_) {
+      if (auto socket = weak.lock())
+        ::shutdown(socket->native_handle(), SHUT_RDWR);
+    }
+    sockets_.clear();
+  }
+  // While held, requests are read and left unanswered
+  void Hold(bool hold) { hold_ = hold; }
+  std::size_t Received() const { return received_; }
+
+ private:
+  struct Request {
+    std::int64_t ticker = 0;
+    std::string cmd;
+    std::string sql;
+    std::int64_t id = -1;
+    std::string cursor;
+    std::size_t num_argss = 0;  // parameter sets of "many"
+    std::int64_t load_rows = 0;  // of the block of "load"
+    std::int64_t load_bytes = 0;
+  };
+  static bool Parse(const std::uint8_t* p, const std::uint8_t* end,
+                    Request& r);
+  void Reply(const Request& r, std::vector<std::string>& prepared,
+             bool columnar, bool use_pending, std::vector<std::uint8_t>& out);
+  void Serve(tcp::socket& socket);
+  boost::asio::io_service io_service_;
+  tcp::acceptor acceptor_;
+  std::vector<std::uint8_t> rows_;
+  std::string columns_;
+  std::mutex m_;
+  std::vector<std::weak_ptr<tcp::socket>> sockets_;
+  std::atomic<std::size_t> num_sockets_ = 0;
+  std::atomic<bool> hold_ = false;
+  std::atomic<std::size_t> received_ = 0;  // requests parsed
+};
+
+template <typename T>
+inline T Load(const std::uint8_t* p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return boost::endian::little_to_native(v);
+}
+
+inline bool MockServer::Parse(const std::uint8_t* p,
+                              const std::uint8_t* end, Request& r) {
+  p += 4;
+  while (p < end && *p) {
+    auto type = *p++;
+    auto key = reinterpret_cast<const char*>(p);
+    p += strlen(key) + 1;
+    std::int64_t n = 0;
+    switch (type) {
+      case bson_type::kInt32:
+        n = Load<std::int32_t>(p);
+        p += 4;
+        break;
+      case bson_type::kInt64:
+        n = Load<std::int64_t>(p);
+        p += 8;
+        break;
+      case bson_type::kString:
+        if (*key == '1')
+          r.cmd = reinterpret_cast<const char*>(p + 4);
+        else if (*key == '2')
+          r.sql = reinterpret_cast<const char*>(p + 4);
+        p += 4 + Load<std::int32_t>(p);
+        continue;
+      case bson_type::kArray:
+        if (*key == '3') {
+          auto q = p + 4;
+          for (; *q == bson_type::kArray; ++r.num_argss) {
+            q += strlen(reinterpret_cast<const char*>(q + 1)) + 2;
+            q += Load<std::int32_t>(q);
+          }
+          if (*q == bson_type::kBinary) {
+            q += strlen(reinterpret_cast<const char*>(q + 1)) + 2;
+            r.load_bytes = Load<std::int32_t>(q);
+            r.load_rows = Load<std::uint32_t>(q + 5);
+          }
+        }
+        p += Load<std::int32_t>(p);
+        continue;
+      case bson_type::kBinary:
+        if (*key == '4')
+          r.cursor.assign(reinterpret_cast<const char*>(p + 5),
+                          Load<std::int32_t>(p));
+        p += 5 + Load<std::int32_t>(p);
+        continue;
+      case bson_type::kNull:
+        continue;
+      default:
+        return false;
+    }
+    if (*key == '0') r.ticker = n;
+    if (*key == '2') r.id = n;
+  }
+  return true;
+}
+
+inline void MockServer::Reply(const Request& r,
+                              std::vector<std::string>& prepared,
+                              bool columnar, bool use_pending,
+                              std::vector<std::uint8_t>& out) {
+  auto sql = r.sql;
+  if (r.id >= 0 && r.id < std::int64_t(prepared.size())) sql = prepared[r.id];
+  EncodeFrame(out, [&](BsonWriter& w) {
+    auto start = w.Begin();
+    w.Write("0", r.ticker);
+    if (r.cmd == "prepare" && use_pending) {
+      w.Write("1", std::string("No database name has been specified"));
+    } else if (r.cmd == "prepare") {
+      prepared.push_back(sql);
+      w.Write("1", std::int64_t(prepared.size() - 1));
+    } else if (r.cmd == "run" && !sql.compare(0, 6, "select")) {
+      auto limit = sql.find(" limit ");
+      if (limit == std::string::npos) {
+        if (columnar)
+          w.WriteBinary("1", columns_, columnar::kSubtype);
+        else
+          w.Write("1", BsonRawArray{rows_});
+      } else {
+        std::int64_t begin = 0;
+        if (r.cursor.size() == sizeof(begin))
+          memcpy(&begin, r.cursor.data(), sizeof(begin));
+        auto end = std::min<std::int64_t>(
+            begin + atoi(sql.c_str() + limit + 7), kStreamRows);
+        Argss rows;
+        for (auto i = begin; i < end; ++i) rows.push_back(Bar(i));
+        if (columnar)
+          w.WriteBinary("1", EncodeColumnar(rows), columnar::kSubtype);
+        else
+          w.Write("1", rows);
+        if (end < kStreamRows) {
+          w.WriteBinary("2", std::string(reinterpret_cast<char*>(&end),
+                                         sizeof(end)));
+        }
+      }
+    } else if (r.cmd == "load") {
+      w.Write("1", Argss{{r.load_rows, std::int64_t(1), r.load_bytes}});
+    } else {
+      w.Write("1", nullptr);
+    }
+    w.End(start);
+  });
+}
+
+// Replies to all complete frames of one read in one write
+inline void MockServer::Serve(tcp::socket& socket) {
+  static const std::string kColumnar = "protocol=columnar";
+  static const std::string kCompress = "compress=";
+  std::vector<std::string> prepared(num_sockets_++);
+  auto columnar = false;
+  auto use_pending = false;  // a "use" is answered with this read
+  std::size_t compress_min = 0;
+  std::vector<std::uint8_t> in(1 << 20), out, inflated;
+  std::size_t n = 0;
+  boost::system::error_code e;
+  for (;;) {
+    if (n == in.size()) in.resize(in.size() * 2);
+    n += socket.read_some(boost::asio::buffer(in.data() + n, in.size() - n), e);
+    if (e) return;
+    auto p = in.data();
+    auto end = in.data() + n;
+    while (end - p >= 4) {
+      auto len = Load<std::uint32_t>(p);
+      auto compressed = (len & kCompressedFrame) != 0;
+      len &= ~kCompressedFrame;
+      if (std::size_t(end - p) < 4 + len) break;
+      auto body = p + 4;
+      p += 4 + len;
+      if (compressed) {
+        InflateFrame(body, len, inflated);
+        body = inflated.data();
+        len = inflated.size();
+      }
+      auto respond = [&](const Request& r) {
+        auto n0 = out.size();
+        Reply(r, prepared, columnar, use_pending, out);
+        if (compress_min && out.size() - n0 - 4 >= compress_min)
+          CompressFrame(out, n0);
+      };
+      Request r;
+      if (len == kColumnar.size() && !memcmp(body, kColumnar.data(), len)) {
+        columnar = true;
+      } else if (len > kCompress.size() &&
+                 !memcmp(body, kCompress.data(), kCompress.size())) {
+        compress_min = atoi(std::string(body + kCompress.size(), body + len)
+                                .c_str());
+      } else if (len && Parse(body, body + len, r)) {
+        ++received_;
+        if (hold_) continue;
+        if (r.cmd == "use") use_pending = true;
+        // "many" replies as one "run" per parameter set, then nil
+        for (std::size_t i = 0; r.cmd == "many" && i < r.num_argss; ++i) {
+          auto part = r;
+          part.cmd = "run";
+          part.ticker = r.ticker + 1 + i;
+          respond(part);
+        }
+        respond(r);
+      }
+    }
+    n = end - p;
+    memmove(in.data(), p, n);
+    if (out.size()) {
+      boost::asio::write(socket, boost::asio::buffer(out), e);
+      if (e) return;
+      out.clear();
+    }
+    use_pending = false;
+  }
+}
+
+}  // namespace mock
+}  // namespace opentick
+
+#endif  // OPENTICK_MOCK_SERVER_H_
@@ -0,0 +1,92 @@
+// Reconnecting against the in-process MockServer, whose new session hands
+// out other prepared ids than the lost one: requests in flight are replayed
+// and those made meanwhile wait for the prepares, with the new ids.
+
+#include "mock_server.h"
+#include "opentick.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace opentick;
+using namespace opentick::mock;
+
+// assert is compiled out of the default Release build
+#define CHECK(cond)                                                   \
+  if (!(cond)) {                                                      \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl; \
+    std::exit(1);                                                     \
+  }
+
+static const std::string kSelect =
+    "select * from test where sec=? and interval=?";
+
+// A stale id resolves to no statement on the mock, which replies null
+static bool HasRows(const Future& f) {
+  auto rows = f->Get(5);
+  return rows && rows->size() == std::size_t(kSelectRows);
+}
+
+int main() {
+  auto& mock = *new MockServer;  // its threads are detached, kept until exit
+  ReconnectOptions options;
+  options.min_delay_ms = 10;
+  options.max_delay_ms = 50;
+  options.replay = ReconnectOptions::kReplaySelects;
+  auto conn = Connect("127.0.0.1", mock.Port());
+  conn->SetReconnect(true, options);
+  conn->Use("test");
+  CHECK(conn->Prepare(kSelect) == 0);
+  CHECK(HasRows(conn->ExecuteAsync(kSelect, Args{1, 1})));
+
+  // one request in flight as the socket is lost, one made right after
+  auto received = mock.Received();
+  mock.Hold(true);
+  auto replayed = conn->ExecuteAsync(kSelect, Args{1, 1});
+  while (mock.Received() == received)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  mock.Hold(false);
+  mock.Drop();
+  auto waiting = conn->ExecuteAsync(kSelect, Args{1, 1});
+  CHECK(HasRows(replayed));
+  CHECK(HasRows(waiting));
+  CHECK(conn->Metrics().reconnects == 1);
+  CHECK(conn->Prepare(kSelect) == 1);  // the first id of the second socket
+  conn->Close();
+
+  // not replayed, a request racing the loss either fails or runs its own
+  // statement, never one of the lost session's ids
+  options.replay = ReconnectOptions::kReplayNone;
+  auto conn2 = Connect("127.0.0.1", mock.Port());
+  conn2->SetReconnect(true, options);
+  conn2->Use("test");
+  CHECK(HasRows(conn2->ExecuteAsync(kSelect, Args{1, 1})));
+  std::atomic<bool> done = false;
+  std::atomic<int> ok = 0, wrong = 0;
+  std::vector<std::thread> threads;
+  for (auto i = 0; i < 2; ++i) {
+    threads.emplace_back([&]() {
+      while (!done) {
+        try {
+          if (HasRows(conn2->ExecuteAsync(kSelect, Args{1, 1})))
+            ++ok;
+          else
+            ++wrong;
+        } catch (Exception& e) {
+        }
+      }
+    });
+  }
+  for (auto i = 0; i < 3; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    mock.Drop();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  done = true;
+  for (auto& t : threads) t.join();
+  CHECK(ok > 0 && wrong == 0);
+  CHECK(conn2->Metrics().reconnects == 3);
+  conn2->Close();
+  std::cout << "ok" << std::endl;
+  return 0;
+}
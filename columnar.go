@@ -0,0 +1,353 @@
+package opentick
+
+import (
+	"encoding/binary"
+	"errors"
+	"github.com/apple/foundationdb/bindings/go/src/fdb/tuple"
+	"gopkg.in/mgo.v2/bson"
+	"math"
+	"strconv"
+)
+
+// Columnar replies, negotiated per connection with "protocol=columnar", carry
+// the rows of a bson reply as a binary of subtype columnarSubtype:
+//
+//	uint32 rows, uint32 cols, then for each column
+//	uint8 type, uint8 hasNulls, [(rows+63)/64 uint64 null bitmap], values
+//
+// all little-endian. Null cells are set in the bitmap and zero in the values:
+//
+//	colInt64, colTime (ns since epoch)  rows int64
+//	colDouble                           rows float64
+//	colBool                             rows uint8
+//	colString                           rows uint32 end offsets, the bytes
+//	colMixed                            bson document {"0": cell, ...}
+//	colNull                             nothing
+const columnarSubtype = 0x80
+
+const (
+	colNull byte = iota
+	colInt64
+	colDouble
+	colTime
+	colBool
+	colString
+	colMixed
+)
+
+func columnarCellType(v interface{}) byte {
+	switch v2 := v.(type) {
+	case nil:
+		return colNull
+	case int, int64, int32, int16, int8, uint32, uint16, uint8:
+		return colInt64
+	case float64, float32:
+		return colDouble
+	case bool:
+		return colBool
+	case string:
+		return colString
+	case tuple.Tuple:
+		if len(v2) == 2 {
+			if _, ok := getInt(v2[0]); ok {
+				if _, ok := getInt(v2[1]); ok {
+					return colTime
+				}
+			}
+		}
+	}
+	return colMixed
+}
+
+func columnarInt(v interface{}) int64 {
+	switch v2 := v.(type) {
+	case int:
+		return int64(v2)
+	case int64:
+		return v2
+	case int32:
+		return int64(v2)
+	case int16:
+		return int64(v2)
+	case int8:
+		return int64(v2)
+	case uint32:
+		return int64(v2)
+	case uint16:
+		return int64(v2)
+	case uint8:
+		return int64(v2)
+	case tuple.Tuple:
+		sec, _ := getInt(v2[0])
+		nsec, _ := getInt(v2[1])
+		return sec*1000000000 + nsec
+	}
+	return 0
+}
+
+func encodeColumnar(rows [][]interface{}) (data []byte, err error) {
+	nrows := len(rows)
+	ncols := 0
+	if nrows > 0 {
+		ncols = len(rows[0])
+	}
+	for _, row := range rows {
+		if len(row) != ncols {
+			return nil, errors.New("All rows must have the same number of columns")
+		}
+	}
+	var u32 [4]byte
+	var u64 [8]byte
+	putUint32 := func(v uint32) {
+		binary.LittleEndian.PutUint32(u32[:], v)
+		data = append(data, u32[:]...)
+	}
+	putUint64 := func(v uint64) {
+		binary.LittleEndian.PutUint64(u64[:], v)
+		data = append(data, u64[:]...)
+	}
+	putUint32(uint32(nrows))
+	putUint32(uint32(ncols))
+	nulls := make([]uint64, (nrows+63)/64)
+	for j := 0; j < ncols; j++ {
+		typ := colNull
+		hasNulls := false
+		for i := range nulls {
+			nulls[i] = 0
+		}
+		for i, row := range rows {
+			t := columnarCellType(row[j])
+			if t == colNull {
+				hasNulls = true
+				nulls[i/64] |= 1 << uint(i%64)
+			} else if typ == colNull {
+				typ = t
+			} else if typ != t {
+				typ = colMixed
+			}
+		}
+		if typ == colMixed || typ == colNull {
+			hasNulls = false
+		}
+		data = append(data, typ)
+		if hasNulls {
+			data = append(data, 1)
+			for _, w := range nulls {
+				putUint64(w)
+			}
+		} else {
+			data = append(data, 0)
+		}
+		switch typ {
+		case colInt64, colTime:
+			for _, row := range rows {
+				putUint64(uint64(columnarInt(row[j])))
+			}
+		case colDouble:
+			for _, row := range rows {
+				var f float64
+				switch v := row[j].(type) {
+				case float64:
+					f = v
+				case float32:
+					f = float64(v)
+				}
+				putUint64(math.Float64bits(f))
+			}
+		case colBool:
+			for _, row := range rows {
+				if v, _ := row[j].(bool); v {
+					data = append(data, 1)
+				} else {
+					data = append(data, 0)
+				}
+			}
+		case colString:
+			end := 0
+			for _, row := range rows {
+				v, _ := row[j].(string)
+				end += len(v)
+				if end > math.MaxUint32 {
+					return nil, errors.New("Results too large")
+				}
+				putUint32(uint32(end))
+			}
+			for _, row := range rows {
+				v, _ := row[j].(string)
+				data = append(data, v...)
+			}
+		case colMixed:
+			cells := make(bson.D, nrows)
+			for i, row := range rows {
+				cells[i] = bson.DocElem{Name: strconv.Itoa(i), Value: row[j]}
+			}
+			doc, err1 := bson.Marshal(cells)
+			if err1 != nil {
+				return nil, err1
+			}
+			data = append(data, doc...)
+		}
+	}
+	return
+}
+
+// Column of a block of decodeColumnar, the cells in the slice of its type
+type columnarColumn struct {
+	typ    byte
+	nulls  []uint64      // nil without nulls
+	ints   []int64       // colInt64, colTime, colBool
+	floats []float64     // colDouble
+	strs   []string      // colString
+	mixed  []interface{} // colMixed
+}
+
+func (self *columnarColumn) isNull(i int) bool {
+	if self.typ == colNull {
+		return true
+	}
+	if self.typ == colMixed {
+		return self.mixed[i] == nil
+	}
+	return self.nulls != nil && (self.nulls[i/64]>>uint(i%64))&1 != 0
+}
+
+// Cell i as bson decodes it, a time as [sec, nsec]
+func (self *columnarColumn) cell(i int) interface{} {
+	if self.isNull(i) {
+		return nil
+	}
+	switch self.typ {
+	case colInt64:
+		return self.ints[i]
+	case colTime:
+		sec, nsec := splitNanos(self.ints[i])
+		return []interface{}{sec, nsec}
+	case colDouble:
+		return self.floats[i]
+	case colBool:
+		return self.ints[i] != 0
+	case colString:
+		return self.strs[i]
+	}
+	return self.mixed[i]
+}
+
+func splitNanos(ns int64) (sec int64, nsec int64) {
+	sec, nsec = ns/1000000000, ns%1000000000
+	if nsec < 0 {
+		sec, nsec = sec-1, nsec+1000000000
+	}
+	return
+}
+
+var errInvalidColumnar = errors.New("Invalid columnar block")
+
+// Inverse of encodeColumnar. The counts are checked against the payload
+// before anything is allocated from them, a block of nulls only is rejected
+// since its row count is not backed by any data.
+func decodeColumnar(data []byte) (nrows int, cols []columnarColumn, err error) {
+	le := binary.LittleEndian
+	if len(data) < 8 {
+		return 0, nil, errInvalidColumnar
+	}
+	nrows = int(le.Uint32(data))
+	ncols := int(le.Uint32(data[4:]))
+	p := data[8:]
+	if ncols > len(p)/2 {
+		return 0, nil, errInvalidColumnar
+	}
+	cols = make([]columnarColumn, ncols)
+	need := func(n int) bool { return n >= 0 && len(p) >= n }
+	backed := nrows == 0
+	for j := range cols {
+		col := &cols[j]
+		if !need(2) {
+			return 0, nil, errInvalidColumnar
+		}
+		col.typ = p[0]
+		hasNulls := p[1] != 0
+		p = p[2:]
+		if hasNulls {
+			n := (nrows + 63) / 64
+			if !need(n * 8) {
+				return 0, nil, errInvalidColumnar
+			}
+			col.nulls = make([]uint64, n)
+			for i := range col.nulls {
+				col.nulls[i] = le.Uint64(p[i*8:])
+			}
+			p = p[n*8:]
+		}
+		if col.typ != colNull {
+			backed = true
+		}
+		switch col.typ {
+		case colNull:
+		case colInt64, colTime, colDouble:
+			if !need(nrows * 8) {
+				return 0, nil, errInvalidColumnar
+			}
+			if col.typ == colDouble {
+				col.floats = make([]float64, nrows)
+				for i := range col.floats {
+					col.floats[i] = math.Float64frombits(le.Uint64(p[i*8:]))
+				}
+			} else {
+				col.ints = make([]int64, nrows)
+				for i := range col.ints {
+					col.ints[i] = int64(le.Uint64(p[i*8:]))
+				}
+			}
+			p = p[nrows*8:]
+		case colBool:
+			if !need(nrows) {
+				return 0, nil, errInvalidColumnar
+			}
+			col.ints = make([]int64, nrows)
+			for i := range col.ints {
+				col.ints[i] = int64(p[i])
+			}
+			p = p[nrows:]
+		case colString:
+			if !need(nrows * 4) {
+				return 0, nil, errInvalidColumnar
+			}
+			ends := p[:nrows*4]
+			p = p[nrows*4:]
+			col.strs = make([]string, nrows)
+			begin := 0
+			for i := range col.strs {
+				end := int(le.Uint32(ends[i*4:]))
+				if end < begin || !need(end) {
+					return 0, nil, errInvalidColumnar
+				}
+				col.strs[i] = string(p[begin:end])
+				begin = end
+			}
+			p = p[begin:]
+		case colMixed:
+			if !need(4) || !need(int(le.Uint32(p))) {
+				return 0, nil, errInvalidColumnar
+			}
+			n := int(le.Uint32(p))
+			var cells bson.M
+			if err = bson.Unmarshal(p[:n], &cells); err != nil {
+				return
+			}
+			if len(cells) != nrows {
+				return 0, nil, errInvalidColumnar
+			}
+			p = p[n:]
+			col.mixed = make([]interface{}, nrows)
+			for i := range col.mixed {
+				col.mixed[i] = cells[strconv.Itoa(i)]
+			}
+		default:
+			return 0, nil, errors.New("Unsupported column type " + strconv.Itoa(int(col.typ)))
+		}
+	}
+	if !backed {
+		return 0, nil, errInvalidColumnar
+	}
+	return
+}
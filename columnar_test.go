@@ -0,0 +1,112 @@
+package opentick
+
+import (
+	"encoding/binary"
+	"github.com/apple/foundationdb/bindings/go/src/fdb/tuple"
+	"github.com/stretchr/testify/assert"
+	"gopkg.in/mgo.v2/bson"
+	"math"
+	"testing"
+)
+
+var columnarRows = [][]interface{}{
+	{int64(1), tuple.Tuple{int64(1500000000), int64(7)}, 2.5, "ab", true, nil, 1},
+	{int64(-2), tuple.Tuple{int64(1500000001), int64(0)}, nil, "", false, nil, "x"},
+	{int64(3), nil, float32(0.5), "cde", nil, nil, nil},
+}
+
+func Test_EncodeColumnar(t *testing.T) {
+	data, err := encodeColumnar(columnarRows)
+	assert.Equal(t, nil, err)
+	le := binary.LittleEndian
+	assert.Equal(t, uint32(3), le.Uint32(data))
+	assert.Equal(t, uint32(7), le.Uint32(data[4:]))
+	p := data[8:]
+	// int64
+	assert.Equal(t, []byte{colInt64, 0}, p[:2])
+	assert.Equal(t, int64(-2), int64(le.Uint64(p[10:])))
+	p = p[2+3*8:]
+	// time with a null in row 2
+	assert.Equal(t, []byte{colTime, 1}, p[:2])
+	assert.Equal(t, uint64(4), le.Uint64(p[2:]))
+	assert.Equal(t, int64(1500000000*1000000000+7), int64(le.Uint64(p[10:])))
+	assert.Equal(t, int64(0), int64(le.Uint64(p[26:])))
+	p = p[2+8+3*8:]
+	// double, float32 widened
+	assert.Equal(t, []byte{colDouble, 1}, p[:2])
+	assert.Equal(t, uint64(2), le.Uint64(p[2:]))
+	assert.Equal(t, 0.5, math.Float64frombits(le.Uint64(p[26:])))
+	p = p[2+8+3*8:]
+	// string end offsets then bytes
+	assert.Equal(t, []byte{colString, 0}, p[:2])
+	assert.Equal(t, uint32(2), le.Uint32(p[2:]))
+	assert.Equal(t, uint32(2), le.Uint32(p[6:]))
+	assert.Equal(t, uint32(5), le.Uint32(p[10:]))
+	assert.Equal(t, "abcde", string(p[14:19]))
+	p = p[19:]
+	assert.Equal(t, []byte{colBool, 1, 4, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0}, p[:13])
+	p = p[13:]
+	assert.Equal(t, []byte{colNull, 0}, p[:2])
+	p = p[2:]
+	// cells of different types
+	assert.Equal(t, []byte{colMixed, 0}, p[:2])
+	var mixed bson.M
+	assert.Equal(t, nil, bson.Unmarshal(p[2:], &mixed))
+	assert.Equal(t, bson.M{"0": 1, "1": "x", "2": nil}, mixed)
+	assert.Equal(t, int(le.Uint32(p[2:])), len(p[2:]))
+}
+
+func Test_EncodeColumnarEmpty(t *testing.T) {
+	data, err := encodeColumnar([][]interface{}{})
+	assert.Equal(t, nil, err)
+	assert.Equal(t, make([]byte, 8), data)
+	_, err = encodeColumnar([][]interface{}{{1}, {1, 2}})
+	assert.Equal(t, "All rows must have the same number of columns", err.Error())
+}
+
+func Test_DecodeColumnar(t *testing.T) {
+	data, err := encodeColumnar([][]interface{}{
+		{int64(1), tuple.Tuple{int64(-1), int64(999999999)}, 2.5, "ab", true, nil},
+		{int64(-2), nil, nil, "cde", false, nil},
+	})
+	assert.Equal(t, nil, err)
+	n, cols, err := decodeColumnar(data)
+	assert.Equal(t, nil, err)
+	assert.Equal(t, 2, n)
+	assert.Equal(t, 6, len(cols))
+	assert.Equal(t, int64(-2), cols[0].cell(1))
+	assert.Equal(t, []interface{}{int64(-1), int64(999999999)}, cols[1].cell(0))
+	assert.Equal(t, nil, cols[1].cell(1))
+	assert.Equal(t, 2.5, cols[2].cell(0))
+	assert.Equal(t, true, cols[2].isNull(1))
+	assert.Equal(t, "cde", cols[3].cell(1))
+	assert.Equal(t, false, cols[4].cell(1))
+	assert.Equal(t, nil, cols[5].cell(0))
+	_, _, err = decodeColumnar(data[:len(data)-1])
+	assert.Equal(t, errInvalidColumnar, err)
+}
+
+func Test_DecodeColumnarMalformed(t *testing.T) {
+	block := func(nrows, ncols uint32, rest ...byte) []byte {
+		data := make([]byte, 8)
+		binary.LittleEndian.PutUint32(data, nrows)
+		binary.LittleEndian.PutUint32(data[4:], ncols)
+		return append(data, rest...)
+	}
+	// more columns than the payload can hold
+	_, _, err := decodeColumnar(block(1, math.MaxUint32, colNull, 0))
+	assert.Equal(t, errInvalidColumnar, err)
+	// rows backed by no data
+	_, _, err = decodeColumnar(block(math.MaxUint32, 1, colNull, 0))
+	assert.Equal(t, errInvalidColumnar, err)
+	_, _, err = decodeColumnar(block(math.MaxUint32, 1, colInt64, 0, 1, 2, 3, 4, 5, 6, 7, 8))
+	assert.Equal(t, errInvalidColumnar, err)
+	_, _, err = decodeColumnar(block(math.MaxUint32, 1, colBool, 1))
+	assert.Equal(t, errInvalidColumnar, err)
+	doc, _ := bson.Marshal(bson.D{{Name: "0", Value: 1}})
+	_, _, err = decodeColumnar(block(math.MaxUint32, 1, append([]byte{colMixed, 0}, doc...)...))
+	assert.Equal(t, errInvalidColumnar, err)
+	n, cols, err := decodeColumnar(block(0, 1, colNull, 0))
+	assert.Equal(t, nil, err)
+	assert.Equal(t, []interface{}{0, 1}, []interface{}{n, len(cols)})
+}
@@ -1,6 +1,7 @@
 package opentick
 
 import (
+	"bytes"
 	"errors"
 	"fmt"
 	"github.com/apple/foundationdb/bindings/go/src/fdb"
@@ -8,12 +9,15 @@ import (
 	"github.com/apple/foundationdb/bindings/go/src/fdb/tuple"
 	"math"
 	"reflect"
+	"sort"
 	"strconv"
 	"strings"
 	"sync"
 	"time"
 )
 
+// A row of the adj table, prices before Tm are multiplied by Px and volumes
+// by Vol. Cached ones are cumulative, the product of this and all later rows.
 type adjValue struct {
 	Tm  [2]int64
 	Px  float64
@@ -23,11 +27,14 @@ type adjValue struct {
 type adjCacheS struct {
 	mut    sync.Mutex
 	values map[string]map[int][]adjValue
+	gen    uint64 // bumped by clear, loads started before it are not kept
 }
 
+// Called once writes to an adj table are committed
 func (self *adjCacheS) clear(dbName string) {
 	self.mut.Lock()
 	delete(self.values, dbName)
+	self.gen++
 	self.mut.Unlock()
 }
 
@@ -63,6 +70,18 @@ func ExecuteStmt(db fdb.Transactor, stmt interface{}, args []interface{}) (res [
 	return
 }
 
+// ExecuteSelectPage runs a select statement from right after the key after
+// (from the start if empty), more is the key to resume the next page from, nil
+// once fewer rows than the limit are returned
+func ExecuteSelectPage(db fdb.Transactor, stmt interface{}, args []interface{}, after []byte) (res [][]interface{}, more []byte, err error) {
+	stmt2, ok := stmt.(selectStmt)
+	if !ok {
+		err = errors.New("Only select can be paged")
+		return
+	}
+	return executeSelectPage(db, &stmt2, args, after)
+}
+
 func Execute(db fdb.Transactor, dbName string, sql string, args []interface{}) (res [][]interface{}, err error) {
 	ast, err1 := Parse(sql)
 	if err1 != nil {
@@ -109,10 +128,10 @@ func Execute(db fdb.Transactor, dbName string, sql string, args []interface{}) (
 			if dbName == "" {
 				dbName = ast.Drop.Table.DatabaseName()
 			}
+			err = DropTable(db, dbName, ast.Drop.Table.TableName())
 			if ast.Drop.Table.TableName() == "adj" {
 				adjCache.clear(dbName)
 			}
-			err = DropTable(db, dbName, ast.Drop.Table.TableName())
 		}
 	} else {
 		stmt, err1 := Resolve(db, dbName, ast)
@@ -126,21 +145,107 @@ func Execute(db fdb.Transactor, dbName string, sql string, args []interface{}) (
 }
 
 func executeSelect(db fdb.Transactor, stmt *selectStmt, args []interface{}) (res [][]interface{}, err error) {
+	res, _, err = executeSelectPage(db, stmt, args, nil)
+	return
+}
+
+func executeSelectPage(db fdb.Transactor, stmt *selectStmt, args []interface{}, after []byte) (res [][]interface{}, more []byte, err error) {
 	sel, conds, err1 := executeWhere(db, stmt, args)
 	if err1 != nil {
 		err = err1
 		return
 	}
-	if bytes, ok := sel.([]byte); ok {
-		tmp, err1 := db.Transact(func(tr fdb.Transaction) (ret interface{}, err error) {
-			ret = tr.Get(fdb.Key(bytes)).MustGet()
-			return
-		})
-		if err1 != nil {
-			err = err1
+	if kr, ok := sel.(fdb.KeyRange); ok && len(after) > 0 {
+		if bytes.Compare(after, kr.Begin.FDBKey()) < 0 || bytes.Compare(after, kr.End.FDBKey()) >= 0 {
+			err = errors.New("Invalid page cursor")
 			return
 		}
-		bytes = tmp.([]byte)
+		if stmt.Reverse {
+			kr.End = fdb.Key(after)
+		} else {
+			kr.Begin = fdb.Key(append(append([]byte{}, after...), 0x00))
+		}
+		sel = kr
+	}
+	tmp, err2 := db.Transact(func(tr fdb.Transaction) (interface{}, error) {
+		return readSelect(tr, stmt, sel)
+	})
+	if err2 != nil {
+		err = err2
+		return
+	}
+	return decodeSelect(db, stmt, conds, tmp)
+}
+
+// ExecuteSelectMany runs a select statement once per arguments of argsArray,
+// all the ranges read concurrently in one read transaction so that they see
+// the same snapshot. errs[i] is set instead of res[i] for arguments rejected
+// before the read, err fails all of them.
+func ExecuteSelectMany(db fdb.Transactor, stmt interface{}, argsArray [][]interface{}) (res [][][]interface{}, errs []error, err error) {
+	stmt2, ok := stmt.(selectStmt)
+	if !ok {
+		err = errors.New("Only select can be run as many")
+		return
+	}
+	n := len(argsArray)
+	sels := make([]interface{}, n)
+	conds := make([][]condition, n)
+	errs = make([]error, n)
+	for i, args := range argsArray {
+		sels[i], conds[i], errs[i] = executeWhere(db, &stmt2, args)
+	}
+	tmp, err1 := db.ReadTransact(func(tr fdb.ReadTransaction) (interface{}, error) {
+		reads := make([]interface{}, n)
+		readErrs := make([]error, n)
+		var wg sync.WaitGroup
+		for i, sel := range sels {
+			if errs[i] != nil {
+				continue
+			}
+			wg.Add(1)
+			go func(i int, sel interface{}) {
+				defer wg.Done()
+				reads[i], readErrs[i] = readSelect(tr, &stmt2, sel)
+			}(i, sel)
+		}
+		wg.Wait()
+		for _, e := range readErrs {
+			if e != nil {
+				// the whole transaction is retried if e is retryable
+				return nil, e
+			}
+		}
+		return reads, nil
+	})
+	if err1 != nil {
+		err = err1
+		return
+	}
+	res = make([][][]interface{}, n)
+	for i, read := range tmp.([]interface{}) {
+		if errs[i] == nil {
+			res[i], _, errs[i] = decodeSelect(db, &stmt2, conds[i], read)
+		}
+	}
+	return
+}
+
+// Reads the key or key range sel of executeWhere
+func readSelect(tr fdb.ReadTransaction, stmt *selectStmt, sel interface{}) (interface{}, error) {
+	if bytes, ok := sel.([]byte); ok {
+		return tr.Get(fdb.Key(bytes)).Get()
+	}
+	limit := stmt.Limit
+	if stmt.Aggs != nil {
+		limit = 0 // of groups instead
+	}
+	return tr.GetRange(sel.(fdb.KeyRange), fdb.RangeOptions{Limit: limit, Reverse: stmt.Reverse}).GetSliceWithError()
+}
+
+// Rows of what readSelect read, more is the key of the last one if there may
+// be more past the limit
+func decodeSelect(db fdb.Transactor, stmt *selectStmt, conds []condition, read interface{}) (res [][]interface{}, more []byte, err error) {
+	if bytes, ok := read.([]byte); ok {
 		if len(bytes) == 0 {
 			return
 		}
@@ -149,8 +254,18 @@ func executeSelect(db fdb.Transactor, stmt *selectStmt, args []interface{}) (res
 			err = errors.New("Internal errror: " + err2.Error())
 			return
 		}
+		key := make(tuple.Tuple, len(conds))
+		for i := range conds {
+			key[i] = conds[i].Equal
+		}
+		if err = applyFuncOne(db, stmt, key, value); err != nil {
+			return
+		}
+		if stmt.Aggs != nil {
+			res = aggregateRows(stmt, [][2]tuple.Tuple{{key, value}})
+			return
+		}
 		res = []([]interface{}){make([]interface{}, len(stmt.Cols))}
-		applyFuncOne(stmt, value)
 		for i, col := range stmt.Cols {
 			if col.IsKey {
 				res[0][i] = conds[col.Pos].Equal
@@ -160,21 +275,13 @@ func executeSelect(db fdb.Transactor, stmt *selectStmt, args []interface{}) (res
 		}
 		return
 	}
-	kr := sel.(fdb.KeyRange)
-	tmp, err2 := db.Transact(func(tr fdb.Transaction) (interface{}, error) {
-		return tr.GetRange(kr, fdb.RangeOptions{Limit: stmt.Limit, Reverse: stmt.Reverse}).GetSliceWithError()
-	})
-	if err2 != nil {
-		err = err2
-		return
-	}
-	if tmp == nil {
-		return
-	}
-	recs := tmp.([]fdb.KeyValue)
+	recs, _ := read.([]fdb.KeyValue)
 	if len(recs) == 0 {
 		return
 	}
+	if stmt.Limit > 0 && len(recs) == stmt.Limit && stmt.Aggs == nil {
+		more = recs[len(recs)-1].Key
+	}
 	tmpRes := make([][2]tuple.Tuple, len(recs))
 	for i, rec := range recs {
 		key, err1 := stmt.Scheme.Dir.Unpack(rec.Key)
@@ -189,9 +296,21 @@ func executeSelect(db fdb.Transactor, stmt *selectStmt, args []interface{}) (res
 		}
 		tmpRes[i] = [2]tuple.Tuple{key, value}
 	}
-	applyFunc(stmt, tmpRes)
+	if err = applyFunc(db, stmt, tmpRes); err != nil {
+		return
+	}
+	if stmt.Aggs != nil {
+		res = aggregateRows(stmt, tmpRes)
+		return
+	}
+	res = selectRows(stmt, tmpRes)
+	return
+}
+
+// The selected columns of the keys and values of recs
+func selectRows(stmt *selectStmt, recs [][2]tuple.Tuple) (res [][]interface{}) {
 	res = make([]([]interface{}), len(recs))
-	for i, tmp := range tmpRes {
+	for i, tmp := range recs {
 		key, value := tmp[0], tmp[1]
 		row := make([]interface{}, len(stmt.Cols))
 		res[i] = row
@@ -210,7 +329,7 @@ func executeSelect(db fdb.Transactor, stmt *selectStmt, args []interface{}) (res
 
 func executeDelete(db fdb.Transactor, stmt *deleteStmt, args []interface{}) (err error) {
 	if stmt.Scheme.TblName == "adj" {
-		adjCache.clear(stmt.Scheme.DbName)
+		defer adjCache.clear(stmt.Scheme.DbName)
 	}
 	tmp, _, err1 := executeWhere(db, stmt, args)
 	if err1 != nil {
@@ -291,20 +410,153 @@ func executeWhere(db fdb.Transactor, stmt whereStmt, args []interface{}) (res in
 }
 
 func BatchInsert(db fdb.Transactor, stmt *insertStmt, argsArray [][]interface{}) (err error) {
+	if stmt.Scheme.TblName == "adj" {
+		defer adjCache.clear(stmt.Scheme.DbName)
+	}
+	watched := subscriptions.watching(stmt.Scheme)
+	var kvs []fdb.KeyValue
 	_, err = db.Transact(func(tr fdb.Transaction) (ret interface{}, err error) {
+		kvs = kvs[:0]
 		for _, args := range argsArray {
 			var parts [2][]tuple.TupleElement
 			err = prepareInsert(stmt, args, &parts)
 			if err != nil {
 				return
 			}
-			tr.Set(stmt.Scheme.Dir.Pack(tuple.Tuple(parts[0])), tuple.Tuple(parts[1]).Pack())
+			key, value := stmt.Scheme.Dir.Pack(tuple.Tuple(parts[0])), tuple.Tuple(parts[1]).Pack()
+			tr.Set(key, value)
+			if watched {
+				kvs = append(kvs, fdb.KeyValue{Key: key, Value: value})
+			}
 		}
 		return
 	})
+	if err == nil && watched {
+		subscriptions.publish(stmt.Scheme, kvs)
+	}
+	return
+}
+
+// Keys and values of one transaction of BulkLoad, FDB advises less than 1MB
+const loadTransactionBytes = 1 << 20
+
+// Transactions of one BulkLoad committing at once
+const maxLoadTransactions = 16
+
+type LoadStats struct {
+	Rows         int // committed
+	Transactions int
+	Bytes        int // of keys and values
+}
+
+// BulkLoad inserts the rows of a columnar block, one column per placeholder of
+// stmt. The rows are sorted by key and split into transactions of distinct key
+// ranges committed in parallel over dbs, so the load is not atomic, stats
+// counts what was committed also if err is set.
+func BulkLoad(dbs []fdb.Transactor, stmt *insertStmt, block []byte) (stats LoadStats, err error) {
+	nrows, cols, err1 := decodeColumnar(block)
+	if err1 != nil {
+		err = err1
+		return
+	}
+	if len(cols) != stmt.NumPlaceholders {
+		err = errors.New("Expected " + strconv.FormatInt(int64(stmt.NumPlaceholders), 10) + " columns, got " + strconv.FormatInt(int64(len(cols)), 10))
+		return
+	}
+	if stmt.Scheme.TblName == "adj" {
+		defer adjCache.clear(stmt.Scheme.DbName)
+	}
+	kvs := make([]fdb.KeyValue, nrows)
+	values := make([]interface{}, len(stmt.Values))
+	for i := range kvs {
+		for k, v := range stmt.Values {
+			if p, ok := v.(placeholder); ok {
+				v, err = loadValue(stmt.Scheme.Cols[k], &cols[int(p)], i)
+				if err != nil {
+					err = errors.New("Row " + strconv.Itoa(i) + ": " + err.Error())
+					return
+				}
+			}
+			values[k] = v
+		}
+		var parts [2][]tuple.TupleElement
+		for j, cols := range [2]([]*TableColDef){stmt.Scheme.Keys, stmt.Scheme.Values} {
+			parts[j] = make([]tuple.TupleElement, len(cols))
+			for _, col := range cols {
+				parts[j][col.Pos] = tuple.TupleElement(values[col.PosCol])
+			}
+		}
+		kvs[i] = fdb.KeyValue{Key: stmt.Scheme.Dir.Pack(tuple.Tuple(parts[0])), Value: tuple.Tuple(parts[1]).Pack()}
+	}
+	// stable, the last of rows with the same key wins as in BatchInsert
+	sort.SliceStable(kvs, func(i, j int) bool { return bytes.Compare(kvs[i].Key, kvs[j].Key) < 0 })
+	var mut sync.Mutex
+	var wg sync.WaitGroup
+	sem := make(chan struct{}, maxLoadTransactions)
+	for begin, n := 0, 0; begin < len(kvs); n++ {
+		end, size := begin, 0
+		for end < len(kvs) && (size < loadTransactionBytes || bytes.Equal(kvs[end].Key, kvs[end-1].Key)) {
+			size += len(kvs[end].Key) + len(kvs[end].Value)
+			end++
+		}
+		sem <- struct{}{}
+		wg.Add(1)
+		go func(db fdb.Transactor, chunk []fdb.KeyValue, size int) {
+			defer func() {
+				<-sem
+				wg.Done()
+			}()
+			_, err2 := db.Transact(func(tr fdb.Transaction) (interface{}, error) {
+				for _, kv := range chunk {
+					tr.Set(kv.Key, kv.Value)
+				}
+				return nil, nil
+			})
+			mut.Lock()
+			if err2 != nil {
+				if err == nil {
+					err = err2
+				}
+			} else {
+				stats.Rows += len(chunk)
+				stats.Transactions++
+				stats.Bytes += size
+			}
+			mut.Unlock()
+			if err2 == nil {
+				subscriptions.publish(stmt.Scheme, chunk)
+			}
+		}(dbs[n%len(dbs)], kvs[begin:end], size)
+		begin = end
+	}
+	wg.Wait()
 	return
 }
 
+// Cell i of c for col, without validateValue if of the type of col already
+func loadValue(col *TableColDef, c *columnarColumn, i int) (interface{}, error) {
+	if c.isNull(i) {
+		if col.IsKey {
+			return nil, errors.New("Null value for primary key \"" + col.Name + "\"")
+		}
+		return nil, nil
+	}
+	switch {
+	case c.typ == colInt64 && col.Type == BigInt:
+		return c.ints[i], nil
+	case c.typ == colDouble && col.Type == Double:
+		return c.floats[i], nil
+	case c.typ == colTime && col.Type == Timestamp:
+		sec, nsec := splitNanos(c.ints[i])
+		return tuple.Tuple{sec, nsec}, nil
+	case c.typ == colBool && col.Type == Boolean:
+		return c.ints[i] != 0, nil
+	case c.typ == colString && col.Type == Text:
+		return c.strs[i], nil
+	}
+	return validateValue(col, c.cell(i))
+}
+
 func prepareInsert(stmt *insertStmt, args []interface{}, parts *[2][]tuple.TupleElement) (err error) {
 	if stmt.NumPlaceholders != len(args) {
 		err = errors.New("Expected " + strconv.FormatInt(int64(stmt.NumPlaceholders), 10) + " arguments, got " + strconv.FormatInt(int64(len(args)), 10))
@@ -334,9 +586,6 @@ func prepareInsert(stmt *insertStmt, args []interface{}, parts *[2][]tuple.Tuple
 }
 
 func executeInsert(db fdb.Transactor, stmt *insertStmt, args []interface{}) (err error) {
-	if stmt.Scheme.TblName == "adj" {
-		adjCache.clear(stmt.Scheme.DbName)
-	}
 	argsArray := [1][]interface{}{args}
 	return BatchInsert(db, stmt, argsArray[:])
 }
@@ -360,9 +609,10 @@ func resolveSelect(db fdb.Transactor, dbName string, ast *AstSelect) (stmt selec
 	}
 	if ast.Selected.All != nil {
 		stmt.Cols = scheme.Cols
+		err = resolveAggregates(&stmt, ast.Bucket)
 		return
 	}
-	used := make([]bool, len(scheme.Cols))
+	used := make(map[string]bool)
 	stmt.Cols = make([]*TableColDef, len(ast.Selected.Cols))
 	stmt.Funcs = make([]*string, len(ast.Selected.Cols))
 	for j, col := range ast.Selected.Cols {
@@ -377,12 +627,16 @@ func resolveSelect(db fdb.Transactor, dbName string, ast *AstSelect) (stmt selec
 			err = errors.New("Undefined column name " + *colName)
 			return
 		}
-		i := col.PosCol
-		if used[i] {
+		// the same column may be aggregated more than once, e.g. max(px), min(px)
+		name := *colName
+		if funcName != nil {
+			name = strings.ToLower(*funcName) + "(" + name + ")"
+		}
+		if used[name] {
 			err = errors.New("Duplicate column name " + *colName)
 			return
 		}
-		used[i] = true
+		used[name] = true
 		stmt.Cols[j] = col
 		if funcName != nil {
 			tmp := strings.ToLower(*funcName)
@@ -400,6 +654,77 @@ func resolveSelect(db fdb.Transactor, dbName string, ast *AstSelect) (stmt selec
 		stmt.Funcs[j] = funcName
 	}
 	getAdjTuples(&stmt)
+	err = resolveAggregates(&stmt, ast.Bucket)
+	return
+}
+
+type aggFunc int
+
+const (
+	aggNone aggFunc = iota
+	aggFirst
+	aggLast
+	aggMax
+	aggMin
+	aggSum
+)
+
+var aggFuncs = map[string]aggFunc{"first": aggFirst, "last": aggLast, "max": aggMax, "min": aggMin, "sum": aggSum}
+
+// Aggregate functions of the select list and the bucket clause. The rows of a
+// range are grouped by the primary key columns before the timestamp one and
+// by buckets of its values, a plain key column gives the value of the group,
+// the timestamp one the start of its bucket.
+func resolveAggregates(stmt *selectStmt, bucket *AstNumber) (err error) {
+	aggs := make([]aggFunc, len(stmt.Cols))
+	hasAgg := false
+	for j := range stmt.Funcs {
+		if stmt.Funcs[j] != nil {
+			aggs[j] = aggFuncs[*stmt.Funcs[j]]
+			hasAgg = hasAgg || aggs[j] != aggNone
+		}
+	}
+	if !hasAgg && bucket == nil {
+		return
+	}
+	stmt.PosTm = -1
+	for i, col := range stmt.Scheme.Keys {
+		if col.Type == Timestamp {
+			stmt.PosTm = i
+		}
+	}
+	if bucket != nil {
+		if stmt.PosTm < 0 {
+			return errors.New("Bucket needs a timestamp primary key")
+		}
+		if bucket.Int != nil {
+			stmt.Bucket = *bucket.Int * 1000000000
+		} else {
+			stmt.Bucket = int64(*bucket.Float * 1e9)
+		}
+		if stmt.Bucket <= 0 {
+			return errors.New("Bucket must be positive")
+		}
+	}
+	for j, col := range stmt.Cols {
+		switch aggs[j] {
+		case aggNone:
+			if !col.IsKey {
+				return errors.New("Column " + col.Name + " must be aggregated or a primary key")
+			}
+			continue
+		case aggSum:
+			if col.Type == Timestamp || col.Type == Boolean || col.Type == Text {
+				return errors.New("Invalid function (sum) for \"" + col.Name + "\" of type " + col.Type.Name())
+			}
+		case aggMax, aggMin:
+			if col.Type == Boolean || col.Type == Text {
+				return errors.New("Invalid function (" + *stmt.Funcs[j] + ") for \"" + col.Name + "\" of type " + col.Type.Name())
+			}
+		}
+		stmt.Funcs[j] = nil
+	}
+	stmt.Aggs = aggs
 	return
 }
 
@@ -424,6 +749,8 @@ type selectStmt struct {
 	Reverse         bool
 	Adjs            []adjTuple
 	PosTm           int
+	Aggs            []aggFunc // nil if not aggregated
+	Bucket          int64     // ns, 0 for one group per key prefix
 }
 
 func (self *selectStmt) GetNumPlaceholders() int {
@@ -798,28 +1125,319 @@ func getAdjTuples(stmt *selectStmt) {
 	stmt.Adjs = adjs
 }
 
-func applyFunc(stmt *selectStmt, recs []([2]tuple.Tuple)) {
-	adjs := stmt.Adjs
-	if adjs != nil {
+// Folds recs, in key order, into one row per group of resolveAggregates, at
+// most stmt.Limit of them
+func aggregateRows(stmt *selectStmt, recs [][2]tuple.Tuple) (res [][]interface{}) {
+	var row []interface{}
+	var prefix tuple.Tuple
+	var bucket int64
+	for _, rec := range recs {
+		key, value := rec[0], rec[1]
+		var b int64
+		if stmt.Bucket > 0 && stmt.PosTm < len(key) {
+			b = columnarInt(key[stmt.PosTm])
+			b -= b % stmt.Bucket
+			if b > columnarInt(key[stmt.PosTm]) {
+				b -= stmt.Bucket // before 1970
+			}
+		}
+		var p tuple.Tuple // one group of all rows without a timestamp key
+		if stmt.PosTm >= 0 && stmt.PosTm < len(key) {
+			p = key[:stmt.PosTm]
+		}
+		start := row == nil || b != bucket || !sameCells(p, prefix)
+		if start {
+			if stmt.Limit > 0 && len(res) == stmt.Limit {
+				break
+			}
+			row = make([]interface{}, len(stmt.Cols))
+			res = append(res, row)
+			prefix, bucket = p, b
+		}
+		for j, col := range stmt.Cols {
+			var v interface{}
+			if col.IsKey {
+				if int(col.Pos) < len(key) {
+					v = key[col.Pos]
+				}
+			} else if int(col.Pos) < len(value) {
+				v = value[col.Pos]
+			}
+			switch stmt.Aggs[j] {
+			case aggNone:
+				if !start {
+					continue
+				}
+				if col.IsKey && int(col.Pos) == stmt.PosTm && stmt.Bucket > 0 {
+					sec := b / 1000000000
+					nsec := b - sec*1000000000
+					if nsec < 0 {
+						sec, nsec = sec-1, nsec+1000000000
+					}
+					v = tuple.Tuple{sec, nsec}
+				}
+				row[j] = v
+			case aggFirst, aggLast:
+				// earliest / latest even if scanned in reverse
+				if v != nil && (row[j] == nil || (stmt.Aggs[j] == aggLast) != stmt.Reverse) {
+					row[j] = v
+				}
+			case aggMax, aggMin:
+				if v == nil {
+					continue
+				}
+				if row[j] == nil || aggLess(row[j], v) == (stmt.Aggs[j] == aggMax) {
+					row[j] = v
+				}
+			case aggSum:
+				i, f, isInt, ok := aggNumber(v)
+				if !ok {
+					continue
+				}
+				switch s := row[j].(type) {
+				case nil:
+					if isInt {
+						row[j] = i
+					} else {
+						row[j] = f
+					}
+				case int64:
+					if isInt {
+						row[j] = s + i
+					} else {
+						row[j] = float64(s) + f
+					}
+				case float64:
+					if isInt {
+						row[j] = s + float64(i)
+					} else {
+						row[j] = s + f
+					}
+				}
+			}
+		}
+	}
+	return
+}
+
+// Numeric value of a cell, timestamps in ns
+func aggNumber(v interface{}) (i int64, f float64, isInt bool, ok bool) {
+	switch v2 := v.(type) {
+	case float64:
+		return 0, v2, false, true
+	case float32:
+		return 0, float64(v2), false, true
+	case tuple.Tuple:
+		return columnarInt(v2), 0, true, true
+	}
+	i, ok = getInt(v)
+	return i, 0, true, ok
+}
+
+func aggLess(a interface{}, b interface{}) bool {
+	i, f, isInt, _ := aggNumber(a)
+	i2, f2, isInt2, _ := aggNumber(b)
+	if isInt && isInt2 {
+		return i < i2
+	}
+	if isInt {
+		f = float64(i)
+	}
+	if isInt2 {
+		f2 = float64(i2)
 	}
+	return f < f2
 }
 
-func applyFuncOne(stmt *selectStmt, value tuple.Tuple) {
+func sameCells(a tuple.Tuple, b tuple.Tuple) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if t, ok := a[i].(tuple.Tuple); ok {
+			t2, ok2 := b[i].(tuple.Tuple)
+			if !ok2 || !sameCells(t, t2) {
+				return false
+			}
+		} else if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// Adjusts the adj_px / adj_vol columns of recs in place, in one pass: the
+// first primary key is the sec of the adj table, and consecutive rows of a
+// sec mostly fall between the same two adj rows
+func applyFunc(db fdb.Transactor, stmt *selectStmt, recs []([2]tuple.Tuple)) (err error) {
 	adjs := stmt.Adjs
-	if adjs != nil {
+	if adjs == nil {
+		return
 	}
+	var factors []adjValue
+	var sec int64
+	loaded := false
+	var px, vol float64
+	var lo, hi int64 = 1, 0 // tm range of px and vol
+	for _, rec := range recs {
+		key, value := rec[0], rec[1]
+		if len(key) <= stmt.PosTm {
+			continue
+		}
+		sec2, ok := getInt(key[0])
+		if !ok {
+			continue
+		}
+		if !loaded || sec2 != sec {
+			factors, err = adjCache.get(db, stmt.Scheme.DbName, int(sec2))
+			if err != nil {
+				return
+			}
+			sec, loaded = sec2, true
+			lo, hi = 1, 0
+		}
+		if len(factors) == 0 {
+			continue
+		}
+		tm := columnarInt(key[stmt.PosTm])
+		if tm < lo || tm >= hi {
+			px, vol, lo, hi = adjFactors(factors, tm)
+		}
+		for _, adj := range adjs {
+			if adj.Pos >= len(value) {
+				continue
+			}
+			f := px
+			if adj.Adj == 2 {
+				f = vol
+			}
+			switch v := value[adj.Pos].(type) {
+			case float64:
+				value[adj.Pos] = v * f
+			case float32:
+				value[adj.Pos] = float32(float64(v) * f)
+			case int64:
+				value[adj.Pos] = int64(math.Round(float64(v) * f))
+			}
+		}
+	}
+	return
+}
+
+func applyFuncOne(db fdb.Transactor, stmt *selectStmt, key tuple.Tuple, value tuple.Tuple) error {
+	return applyFunc(db, stmt, [][2]tuple.Tuple{{key, value}})
 }
 
-func (self *adjCacheS) get(dbName string, sec int) (ret []adjValue) {
+// Cumulative factors of the adj rows after tm and the range [lo, hi) of tm
+// they hold for
+func adjFactors(factors []adjValue, tm int64) (px, vol float64, lo, hi int64) {
+	i := sort.Search(len(factors), func(i int) bool { return adjNanos(&factors[i]) > tm })
+	px, vol, lo, hi = 1, 1, math.MinInt64, math.MaxInt64
+	if i > 0 {
+		lo = adjNanos(&factors[i-1])
+	}
+	if i < len(factors) {
+		px, vol, hi = factors[i].Px, factors[i].Vol, adjNanos(&factors[i])
+	}
+	return
+}
+
+func adjNanos(v *adjValue) int64 {
+	return v.Tm[0]*1000000000 + v.Tm[1]
+}
+
+// Cumulative adj rows of sec in dbName ordered by tm, read from its adj table
+// on a miss
+func (self *adjCacheS) get(db fdb.Transactor, dbName string, sec int) (ret []adjValue, err error) {
 	self.mut.Lock()
 	if values, ok := self.values[dbName]; ok {
 		if ret, ok = values[sec]; ok {
+			self.mut.Unlock()
 			return
 		}
-	} else {
-		values = make(map[int][]adjValue)
-		self.values[dbName] = values
 	}
+	gen := self.gen
 	self.mut.Unlock()
+	ret, err = loadAdj(db, dbName, sec)
+	if err != nil {
+		return
+	}
+	self.mut.Lock()
+	if self.gen == gen {
+		values, ok := self.values[dbName]
+		if !ok {
+			values = make(map[int][]adjValue)
+			self.values[dbName] = values
+		}
+		values[sec] = ret
+	}
+	self.mut.Unlock()
+	return
+}
+
+var errAdjColumns = errors.New("adj table must have tm, px, vol columns")
+
+// Positions of the tm key and the px, vol values of an adj table
+func adjColumns(scheme *TableScheme) (posTm int, posPx int, posVol int, err error) {
+	tm, ok1 := scheme.NameMap["tm"]
+	px, ok2 := scheme.NameMap["px"]
+	vol, ok3 := scheme.NameMap["vol"]
+	if !ok1 || !ok2 || !ok3 || tm.Type != Timestamp || !tm.IsKey ||
+		px.Type != Double || px.IsKey || vol.Type != Double || vol.IsKey {
+		err = errAdjColumns
+		return
+	}
+	return int(tm.Pos), int(px.Pos), int(vol.Pos), nil
+}
+
+func loadAdj(db fdb.Transactor, dbName string, sec int) (ret []adjValue, err error) {
+	exists, err1 := HasTable(db, dbName, "adj")
+	if err1 != nil || !exists {
+		return nil, err1
+	}
+	scheme, err2 := GetTableScheme(db, dbName, "adj")
+	if err2 != nil {
+		return nil, err2
+	}
+	posTm, posPx, posVol, err6 := adjColumns(scheme)
+	if err6 != nil {
+		return nil, err6
+	}
+	tmp, err3 := db.ReadTransact(func(tr fdb.ReadTransaction) (interface{}, error) {
+		return tr.GetRange(scheme.Dir.Sub(int64(sec)), fdb.RangeOptions{}).GetSliceWithError()
+	})
+	if err3 != nil {
+		return nil, err3
+	}
+	recs, _ := tmp.([]fdb.KeyValue)
+	ret = make([]adjValue, 0, len(recs))
+	for _, rec := range recs {
+		key, err4 := scheme.Dir.Unpack(rec.Key)
+		if err4 != nil {
+			return nil, errors.New("Internal errror: " + err4.Error())
+		}
+		value, err5 := tuple.Unpack(rec.Value)
+		if err5 != nil {
+			return nil, errors.New("Internal errror: " + err5.Error())
+		}
+		v := adjValue{Px: 1, Vol: 1}
+		ns := columnarInt(key[posTm])
+		v.Tm = [2]int64{ns / 1000000000, ns % 1000000000}
+		if posPx < len(value) {
+			if f, ok := value[posPx].(float64); ok {
+				v.Px = f
+			}
+		}
+		if posVol < len(value) {
+			if f, ok := value[posVol].(float64); ok {
+				v.Vol = f
+			}
+		}
+		ret = append(ret, v)
+	}
+	for i := len(ret) - 2; i >= 0; i-- {
+		ret[i].Px *= ret[i+1].Px
+		ret[i].Vol *= ret[i+1].Vol
+	}
 	return
 }
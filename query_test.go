@@ -2,6 +2,7 @@ package opentick
 
 import (
 	"github.com/apple/foundationdb/bindings/go/src/fdb"
+	"github.com/apple/foundationdb/bindings/go/src/fdb/tuple"
 	"github.com/stretchr/testify/assert"
 	"testing"
 )
@@ -138,6 +139,162 @@ func Test_Query(t *testing.T) {
 	Execute(db, "", "drop table test.test", nil)
 }
 
+func Test_SelectPage(t *testing.T) {
+	fdb.MustAPIVersion(FdbVersion)
+	var db = fdb.MustOpenDefault()
+	DropDatabase(db, "test")
+	CreateDatabase(db, "test")
+	Execute(db, "", "create table test.test(a int, b int, c double, primary key(a, b))", nil)
+	for i := 0; i < 5; i++ {
+		Execute(db, "", "insert into test.test(a, b, c) values(1, ?, 1.5)", []interface{}{i})
+	}
+	ast, _ := Parse("select b from test.test where a=1 limit 2")
+	stmt, _ := Resolve(db, "", ast)
+	res, more, err := ExecuteSelectPage(db, stmt, nil, nil)
+	assert.Equal(t, nil, err)
+	assert.Equal(t, [][]interface{}{{int64(0)}, {int64(1)}}, res)
+	res, more, err = ExecuteSelectPage(db, stmt, nil, more)
+	assert.Equal(t, [][]interface{}{{int64(2)}, {int64(3)}}, res)
+	res, more, err = ExecuteSelectPage(db, stmt, nil, more)
+	assert.Equal(t, [][]interface{}{{int64(4)}}, res)
+	assert.Equal(t, []byte(nil), more)
+	ast, _ = Parse("select b from test.test where a=1 limit -3")
+	stmt, _ = Resolve(db, "", ast)
+	res, more, err = ExecuteSelectPage(db, stmt, nil, []byte{})
+	assert.Equal(t, [][]interface{}{{int64(4)}, {int64(3)}, {int64(2)}}, res)
+	res, more, err = ExecuteSelectPage(db, stmt, nil, more)
+	assert.Equal(t, [][]interface{}{{int64(1)}, {int64(0)}}, res)
+	_, _, err = ExecuteSelectPage(db, stmt, nil, []byte("x"))
+	assert.Equal(t, "Invalid page cursor", err.Error())
+	_, _, err = ExecuteSelectPage(db, "", nil, nil)
+	assert.Equal(t, "Only select can be paged", err.Error())
+	Execute(db, "", "drop table test.test", nil)
+}
+
+func Test_SelectMany(t *testing.T) {
+	fdb.MustAPIVersion(FdbVersion)
+	var db = fdb.MustOpenDefault()
+	DropDatabase(db, "test")
+	CreateDatabase(db, "test")
+	Execute(db, "", "create table test.test(a int, b int, c double, primary key(a, b))", nil)
+	for i := 0; i < 3; i++ {
+		for j := 0; j <= i; j++ {
+			Execute(db, "", "insert into test.test(a, b, c) values(?, ?, 1.5)", []interface{}{i, j})
+		}
+	}
+	ast, _ := Parse("select b from test.test where a=?")
+	stmt, _ := Resolve(db, "", ast)
+	res, errs, err := ExecuteSelectMany(db, stmt, [][]interface{}{{2}, {0}, {}, {5}})
+	assert.Equal(t, nil, err)
+	assert.Equal(t, [][]interface{}{{int64(0)}, {int64(1)}, {int64(2)}}, res[0])
+	assert.Equal(t, [][]interface{}{{int64(0)}}, res[1])
+	assert.Equal(t, "Expected 1 arguments, got 0", errs[2].Error())
+	assert.Equal(t, nil, errs[3])
+	assert.Equal(t, 0, len(res[3]))
+	ast, _ = Parse("select c from test.test where a=? and b=?")
+	stmt, _ = Resolve(db, "", ast)
+	res, errs, err = ExecuteSelectMany(db, stmt, [][]interface{}{{1, 1}, {1, 2}})
+	assert.Equal(t, [][]interface{}{{1.5}}, res[0])
+	assert.Equal(t, 0, len(res[1]))
+	_, _, err = ExecuteSelectMany(db, "", nil)
+	assert.Equal(t, "Only select can be run as many", err.Error())
+	Execute(db, "", "drop table test.test", nil)
+}
+
+func Test_AggregateRows(t *testing.T) {
+	sec := &TableColDef{Name: "sec", Type: Int, IsKey: true, Pos: 0}
+	tm := &TableColDef{Name: "tm", Type: Timestamp, IsKey: true, Pos: 1}
+	px := &TableColDef{Name: "px", Type: Double, Pos: 0}
+	v := &TableColDef{Name: "v", Type: BigInt, Pos: 1}
+	name := &TableColDef{Name: "name", Type: Text, Pos: 2}
+	scheme := &TableScheme{Keys: []*TableColDef{sec, tm}}
+	f := func(name string) *string { return &name }
+	stmt := selectStmt{Scheme: scheme, Cols: []*TableColDef{sec, tm, px, px, px, px, v},
+		Funcs: []*string{nil, nil, f("first"), f("max"), f("min"), f("last"), f("sum")}}
+	n := int64(60)
+	assert.Equal(t, nil, resolveAggregates(&stmt, &AstNumber{Int: &n}))
+	assert.Equal(t, int64(60000000000), stmt.Bucket)
+	assert.Equal(t, 1, stmt.PosTm)
+	recs := [][2]tuple.Tuple{
+		{{int64(1), tuple.Tuple{int64(0), int64(0)}}, {1.0, int64(10)}},
+		{{int64(1), tuple.Tuple{int64(30), int64(0)}}, {3.0, int64(5)}},
+		{{int64(1), tuple.Tuple{int64(61), int64(5)}}, {2.0, int64(1)}},
+		{{int64(2), tuple.Tuple{int64(62), int64(0)}}, {7.0}},
+	}
+	want := [][]interface{}{
+		{int64(1), tuple.Tuple{int64(0), int64(0)}, 1.0, 3.0, 1.0, 3.0, int64(15)},
+		{int64(1), tuple.Tuple{int64(60), int64(0)}, 2.0, 2.0, 2.0, 2.0, int64(1)},
+		{int64(2), tuple.Tuple{int64(60), int64(0)}, 7.0, 7.0, 7.0, 7.0, nil},
+	}
+	assert.Equal(t, want, aggregateRows(&stmt, recs))
+	stmt.Reverse = true
+	stmt.Limit = 2
+	reversed := [][2]tuple.Tuple{recs[3], recs[2], recs[1], recs[0]}
+	assert.Equal(t, [][]interface{}{want[2], want[1]}, aggregateRows(&stmt, reversed))
+	stmt = selectStmt{Scheme: scheme, Cols: []*TableColDef{px}, Funcs: []*string{nil}}
+	assert.Equal(t, "Column px must be aggregated or a primary key", resolveAggregates(&stmt, &AstNumber{Int: &n}).Error())
+	stmt = selectStmt{Scheme: scheme, Cols: []*TableColDef{name}, Funcs: []*string{f("sum")}}
+	assert.Equal(t, "Invalid function (sum) for \"name\" of type Text", resolveAggregates(&stmt, nil).Error())
+	stmt = selectStmt{Scheme: &TableScheme{Keys: []*TableColDef{sec}}, Cols: []*TableColDef{v}, Funcs: []*string{f("sum")}}
+	assert.Equal(t, "Bucket needs a timestamp primary key", resolveAggregates(&stmt, &AstNumber{Int: &n}).Error())
+	assert.Equal(t, nil, resolveAggregates(&stmt, nil))
+	assert.Equal(t, [][]interface{}{{int64(16)}}, aggregateRows(&stmt, recs))
+	ast, err := Parse("select tm, first(px), max(px) from test where sec=1 bucket 0.5 limit 3")
+	assert.Equal(t, nil, err)
+	assert.Equal(t, 0.5, *ast.Select.Bucket.Float)
+	assert.Equal(t, "FIRST", *ast.Select.Selected.Cols[1].Func.Name)
+}
+
+func Test_ApplyFunc(t *testing.T) {
+	adjCache.values["test_adj"] = map[int][]adjValue{1: {
+		{Tm: [2]int64{100, 0}, Px: 0.125, Vol: 8},
+		{Tm: [2]int64{200, 0}, Px: 0.25, Vol: 4},
+	}}
+	scheme := &TableScheme{DbName: "test_adj"}
+	stmt := selectStmt{Scheme: scheme, PosTm: 1, Adjs: []adjTuple{{0, 1}, {1, 2}}}
+	tm := func(sec int64) tuple.Tuple { return tuple.Tuple{sec, int64(0)} }
+	recs := [][2]tuple.Tuple{
+		{{int64(1), tm(50)}, {8.0, int64(3)}},
+		{{int64(1), tm(150)}, {8.0, int64(3)}},
+		{{int64(1), tm(200)}, {8.0, int64(3)}},
+		{{int64(1), tm(300)}, {8.0}},
+	}
+	assert.Equal(t, nil, applyFunc(nil, &stmt, recs))
+	assert.Equal(t, tuple.Tuple{1.0, int64(24)}, recs[0][1])
+	assert.Equal(t, tuple.Tuple{2.0, int64(12)}, recs[1][1])
+	assert.Equal(t, tuple.Tuple{8.0, int64(3)}, recs[2][1])
+	assert.Equal(t, tuple.Tuple{8.0}, recs[3][1])
+	value := tuple.Tuple{float32(8), int64(3)}
+	assert.Equal(t, nil, applyFuncOne(nil, &stmt, tuple.Tuple{int64(1), tm(0)}, value))
+	assert.Equal(t, tuple.Tuple{float32(1), int64(24)}, value)
+	px, vol, lo, hi := adjFactors(adjCache.values["test_adj"][1], 100000000000)
+	assert.Equal(t, []interface{}{0.25, 4.0, int64(100000000000), int64(200000000000)}, []interface{}{px, vol, lo, hi})
+	adjCache.clear("test_adj")
+	_, ok := adjCache.values["test_adj"]
+	assert.Equal(t, false, ok)
+}
+
+func Test_AdjColumns(t *testing.T) {
+	adj := func(types ...DataType) *TableScheme {
+		names := []string{"sec", "tm", "px", "vol"}
+		cols := make([]*TableColDef, len(types))
+		for i, typ := range types {
+			cols[i] = NewTableColDef(names[i], typ)
+		}
+		scheme := NewTableScheme(cols, []int{0, 1})
+		return &scheme
+	}
+	posTm, posPx, posVol, err := adjColumns(adj(Int, Timestamp, Double, Double))
+	assert.Equal(t, nil, err)
+	assert.Equal(t, []int{1, 0, 1}, []int{posTm, posPx, posVol})
+	_, _, _, err = adjColumns(adj(Int, Timestamp, Double))
+	assert.Equal(t, errAdjColumns, err)
+	_, _, _, err = adjColumns(adj(Int, Timestamp, Double, Int))
+	assert.Equal(t, errAdjColumns, err)
+	_, _, _, err = adjColumns(adj(Int, BigInt, Double, Double))
+	assert.Equal(t, errAdjColumns, err)
+}
+
 func Benchmark_resolveDelete(b *testing.B) {
 	fdb.MustAPIVersion(FdbVersion)
 	var db = fdb.MustOpenDefault()
@@ -191,3 +348,21 @@ func Benchmark_resolveSelect(b *testing.B) {
 	}
 	Execute(db, "", "drop table test.test", nil)
 }
+
+func Test_LoadValue(t *testing.T) {
+	data, _ := encodeColumnar([][]interface{}{{int64(3), tuple.Tuple{int64(1), int64(2)}}, {nil, nil}})
+	_, cols, _ := decodeColumnar(data)
+	key := &TableColDef{Name: "sec", Type: BigInt, IsKey: true}
+	v, err := loadValue(key, &cols[0], 0)
+	assert.Equal(t, nil, err)
+	assert.Equal(t, int64(3), v)
+	_, err = loadValue(key, &cols[0], 1)
+	assert.Equal(t, "Null value for primary key \"sec\"", err.Error())
+	v, err = loadValue(&TableColDef{Name: "tm", Type: Timestamp}, &cols[1], 0)
+	assert.Equal(t, nil, err)
+	assert.Equal(t, tuple.Tuple{int64(1), int64(2)}, v)
+	v, err = loadValue(&TableColDef{Name: "v", Type: Double}, &cols[0], 0)
+	assert.Equal(t, float64(3), v)
+	v, err = loadValue(&TableColDef{Name: "v", Type: Double}, &cols[1], 1)
+	assert.Equal(t, nil, v)
+}
@@ -0,0 +1,152 @@
+package opentick
+
+import (
+	"container/heap"
+	"errors"
+	"sync"
+)
+
+// Lanes of the requests of one connection, each with its own concurrency
+// budget so that range reads and batches do not hold back point reads
+const (
+	lanePoint = iota // point reads, single-row writes and the rest
+	laneRange        // range reads, pages and "many"
+	laneBatch        // "batch" and "load"
+	numLanes
+)
+
+var laneNames = [numLanes]string{"point", "range", "batch"}
+
+func laneConcurrency(lane int) int {
+	if lane == lanePoint {
+		return sMaxConcurrency
+	}
+	if n := sMaxConcurrency / 4; n > 0 {
+		return n
+	}
+	return 1
+}
+
+// Waiting requests keep their slot of the connection, so the range and batch
+// lanes queue at most an eighth of sMaxConcurrency each: with their budgets
+// they never hold more than 3/4 of the slots, the rest is left to point reads
+func laneQueueCap(lane int) int {
+	if lane == lanePoint {
+		return sMaxConcurrency
+	}
+	if n := sMaxConcurrency / 8; n > 0 {
+		return n
+	}
+	return 1
+}
+
+var errLaneFull = [numLanes]error{
+	errors.New("Too many point requests waiting"),
+	errors.New("Too many range requests waiting"),
+	errors.New("Too many batch requests waiting"),
+}
+
+// Lane of a request, stmt the resolved statement if any
+func requestLane(cmd string, stmt interface{}, paged bool) int {
+	switch cmd {
+	case "batch", "load":
+		return laneBatch
+	case "many":
+		return laneRange
+	case "run":
+		if paged {
+			return laneRange
+		}
+		switch stmt2 := stmt.(type) {
+		case selectStmt:
+			if !isPointSelect(&stmt2) {
+				return laneRange
+			}
+		case deleteStmt:
+			if len(stmt2.Conds) < len(stmt2.Scheme.Keys) || !allEqual(stmt2.Conds) {
+				return laneRange
+			}
+		}
+	}
+	return lanePoint
+}
+
+// A select of the row of a full primary key, or of one row of a range
+func isPointSelect(stmt *selectStmt) bool {
+	if stmt.Limit == 1 && stmt.Aggs == nil {
+		return true
+	}
+	return len(stmt.Conds) == len(stmt.Scheme.Keys) && allEqual(stmt.Conds)
+}
+
+func allEqual(conds []condition) bool {
+	for _, c := range conds {
+		if c.Equal == nil {
+			return false
+		}
+	}
+	return true
+}
+
+type laneWaiter struct {
+	priority int
+	seq      uint64
+	ready    chan struct{}
+}
+
+// Higher priority first, then first come first served
+type laneQueue []*laneWaiter
+
+func (self laneQueue) Len() int { return len(self) }
+func (self laneQueue) Less(i, j int) bool {
+	if self[i].priority != self[j].priority {
+		return self[i].priority > self[j].priority
+	}
+	return self[i].seq < self[j].seq
+}
+func (self laneQueue) Swap(i, j int)       { self[i], self[j] = self[j], self[i] }
+func (self *laneQueue) Push(x interface{}) { *self = append(*self, x.(*laneWaiter)) }
+func (self *laneQueue) Pop() interface{} {
+	old := *self
+	w := old[len(old)-1]
+	*self = old[:len(old)-1]
+	return w
+}
+
+// Admission of the requests of one connection into the lanes
+type scheduler struct {
+	mutex   sync.Mutex
+	running [numLanes]int
+	waiting [numLanes]laneQueue
+	seq     uint64
+}
+
+// Returns a nil channel if admitted into lane right away, else the channel
+// closed once admitted, or errLaneFull if the lane has too many waiting
+// already. Each admission must be followed by one leave.
+func (self *scheduler) enter(lane int, priority int) (<-chan struct{}, error) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	if self.running[lane] < laneConcurrency(lane) && len(self.waiting[lane]) == 0 {
+		self.running[lane]++
+		return nil, nil
+	}
+	if len(self.waiting[lane]) >= laneQueueCap(lane) {
+		return nil, errLaneFull[lane]
+	}
+	self.seq++
+	w := &laneWaiter{priority, self.seq, make(chan struct{})}
+	heap.Push(&self.waiting[lane], w)
+	return w.ready, nil
+}
+
+func (self *scheduler) leave(lane int) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	self.running[lane]--
+	for self.running[lane] < laneConcurrency(lane) && len(self.waiting[lane]) > 0 {
+		w := heap.Pop(&self.waiting[lane]).(*laneWaiter)
+		self.running[lane]++
+		close(w.ready)
+	}
+}
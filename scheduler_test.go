@@ -0,0 +1,70 @@
+package opentick
+
+import (
+	"github.com/stretchr/testify/assert"
+	"testing"
+)
+
+func Test_RequestLane(t *testing.T) {
+	scheme := &TableScheme{Keys: make([]*TableColDef, 2)}
+	point := selectStmt{Scheme: scheme, Conds: []condition{{Equal: 1}, {Equal: 2}}}
+	prefix := selectStmt{Scheme: scheme, Conds: []condition{{Equal: 1}}}
+	latest := selectStmt{Scheme: scheme, Conds: []condition{{Equal: 1}}, Limit: 1}
+	buckets := latest
+	buckets.Aggs = []aggFunc{aggFirst}
+	assert.Equal(t, lanePoint, requestLane("run", point, false))
+	assert.Equal(t, laneRange, requestLane("run", prefix, false))
+	assert.Equal(t, lanePoint, requestLane("run", latest, false))
+	assert.Equal(t, laneRange, requestLane("run", buckets, false))
+	assert.Equal(t, laneRange, requestLane("run", point, true))
+	assert.Equal(t, laneRange, requestLane("run", deleteStmt{Scheme: scheme, Conds: prefix.Conds}, false))
+	assert.Equal(t, lanePoint, requestLane("run", deleteStmt{Scheme: scheme, Conds: point.Conds}, false))
+	assert.Equal(t, lanePoint, requestLane("run", insertStmt{}, false))
+	assert.Equal(t, lanePoint, requestLane("run", nil, false))
+	assert.Equal(t, laneRange, requestLane("many", prefix, false))
+	assert.Equal(t, laneBatch, requestLane("batch", insertStmt{}, false))
+	assert.Equal(t, laneBatch, requestLane("load", insertStmt{}, false))
+	assert.Equal(t, lanePoint, requestLane("prepare", nil, false))
+}
+
+func Test_Scheduler(t *testing.T) {
+	old := sMaxConcurrency
+	defer func() { sMaxConcurrency = old }()
+	sMaxConcurrency = 16 // batch lane: 4 running, 2 waiting
+	var s scheduler
+	admitted := func(lane int) bool {
+		ready, err := s.enter(lane, 0)
+		return ready == nil && err == nil
+	}
+	for i := 0; i < 4; i++ {
+		assert.Equal(t, true, admitted(laneBatch))
+	}
+	low, err := s.enter(laneBatch, 0)
+	assert.Equal(t, true, low != nil && err == nil)
+	high, err := s.enter(laneBatch, 1)
+	assert.Equal(t, true, high != nil && err == nil)
+	_, err = s.enter(laneBatch, 2)
+	assert.Equal(t, errLaneFull[laneBatch], err)
+	// the other lanes are not held back
+	for i := 0; i < 16; i++ {
+		assert.Equal(t, true, admitted(lanePoint))
+	}
+	assert.Equal(t, false, admitted(lanePoint))
+	isReady := func(ch <-chan struct{}) bool {
+		select {
+		case <-ch:
+			return true
+		default:
+			return false
+		}
+	}
+	s.leave(laneBatch)
+	assert.Equal(t, true, isReady(high))
+	assert.Equal(t, false, isReady(low))
+	s.leave(laneBatch)
+	assert.Equal(t, true, isReady(low))
+	for i := 0; i < 4; i++ {
+		s.leave(laneBatch)
+	}
+	assert.Equal(t, true, admitted(laneBatch))
+}
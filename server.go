@@ -1,16 +1,20 @@
 package opentick
 
 import (
+	"bytes"
+	"compress/zlib"
 	"encoding/binary"
 	"encoding/json"
 	"fmt"
 	"github.com/apple/foundationdb/bindings/go/src/fdb"
 	"gopkg.in/mgo.v2/bson"
+	"io"
 	"log"
 	"math"
 	"math/rand"
 	"net"
 	"os"
+	"strconv"
 	"sync"
 	"time"
 )
@@ -36,6 +40,9 @@ func StartServer(addr string, fdbClusterFile string, numDatabaseConn, maxConcurr
 		sMaxConcurrency = maxConcurrency
 	}
 	log.Println("Max concurrency of one connection:", sMaxConcurrency)
+	for lane := 0; lane < numLanes; lane++ {
+		log.Println("Max concurrency of the", laneNames[lane], "lane:", laneConcurrency(lane))
+	}
 	if timeout > 0 {
 		sTimeout = timeout
 	}
@@ -77,17 +84,98 @@ type connection struct {
 	mutex  sync.Mutex
 	cond   *sync.Cond
 	closed bool
+	subs   map[int]func() // cancels of the subscriptions by ticker, guarded by mutex
+	lanes  scheduler
 }
 
 func (self *connection) Send(msg []byte) {
 	self.ch <- msg
 }
 
+// Reply encoding of a connection, negotiated by the client with raw frames
+// "protocol=json", "protocol=columnar" and "compress=<min bytes>"
+type protocol struct {
+	useJson     bool
+	useColumnar bool
+	compressMin int // 0 for no compression
+}
+
+// Applies a negotiation frame, false if body is not one
+func (self *protocol) negotiate(body []byte) bool {
+	if bytes.Equal(body, []byte("protocol=json")) {
+		self.useJson = true
+	} else if bytes.Equal(body, []byte("protocol=columnar")) {
+		self.useColumnar = true
+	} else if bytes.HasPrefix(body, []byte("compress=")) {
+		if n, err := strconv.Atoi(string(body[9:])); err == nil && n >= 0 {
+			self.compressMin = n
+		}
+	} else {
+		return false
+	}
+	return true
+}
+
+// Frames with this bit set in their length are compressed, the payload is the
+// uint32 length of the original body followed by its zlib stream. The client
+// may send them at any time, the server only once asked with "compress=".
+const compressedFrame = 0x80000000
+const maxInflatedFrame = 1 << 30
+
+var zlibWriters = sync.Pool{New: func() interface{} {
+	w, _ := zlib.NewWriterLevel(nil, zlib.BestSpeed)
+	return w
+}}
+
+// Returns the compressed frame of data, or nil if it does not get smaller
+func compressFrame(data []byte) []byte {
+	var buf bytes.Buffer
+	buf.Grow(len(data)/2 + 8)
+	var head [8]byte
+	buf.Write(head[:])
+	w := zlibWriters.Get().(*zlib.Writer)
+	defer zlibWriters.Put(w)
+	w.Reset(&buf)
+	if _, err := w.Write(data); err != nil {
+		return nil
+	}
+	if err := w.Close(); err != nil {
+		return nil
+	}
+	frame := buf.Bytes()
+	if len(frame) >= len(data)+4 {
+		return nil
+	}
+	binary.LittleEndian.PutUint32(frame[:4], uint32(len(frame)-4)|compressedFrame)
+	binary.LittleEndian.PutUint32(frame[4:8], uint32(len(data)))
+	return frame
+}
+
+func inflateFrame(body []byte) ([]byte, error) {
+	if len(body) < 4 {
+		return nil, fmt.Errorf("Truncated compressed frame")
+	}
+	n := binary.LittleEndian.Uint32(body)
+	if n > maxInflatedFrame {
+		return nil, fmt.Errorf("Compressed frame too large: %d", n)
+	}
+	r, err := zlib.NewReader(bytes.NewReader(body[4:]))
+	if err != nil {
+		return nil, err
+	}
+	defer r.Close()
+	out := make([]byte, n)
+	if _, err = io.ReadFull(r, out); err != nil {
+		return nil, err
+	}
+	return out, nil
+}
+
 func handleConnection(conn net.Conn) {
 	timeout := time.Duration(sTimeout) * time.Second
 	log.Println("New connection from", conn.RemoteAddr())
 	ch := make(chan []byte)
-	client := connection{ch: ch, conn: conn}
+	client := connection{ch: ch, conn: conn, subs: make(map[int]func())}
 	client.cond = sync.NewCond(&client.mutex)
 	defer client.close()
 	go client.writeToConnection()
@@ -120,6 +208,8 @@ func handleConnection(conn net.Conn) {
 			n -= n2
 		}
 		bodyLen := binary.LittleEndian.Uint32(head[:])
+		compressed := bodyLen&compressedFrame != 0
+		bodyLen &^= compressedFrame
 		if bodyLen == 0 {
 			continue
 		}
@@ -148,11 +238,21 @@ func handleConnection(conn net.Conn) {
 			tmp = tmp[n2:]
 			n -= n2
 		}
+		if compressed {
+			var err error
+			body, err = inflateFrame(body)
+			if err != nil {
+				log.Println(err.Error(), "of connection", conn.RemoteAddr())
+				return
+			}
+		}
 		client.push(body)
 	}
 }
 
-func reply(ticker int, res interface{}, ch chan []byte, useJson bool) {
+// more is the resume key of a paged select, sent as "2" if not nil, rows are
+// sent in the columnar format and large replies compressed if negotiated
+func reply(ticker int, res interface{}, more []byte, ch chan []byte, proto protocol) {
 	defer func() {
 		if err := recover(); err != nil {
 			// send on closed channel
@@ -160,19 +260,44 @@ func reply(ticker int, res interface{}, ch chan []byte, useJson bool) {
 	}()
 	var data []byte
 	var err error
-	if useJson {
-		data, err = json.Marshal(map[string]interface{}{"0": ticker, "1": res})
+	msg := map[string]interface{}{"0": ticker, "1": res}
+	if more != nil {
+		msg["2"] = more
+	}
+	if rows, ok := res.([][]interface{}); ok && rows != nil && proto.useColumnar && !proto.useJson {
+		block, err1 := encodeColumnar(rows)
+		if err1 != nil {
+			proto.useColumnar = false
+			reply(ticker, "Internal error: "+err1.Error(), nil, ch, proto)
+			return
+		}
+		msg["1"] = bson.Binary{Kind: columnarSubtype, Data: block}
+	}
+	if proto.useJson {
+		data, err = json.Marshal(msg)
 	} else {
-		data, err = bson.Marshal(map[string]interface{}{"0": ticker, "1": res})
+		data, err = bson.Marshal(msg)
 	}
 	if err != nil {
-		reply(ticker, "Internal error: "+err.Error(), ch, useJson)
+		proto.useColumnar = false
+		reply(ticker, "Internal error: "+err.Error(), nil, ch, proto)
 		return
 	}
-	if len(data) > math.MaxUint32 {
-		reply(ticker, "Results too large", ch, useJson)
+	maxSize := math.MaxUint32
+	if proto.compressMin > 0 {
+		maxSize = compressedFrame - 1
+	}
+	if len(data) > maxSize {
+		proto.useColumnar = false
+		reply(ticker, "Results too large", nil, ch, proto)
 		return
 	}
+	if proto.compressMin > 0 && len(data) >= proto.compressMin {
+		if frame := compressFrame(data); frame != nil {
+			ch <- frame
+			return
+		}
+	}
 	var size [4]byte
 	binary.LittleEndian.PutUint32(size[:], uint32(len(data)))
 	ch <- append(size[:], data...)
@@ -205,7 +330,7 @@ func (self *connection) process() {
 	var prepared []interface{}
 	var mut sync.Mutex
 	var dbName string
-	var useJson bool
+	var proto protocol
 	var unfinished int32
 	for {
 		var body []byte
@@ -223,9 +348,15 @@ func (self *connection) process() {
 				break
 			}
 		}
+		// negotiated in order here, each request gets the settings of the
+		// frames before it
+		if proto.negotiate(body) {
+			self.mutex.Unlock()
+			continue
+		}
 		unfinished++
 		self.mutex.Unlock()
-		go func() {
+		go func(proto protocol) {
 			defer func() {
 				self.mutex.Lock()
 				unfinished--
@@ -244,16 +375,17 @@ func (self *connection) process() {
 			var args []interface{}
 			var exists bool
 			var stmt interface{}
-			if useJson {
+			var after []byte
+			var more []byte
+			var lane int
+			var priority int
+			var ready <-chan struct{}
+			if proto.useJson {
 				err = json.Unmarshal(body, &data)
 			} else {
 				err = bson.Unmarshal(body, &data)
 			}
 			if err != nil {
-				if string(body) == "protocol=json" {
-					useJson = true
-					return
-				}
 				if string(body) == "H" { // heartbeat request
 					self.ch <- []byte{0, 0, 0, 0}
 					return
@@ -278,6 +410,25 @@ func (self *connection) process() {
 					goto reply
 				}
 			}
+			if cmd == "unsubscribe" {
+				// args is the ticker of the subscribe
+				id, ok2 := 0, false
+				if len(args) == 1 {
+					id, ok2 = args[0].(int)
+				}
+				if !ok2 {
+					res = "Arguments must be the ticker of a subscribe"
+					goto reply
+				}
+				self.mutex.Lock()
+				cancel := self.subs[id]
+				delete(self.subs, id)
+				self.mutex.Unlock()
+				if cancel != nil {
+					cancel()
+				}
+				goto reply
+			}
 			sql, ok = data["2"].(string)
 			if !ok {
 				preparedId, ok = data["2"].(int)
@@ -297,7 +448,52 @@ func (self *connection) process() {
 				res = "Empty sql"
 				goto reply
 			}
-			if cmd == "run" {
+			if cmd == "run" && data["4"] != nil {
+				after, ok = data["4"].([]byte)
+				if !ok {
+					res = fmt.Sprint("Invalid page cursor, expected binary, got ", data["4"])
+					goto reply
+				}
+			}
+			if sql != "" && (cmd == "run" || cmd == "subscribe") {
+				// resolved here for the lane, the rest is left to Execute
+				ast, err = Parse(sql)
+				if err != nil {
+					res = err.Error()
+					goto reply
+				}
+				if ast.Select != nil || ast.Insert != nil || ast.Delete != nil {
+					stmt, err = Resolve(getDB(), dbName, ast)
+					if err != nil {
+						res = err.Error()
+						goto reply
+					}
+					sql = ""
+				}
+			}
+			if data["5"] != nil {
+				priority, ok = data["5"].(int)
+				if !ok {
+					res = fmt.Sprint("Invalid priority, expected int, got ", data["5"])
+					goto reply
+				}
+			}
+			lane = requestLane(cmd, stmt, data["4"] != nil)
+			ready, err = self.lanes.enter(lane, priority)
+			if err != nil {
+				res = err.Error()
+				goto reply
+			}
+			if ready != nil {
+				<-ready
+			}
+			defer self.lanes.leave(lane)
+			if cmd == "run" && data["4"] != nil {
+				res, more, err = ExecuteSelectPage(getDB(), stmt, args, after)
+				if err != nil {
+					res = err.Error()
+				}
+			} else if cmd == "run" {
 				if sql != "" {
 					res, err = Execute(getDB(), dbName, sql, args)
 				} else {
@@ -334,6 +530,99 @@ func (self *connection) process() {
 				if err != nil {
 					res = err.Error()
 				}
+			} else if cmd == "load" {
+				// one columnar block in args, replied as [[rows, transactions, bytes]]
+				if sql != "" {
+					res = "Load command must be prepared first"
+					goto reply
+				}
+				stmt2, ok2 := stmt.(insertStmt)
+				if !ok2 {
+					res = "Only insert can be loaded"
+					goto reply
+				}
+				var block bson.Binary
+				if len(args) == 1 {
+					block, ok = args[0].(bson.Binary)
+				}
+				if !ok || block.Kind != columnarSubtype {
+					res = "Arguments must be one columnar block"
+					goto reply
+				}
+				stats, err1 := BulkLoad(defaultDBs, &stmt2, block.Data)
+				if err1 != nil {
+					res = fmt.Sprint(stats.Rows, " rows committed, then ", err1.Error())
+					goto reply
+				}
+				res = [][]interface{}{{stats.Rows, stats.Transactions, stats.Bytes}}
+			} else if cmd == "many" {
+				// the rows of args[i] are replied as ticker+1+i once all are read,
+				// then nil or the error failing all of them as ticker
+				if sql != "" {
+					res = "Many command must be prepared first"
+					goto reply
+				}
+				argsArray := make([][]interface{}, len(args))
+				for i, a := range args {
+					argsArray[i], ok = a.([]interface{})
+					if !ok {
+						res = "Arguments must be array of array"
+						goto reply
+					}
+				}
+				results, errs, err1 := ExecuteSelectMany(getDB(), stmt, argsArray)
+				if err1 != nil {
+					res = err1.Error()
+					goto reply
+				}
+				var wg sync.WaitGroup
+				for i := range results {
+					wg.Add(1)
+					go func(i int) {
+						defer wg.Done()
+						if errs[i] != nil {
+							reply(ticker+1+i, errs[i].Error(), nil, self.ch, proto)
+						} else {
+							reply(ticker+1+i, results[i], nil, self.ch, proto)
+						}
+					}(i)
+				}
+				wg.Wait()
+			} else if cmd == "subscribe" {
+				// nil once subscribed, then the rows committed from then on, all
+				// replied as ticker, until "unsubscribe" or an error reply
+				stmt2, ok2 := stmt.(selectStmt)
+				if !ok2 {
+					res = "Only select can be subscribed"
+					goto reply
+				}
+				cancel, err1 := Subscribe(getDB(), &stmt2, args, func(rows [][]interface{}, err error) {
+					if err != nil {
+						self.mutex.Lock()
+						delete(self.subs, ticker)
+						self.mutex.Unlock()
+						reply(ticker, err.Error(), nil, self.ch, proto)
+					} else if rows == nil {
+						reply(ticker, nil, nil, self.ch, proto)
+					} else {
+						reply(ticker, rows, nil, self.ch, proto)
+					}
+				})
+				if err1 != nil {
+					res = err1.Error()
+					goto reply
+				}
+				self.mutex.Lock()
+				if self.closed {
+					cancel()
+				} else {
+					if old := self.subs[ticker]; old != nil {
+						old()
+					}
+					self.subs[ticker] = cancel
+				}
+				self.mutex.Unlock()
+				return
 			} else if cmd == "prepare" {
 				ast, err = Parse(sql)
 				if err != nil {
@@ -363,8 +652,8 @@ func (self *connection) process() {
 				res = "Invalid command " + cmd
 			}
 		reply:
-			reply(ticker, res, self.ch, useJson)
-		}()
+			reply(ticker, res, more, self.ch, proto)
+		}(proto)
 	}
 }
 
@@ -373,6 +662,10 @@ func (self *connection) close() {
 	self.conn.Close()
 	self.mutex.Lock()
 	self.closed = true
+	for _, cancel := range self.subs {
+		cancel()
+	}
+	self.subs = nil
 	self.cond.Signal()
 	self.mutex.Unlock()
 	log.Println("Closed connection from", self.conn.RemoteAddr())
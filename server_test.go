@@ -1,6 +1,8 @@
 package opentick
 
 import (
+	"bytes"
+	"encoding/binary"
 	"github.com/opentradesolutions/opentick/client"
 	"github.com/phayes/freeport"
 	"github.com/stretchr/testify/assert"
@@ -148,3 +150,29 @@ func Benchmark_insert_prepared(b *testing.B) {
 	}
 	conn.Execute("drop table test")
 }
+
+func Test_Negotiate(t *testing.T) {
+	var proto protocol
+	assert.Equal(t, true, proto.negotiate([]byte("protocol=columnar")))
+	assert.Equal(t, true, proto.negotiate([]byte("compress=4096")))
+	assert.Equal(t, true, proto.negotiate([]byte("compress=x")))
+	assert.Equal(t, false, proto.negotiate([]byte("H")))
+	assert.Equal(t, protocol{useColumnar: true, compressMin: 4096}, proto)
+	assert.Equal(t, true, proto.negotiate([]byte("protocol=json")))
+	assert.Equal(t, true, proto.useJson)
+}
+
+func Test_CompressFrame(t *testing.T) {
+	data := bytes.Repeat([]byte("opentick 2.25 2.30 "), 1000)
+	frame := compressFrame(data)
+	assert.NotEqual(t, nil, frame)
+	n := binary.LittleEndian.Uint32(frame)
+	assert.Equal(t, uint32(compressedFrame), n&compressedFrame)
+	assert.Equal(t, len(frame)-4, int(n&^compressedFrame))
+	body, err := inflateFrame(frame[4:])
+	assert.Equal(t, nil, err)
+	assert.Equal(t, data, body)
+	assert.Equal(t, []byte(nil), compressFrame([]byte("ab")))
+	_, err = inflateFrame(frame[4:10])
+	assert.NotEqual(t, nil, err)
+}
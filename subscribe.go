@@ -0,0 +1,166 @@
+package opentick
+
+import (
+	"bytes"
+	"errors"
+	"github.com/apple/foundationdb/bindings/go/src/fdb"
+	"github.com/apple/foundationdb/bindings/go/src/fdb/subspace"
+	"github.com/apple/foundationdb/bindings/go/src/fdb/tuple"
+	"strconv"
+	"sync"
+)
+
+// Rows committed by BatchInsert and BulkLoad of this server are pushed to the
+// subscriptions of their table whose key prefix they fall in, as the select of
+// the subscription would return them. Rows written through other servers on
+// the same cluster are not seen, an FDB watch only tells that a key changed.
+
+// Commits waiting for a subscriber, beyond it the subscriber is dropped
+const subscriptionQueue = 1024
+
+var errSlowSubscriber = errors.New("Subscriber too slow, unsubscribed")
+
+type subscription struct {
+	db       fdb.Transactor
+	stmt     *selectStmt
+	prefix   []byte // packed = conditions
+	queue    chan [][2]tuple.Tuple
+	once     sync.Once
+	overflow bool // set before queue is closed
+}
+
+type subscriptionsS struct {
+	mutex  sync.RWMutex
+	tables map[string]map[*subscription]bool
+}
+
+var subscriptions = subscriptionsS{tables: make(map[string]map[*subscription]bool)}
+
+func tableKey(scheme *TableScheme) string {
+	return scheme.DbName + "." + scheme.TblName
+}
+
+// Subscribe calls push with no rows once subscribed, then with the rows of
+// stmt committed from then on in commit order, until cancel is called or an
+// error ends it. The conditions must all be = on a primary key prefix, limit
+// is ignored.
+func Subscribe(db fdb.Transactor, stmt *selectStmt, args []interface{}, push func(rows [][]interface{}, err error)) (cancel func(), err error) {
+	if stmt.Aggs != nil {
+		err = errors.New("Aggregated selects cannot be subscribed")
+		return
+	}
+	if stmt.NumPlaceholders != len(args) {
+		err = errors.New("Expected " + strconv.FormatInt(int64(stmt.NumPlaceholders), 10) + " arguments, got " + strconv.FormatInt(int64(len(args)), 10))
+		return
+	}
+	conds := stmt.Conds
+	if len(args) > 0 {
+		conds, err = validateConditionArgs(stmt.Scheme, conds, args)
+		if err != nil {
+			return
+		}
+	}
+	var sub subspace.Subspace = stmt.Scheme.Dir
+	for _, c := range conds {
+		if c.IsRange() {
+			err = errors.New("Subscriptions only take = conditions on primary keys")
+			return
+		}
+		sub = sub.Sub(c.Equal)
+	}
+	s := &subscription{db: db, stmt: stmt, prefix: sub.Bytes(), queue: make(chan [][2]tuple.Tuple, subscriptionQueue)}
+	subscriptions.add(s)
+	go func() {
+		push(nil, nil)
+		for recs := range s.queue {
+			if len(s.stmt.Adjs) > 0 {
+				// adjusted in place, the values are shared by the subscriptions
+				for i := range recs {
+					recs[i][1] = append(tuple.Tuple(nil), recs[i][1]...)
+				}
+			}
+			if err := applyFunc(s.db, s.stmt, recs); err != nil {
+				push(nil, err)
+				subscriptions.remove(s, false)
+				return
+			}
+			push(selectRows(s.stmt, recs), nil)
+		}
+		if s.overflow {
+			push(nil, errSlowSubscriber)
+		}
+	}()
+	cancel = func() { subscriptions.remove(s, false) }
+	return
+}
+
+func (self *subscriptionsS) add(s *subscription) {
+	key := tableKey(s.stmt.Scheme)
+	self.mutex.Lock()
+	subs := self.tables[key]
+	if subs == nil {
+		subs = make(map[*subscription]bool)
+		self.tables[key] = subs
+	}
+	subs[s] = true
+	self.mutex.Unlock()
+}
+
+func (self *subscriptionsS) remove(s *subscription, overflow bool) {
+	key := tableKey(s.stmt.Scheme)
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	s.once.Do(func() {
+		s.overflow = overflow
+		close(s.queue)
+		subs := self.tables[key]
+		delete(subs, s)
+		if len(subs) == 0 {
+			delete(self.tables, key)
+		}
+	})
+}
+
+// Whether commits to scheme are to be published
+func (self *subscriptionsS) watching(scheme *TableScheme) bool {
+	self.mutex.RLock()
+	defer self.mutex.RUnlock()
+	return len(self.tables[tableKey(scheme)]) > 0
+}
+
+// Queues the rows of kvs, committed to scheme, to the subscriptions matching
+// them, without waiting for any subscriber
+func (self *subscriptionsS) publish(scheme *TableScheme, kvs []fdb.KeyValue) {
+	var slow []*subscription
+	recs := make([][2]tuple.Tuple, len(kvs)) // unpacked once matched
+	self.mutex.RLock()
+	for s := range self.tables[tableKey(scheme)] {
+		var matched [][2]tuple.Tuple
+		for i, kv := range kvs {
+			if !bytes.HasPrefix(kv.Key, s.prefix) {
+				continue
+			}
+			if recs[i][0] == nil {
+				key, err1 := scheme.Dir.Unpack(kv.Key)
+				value, err2 := tuple.Unpack(kv.Value)
+				if err1 != nil || err2 != nil {
+					continue
+				}
+				recs[i] = [2]tuple.Tuple{key, value}
+			}
+			matched = append(matched, recs[i])
+		}
+		if len(matched) == 0 {
+			continue
+		}
+		select {
+		case s.queue <- matched:
+		default:
+			slow = append(slow, s)
+		}
+	}
+	self.mutex.RUnlock()
+	for _, s := range slow {
+		self.remove(s, true)
+	}
+}
@@ -0,0 +1,35 @@
+package opentick
+
+import (
+	"github.com/apple/foundationdb/bindings/go/src/fdb"
+	"github.com/stretchr/testify/assert"
+	"testing"
+)
+
+func Test_Subscribe(t *testing.T) {
+	fdb.MustAPIVersion(FdbVersion)
+	var db = fdb.MustOpenDefault()
+	DropDatabase(db, "test")
+	CreateDatabase(db, "test")
+	ast, _ := Parse("create table test.sub(sec int, tm int, v double, primary key(sec, tm))")
+	assert.Equal(t, nil, CreateTable(db, "", ast.Create.Table))
+	ast, _ = Parse("select tm, v from test.sub where sec=?")
+	stmt, _ := resolveSelect(db, "", ast.Select)
+	pushed := make(chan [][]interface{}, 10)
+	cancel, err := Subscribe(db, &stmt, []interface{}{1}, func(rows [][]interface{}, err error) { pushed <- rows })
+	assert.Equal(t, nil, err)
+	assert.Equal(t, [][]interface{}(nil), <-pushed)
+	assert.Equal(t, true, subscriptions.watching(stmt.Scheme))
+	ast, _ = Parse("insert into test.sub(sec, tm, v) values(?, ?, ?)")
+	ins, _ := resolveInsert(db, "", ast.Insert)
+	err = BatchInsert(db, &ins, [][]interface{}{{1, 1, 1.5}, {2, 1, 2.5}, {1, 2, 3.5}})
+	assert.Equal(t, nil, err)
+	assert.Equal(t, [][]interface{}{{int64(1), 1.5}, {int64(2), 3.5}}, <-pushed)
+	cancel()
+	assert.Equal(t, false, subscriptions.watching(stmt.Scheme))
+	ast, _ = Parse("select tm from test.sub where sec=1 and tm>1")
+	stmt, _ = resolveSelect(db, "", ast.Select)
+	_, err = Subscribe(db, &stmt, nil, nil)
+	assert.Equal(t, "Subscriptions only take = conditions on primary keys", err.Error())
+	DropDatabase(db, "test")
+}